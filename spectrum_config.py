@@ -86,6 +86,29 @@ else:
     # Default legend names - will be overridden by filenames if count doesn't match
     legend_names = ['Sample A', 'Sample B', 'Sample C']
 
+# Derived curves over the legend names, e.g. {'B - A': '{Sample B} - {Sample A}'}
+expressions = {}
+plot_series = []     # Names to draw and export; empty draws every input and expression
+
+# Stick overlay and hover picking in the interactive viewer
+stick_overlay = False
+stick_axis = False   # Show sticks as oscillator/rotatory strength on the right axis
+hover_states = 5
+
+# Analytic derivative spectra and CSV export of every plotted series
+derivatives = []     # e.g. [1, 2] for d/dx and d2/dx2
+export_data = False
+
+# Many snapshot spectra as one ensemble: median line with shaded quantile bands
+ensemble = False
+ensemble_bands = [[0.05, 0.95]]
+ensemble_rank_error = 0.005
+
+# Band maxima: labels on the plot and a CSV table
+peak_labels = 0      # e.g. 5 to label the most prominent bands
+peak_prominence = 0.05
+peak_table = False
+
 # Advanced conditional settings
 # You can even read environment variables or external files
 if os.getenv('SPECTRUM_HIGH_RES'):
@@ -111,7 +134,7 @@ if os.path.exists(external_config_file):
     exec(open(external_config_file).read())
 
 # Validation and error checking
-valid_modes = ['abs', 'emi', 'cd', 'cdl']
+valid_modes = ['abs', 'emi', 'cd', 'cdl', 'ir', 'raman', 'dos', 'xas', 'vibronic', 'aggregate', 'esa', 'polarized', 'ld', 'rt', 'scan', 'overlap', 'similarity', 'color', 'descriptors']
 valid_units = ['nm', 'eV', 'cm-1']
 valid_formats = ['svg', 'png', 'jpg', 'jpeg', 'eps', 'pdf']
 
@@ -165,6 +188,13 @@ interval = 1.0
 fwhm_ev = 0.2
 output_format = 'png'
 legend_names = ['Ex 280nm', 'Ex 320nm']
+emi_root = 0                    # TD-opt outputs: followed root (0 reads iroot)
+emi_lineshape = 'mlj'           # Marcus-Levich-Jortner band shape
+mlj_lambda_s_ev = 0.1
+mlj_lambda_v_ev = 0.2
+mlj_mode_ev = 0.18
+soc_states = False              # True: spin-orbit states with merged sublevels
+soc_merge_tolerance_ev = 1e-3
 
 # For circular dichroism:
 mode = 'cd'
@@ -176,6 +206,130 @@ fwhm_ev = 0.3
 output_format = 'eps'
 legend_names = ['Native', 'Denatured']
 
+# For IR spectra from a BDF frequency calculation:
+mode = 'ir'                     # or 'raman'
+unit = 'cm-1'
+x_start = 400
+x_end = 4000
+interval = 1.0
+vib_fwhm_cm = 10.0
+freq_scale = 0.97
+
+# For total and projected density of states:
+mode = 'dos'
+unit = 'eV'
+x_start = -20
+x_end = 5
+interval = 0.01
+fwhm_ev = 0.3
+
+# For core-level XAS relative to the edge:
+mode = 'xas'
+unit = 'eV'
+xas_edge_ev = 400.0             # x axis is E - 400 eV
+x_start = -10
+x_end = 20
+interval = 0.02
+fwhm_ev = 0.5
+xas_window = [385, 430]         # roots outside are never stored
+
+# For vibronically resolved bands from Huang-Rhys factors:
+mode = 'vibronic'
+unit = 'nm'
+x_start = 300
+x_end = 450
+interval = 0.5
+fwhm_ev = 0.02
+kT_eV = 0.0257                  # hot bands at room temperature
+vibronic_emission = False
+
+# For excitation energies along a geometry scan:
+mode = 'scan'
+scan_states = 5
+scan_track = 'continuity'       # 'energy', 'number' or 'continuity'
+scan_swaps = []                 # e.g. [[40, 1, 2]] to swap states 1 and 2 from point 40
+scan_quantity = 'energy'        # or 'osc'
+scan_heatmap = False
+
+# For real-time TDDFT dipole traces (time, mu_x, mu_y, mu_z in a.u.):
+mode = 'rt'
+unit = 'eV'
+x_start = 2
+x_end = 10
+fwhm_ev = 0.1
+rt_kick_strength = 1e-3
+rt_window = 'exponential'
+rt_pade = True                  # high resolution from short traces
+
+# For polarized absorption ('polarized') or linear dichroism ('ld'):
+mode = 'ld'
+unit = 'nm'
+x_start = 200
+x_end = 600
+fwhm_ev = 0.3
+orientation_averaging = 'uniaxial'   # 'fixed' (with orientation_euler), 'uniaxial' or 'isotropic'
+orientation_axis = [0, 0, 1]
+order_parameter = 0.8
+
+# For transient absorption (pump-probe) from state-to-state transitions:
+mode = 'esa'
+unit = 'nm'
+x_start = 300
+x_end = 1200
+fwhm_ev = 0.2
+esa_states = [1, 2]
+esa_populations = [0.6, 0.2]
+esa_bleach = True
+
+# For exciton aggregates built from a monomer state:
+mode = 'aggregate'
+unit = 'nm'
+x_start = 300
+x_end = 500
+fwhm_ev = 0.05
+aggregate_state = 1
+aggregate_lattice = [20, 20, 1]
+aggregate_spacing = [5.0, 5.0, 3.5]   # Å
+# aggregate_sites = 'sites.txt'       # or one "x y z [ux uy uz [offset_ev]]" line per site
+aggregate_coupling = 'point'          # or 'extended' with aggregate_dipole_length
+# aggregate_cutoff = 30.0             # Å; couplings beyond are dropped, 0 keeps all
+aggregate_disorder_ev = 0.05
+aggregate_realizations = 100
+
+# For FRET overlap integrals (input files are donors):
+mode = 'overlap'
+unit = 'nm'
+x_start = 250
+x_end = 800
+overlap_acceptors = ['acceptor1.out', 'acceptor2.out']
+overlap_top_pairs = 20
+
+# For all-pairs similarity of many spectra, e.g. functionals or conformers:
+mode = 'similarity'
+similarity_spectrum = 'abs'
+similarity_metric = 'pearson'
+similarity_linkage = 'average'
+similarity_heatmap = True
+
+# For the perceived color of a dye library (CSV plus SVG swatch sheet):
+mode = 'color'
+color_spectrum = 'abs'          # or 'emi'
+color_illuminant = 'D65'
+color_peak_absorbance = 1.0
+unit = 'nm'
+x_start = 300
+x_end = 800
+
+# For descriptor tables in high-throughput screening (no plot):
+mode = 'descriptors'
+unit = 'nm'
+x_start = 200
+x_end = 800
+descriptors = ['peak', 'peak_height', 'onset', 'f_total', 's1', 'bands', 'cd_signs', 'peaks']
+descriptor_bands = [[300, 400], [400, 500]]
+# descriptor_onset_fraction = 0.1  # onset: red edge at this fraction of the peak height
+# descriptor_cd_states = 3         # states in the CD sign pattern
+
 # For energy domain plots:
 mode = 'abs'
 unit = 'eV'
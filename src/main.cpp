@@ -1,39 +1,64 @@
 #include <vtkAxis.h>
+#include <vtkCallbackCommand.h>
 #include <vtkChartLegend.h>
 #include <vtkChartXY.h>
 #include <vtkColorSeries.h>
+#include <vtkContext2D.h>
+#include <vtkContextScene.h>
 #include <vtkContextView.h>
 #include <vtkDoubleArray.h>
 #include <vtkGL2PSExporter.h>
+#include <vtkImageData.h>
 #include <vtkJPEGWriter.h>
+#include <vtkObjectFactory.h>
 #include <vtkPNGWriter.h>
 #include <vtkPen.h>
 #include <vtkPlot.h>
+#include <vtkPlotArea.h>
+#include <vtkRect.h>
 #include <vtkRenderWindow.h>
 #include <vtkRenderWindowInteractor.h>
 #include <vtkRenderer.h>
 #include <vtkSmartPointer.h>
 #include <vtkTable.h>
 #include <vtkTextProperty.h>
+#include <vtkTooltipItem.h>
+#include <vtkTransform2D.h>
 #include <vtkWindowToImageFilter.h>
 
 #include <iostream>
+#include <array>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <cmath>
+#include <random>
+#include <complex>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
 #include <iomanip>
 #include <stdexcept>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <numeric>
 #include <limits>
 #include <filesystem>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <Python.h>
 
 
 using namespace std;
 
+constexpr const char* PLOTSPEC_VERSION = "1.1.0";
+
 // Constants for spectral calculations
 constexpr double EV_TO_CM_MINUS_1 = 8065.54477;
 constexpr double NM_EV_PRODUCT = 1239.84186;
@@ -42,6 +67,53 @@ constexpr double PREFAC_BROADENING_BASE = 1.0 / 4.33e-9;
 constexpr double PREFAC_ECD_BASE = EV_TO_CM_MINUS_1 / 22.9;
 constexpr double KB_EV_PER_K = 1.3806504e-23 / 1.602176487e-19;
 constexpr double ROOM_TEMP_K = 298.15;
+constexpr double FWHM_TO_SIGMA = 0.42466090014400953; // 1 / (2 sqrt(2 ln 2))
+constexpr double GAUSSIAN_WINDOW_SIGMAS = 6.0;
+constexpr size_t BROADENING_MIN_CHUNK = 512; // grid points per broadening thread
+constexpr size_t LARGE_N_STICKS = 4096;       // stick count above which sticks are coalesced
+constexpr double STICK_MERGE_SIGMA_FRACTION = 0.05;
+constexpr size_t VIBRONIC_MAX_FFT_POINTS = size_t(1) << 22;
+constexpr double MLJ_POISSON_TAIL = 1e-6; // Poisson weight left out of truncated MLJ progressions
+constexpr size_t MLJ_MAX_QUANTA = 200;
+constexpr size_t RT_MAX_FFT_POINTS = size_t(1) << 24;
+constexpr size_t RT_PADE_MAX_POINTS = 2049;     // samples fitted by the Pade approximant
+constexpr size_t RT_PADE_MIN_CHUNK = 64;        // grid points per Pade evaluation thread
+constexpr double RT_PADE_NYQUIST_MARGIN = 2.0;  // decimated Nyquist frequency over the grid maximum
+constexpr const char* TDOPT_CYCLE_MARKER = "Geometry Optimization step";
+constexpr std::streamoff BACKWARD_SCAN_BLOCK = 1 << 16;
+constexpr size_t TDOPT_HEADER_LINES = 2000; // lines searched for the echoed iroot
+constexpr double SCAN_OSC_WEIGHT_EV = 0.5; // eV of energy mismatch per unit oscillator strength change
+constexpr double HARTREE_TO_EV = 27.211386245988;
+constexpr double BOHR_TO_ANGSTROM = 0.529177210903;
+constexpr size_t AGGREGATE_DENSE_MAX_SITES = 1000; // larger aggregates use the kernel polynomial method
+constexpr size_t AGGREGATE_MIN_CHUNK = 256;        // sites per coupling-assembly thread
+constexpr uint64_t AGGREGATE_DISORDER_SEED = 20240601;
+constexpr size_t KPM_MAX_MOMENTS = 8192;
+constexpr double KPM_EDGE_MARGIN = 0.01;
+constexpr double KPM_RESOLUTION_FRACTION = 0.125; // kernel resolution relative to the Gaussian sigma
+constexpr size_t GEMM_TILE_ROWS = 64;   // rows of each operand per cache tile, a multiple of 4
+constexpr size_t GEMM_TILE_DEPTH = 256; // shared dimension per cache tile
+constexpr double COLOR_VISIBLE_MIN_NM = 380.0;
+constexpr double COLOR_VISIBLE_MAX_NM = 780.0;
+constexpr double COLOR_D65_STEP_NM = 10.0;
+constexpr double COLOR_D65_SPD[] = { // CIE standard illuminant D65, 380-780 nm
+    49.9755, 54.6482, 82.7549, 91.486, 93.4318, 86.6823, 104.865, 117.008, 117.812, 114.861, 115.923,
+    108.811, 109.354, 107.802, 104.79, 107.689, 104.405, 104.046, 100.0, 96.3342, 95.788, 88.6856,
+    90.0062, 89.5991, 87.6987, 83.2886, 83.6992, 80.0268, 80.2146, 82.2778, 78.2842, 69.7213, 71.6091,
+    74.349, 61.604, 69.8856, 75.087, 63.5927, 46.4182, 66.8054, 63.3828 };
+constexpr double COLOR_A_TEMPERATURE_K = 2856.0;
+constexpr double PLANCK_C2_NM_K = 1.4387769e7;
+constexpr double SRGB_WHITE_XYZ[3] = { 0.95047, 1.0, 1.08883 };
+constexpr size_t DESCRIPTOR_MAX_ITERATIONS = 200;      // mean-shift and bisection steps
+constexpr double DESCRIPTOR_TOLERANCE_SIGMA = 1e-6;    // convergence of peak and onset, in line widths
+constexpr double DESCRIPTOR_CD_MIN_FRACTION = 0.01;    // |R| relative to the largest for a CD sign
+constexpr size_t PEAK_LABEL_STATES = 2;       // dominant states named in a peak label
+constexpr float PEAK_LABEL_GAP_PX = 4.0f;     // spacing between a peak, its label and other labels
+constexpr int PEAK_LABEL_FONT_SIZE = 10;
+constexpr double PEAK_LABEL_HEADROOM = 0.3;   // y-axis padding, relative to the data range, kept for labels
+constexpr size_t EXPRESSION_BLOCK_SIZE = 256; // grid points per block of the fused expression pass
+constexpr size_t QUANTILE_BUFFER_FACTOR = 5;  // values buffered per unit of compression before merging
+constexpr double ENSEMBLE_BAND_OPACITY = 0.25; // fill opacity of ensemble quantile bands
 
 // Structure to hold spectral calculation parameters
 struct PlotSpecParams {
@@ -54,10 +126,203 @@ struct PlotSpecParams {
     double fwhm_cm_minus_1 = 0.5 * EV_TO_CM_MINUS_1;
     std::vector<std::string> input_filenames;
     std::vector<std::string> legend_names;
+    std::vector<std::string> expression_names; // derived series over the legend names, e.g. 'B - A'
+    std::vector<std::string> expressions;
+    std::vector<std::string> plot_series;      // names drawn and exported; empty draws all
     std::string output_format = "svg";
     std::string output_filename = "spectrum_plot";
     bool interactive = true;
+    bool force_render = false;
+    std::string render_hash; // content hash of parameters and inputs, set at startup
+    std::string batch_manifest;
+    bool resume = false;
     double kT_eV = ROOM_TEMP_K * KB_EV_PER_K;
+    double freq_scale = 1.0;
+    bool vibronic_emission = false;
+    double rt_kick_strength = 1e-3;     // delta-kick field strength of rt traces (a.u.)
+    std::string rt_window = "gaussian"; // damping window of rt traces: gaussian or exponential
+    bool rt_pade = false;
+    int scan_states = 5;                 // tracked states of a geometry scan
+    std::string scan_track = "energy";   // energy, number or continuity
+    std::vector<std::vector<int>> scan_swaps; // {point, a, b}: swap tracked states a and b from point on
+    std::string scan_quantity = "energy"; // energy or osc
+    bool scan_heatmap = false;
+    int emi_root = 0;                  // root followed by an excited-state optimization, 0 to read iroot
+    bool soc_states = false;           // read spin-orbit-coupled states instead of scalar TDDFT states
+    double soc_merge_tolerance_ev = 1e-3; // sublevels closer than this are merged, 0 to keep all
+    std::string emi_lineshape = "gaussian"; // gaussian or mlj
+    double mlj_lambda_s_ev = 0.1;  // low-frequency and solvent reorganization energy
+    double mlj_lambda_v_ev = 0.2;  // reorganization energy of the effective high-frequency mode
+    double mlj_mode_ev = 0.18;     // energy of the effective high-frequency mode
+    std::string orientation_averaging = "fixed"; // fixed, uniaxial or isotropic
+    std::vector<double> orientation_euler = {0.0, 0.0, 0.0}; // ZYZ Euler angles (degrees), molecule to lab
+    std::vector<double> orientation_axis = {0.0, 0.0, 1.0};  // molecular axis ordered along lab z
+    double order_parameter = 1.0;
+    std::vector<int> esa_states = {1};         // reference states of excited-state absorption
+    std::vector<double> esa_populations = {1.0}; // fraction of molecules in each reference state
+    bool esa_bleach = true;
+    std::string aggregate_sites;         // sites file; empty to use aggregate_lattice
+    std::vector<int> aggregate_lattice;  // sites along x, y and z
+    std::vector<double> aggregate_spacing = {5.0, 5.0, 5.0}; // Å
+    int aggregate_state = 1;             // monomer state forming the excitons
+    std::string aggregate_coupling = "point";
+    double aggregate_dipole_length_angstrom = 0.0;
+    double aggregate_cutoff_angstrom = 30.0;
+    double aggregate_disorder_ev = 0.0;  // standard deviation of the site energies
+    int aggregate_realizations = 1;
+    std::vector<std::string> overlap_acceptors; // acceptor outputs of overlap; empty to pair donors with themselves
+    int overlap_top_pairs = 20;
+    std::string similarity_spectrum = "abs"; // mode of the spectra compared by similarity
+    std::string similarity_metric = "cosine"; // cosine or pearson
+    std::string similarity_linkage = "none";  // none, single, complete or average
+    bool similarity_heatmap = false;
+    std::string color_spectrum = "abs";  // abs (transmitted light) or emi (emitted light)
+    std::string color_illuminant = "D65"; // D65, A or E
+    double color_peak_absorbance = 1.0;  // absorbance at the absorption maximum
+    std::vector<std::string> descriptors = {"peak", "peak_height", "onset", "f_total", "s1"};
+    std::vector<std::vector<double>> descriptor_bands; // {start, end} in the display unit
+    double descriptor_onset_fraction = 0.1;  // onset: red edge at this fraction of the peak height
+    int descriptor_cd_states = 3;            // states in the CD sign pattern
+    double xas_edge_ev = 0.0;       // origin of an edge-relative xas axis, 0 for absolute energies
+    double xas_window_min_ev = 0.0; // roots parsed for xas; an empty window uses the plotted range
+    double xas_window_max_ev = 0.0;
+    double vib_fwhm_cm_minus_1 = 10.0;
+    bool stick_overlay = false;
+    bool stick_axis = false;
+    int hover_states = 5;
+    std::vector<int> derivatives;  // orders (1, 2) of analytic derivative series added to Gaussian spectra
+    int peak_labels = 0;           // most prominent band maxima labelled per spectrum
+    double peak_prominence = 0.05; // minimum prominence relative to the largest |y|
+    bool peak_table = false;       // write detected band maxima as <output_filename>_peaks.csv
+    bool export_data = false;      // also write the plotted series as <output_filename>_data.csv
+    bool ensemble = false;         // all inputs form one ensemble drawn as median and quantile bands
+    std::vector<std::vector<double>> ensemble_bands = { { 0.05, 0.95 } }; // {lower, upper} quantiles
+    double ensemble_rank_error = 0.005; // quantile error bound at the median, sets the sketch size
+};
+
+// Excited states parsed from BDF TDDFT output, stored column-wise and sorted
+// by energy so broadening, stick overlays and hover picking can use binary search
+struct ExcitedStateStore {
+    std::string source_file;
+    std::vector<double> energy_ev;
+    std::vector<double> osc_strength;
+    std::vector<double> rot_strength_len;
+    std::vector<double> rot_strength_vel;
+    // Transition dipole moments (a.u.), zero unless the output prints them
+    std::vector<double> dipole_x;
+    std::vector<double> dipole_y;
+    std::vector<double> dipole_z;
+    bool has_transition_dipoles = false;
+    std::vector<int> state_number;
+    // Section index into the output file: the summary table row of each state
+    // and, when printed, its detailed orbital-composition block (-1 if absent)
+    std::vector<std::streamoff> summary_offset;
+    std::vector<std::streamoff> detail_offset;
+    // Orbital-composition text, loaded from the file only when requested
+    mutable std::unordered_map<size_t, std::string> composition_cache;
+
+    size_t size() const { return energy_ev.size(); }
+};
+
+// Harmonic normal modes parsed from a BDF frequency calculation, stored
+// column-wise and sorted by scaled frequency
+struct VibrationalModeStore {
+    std::vector<double> frequency_cm;
+    std::vector<double> ir_intensity;   // km/mol
+    std::vector<double> raman_activity; // Å^4/amu
+
+    size_t size() const { return frequency_cm.size(); }
+};
+
+// Molecular orbitals parsed from a BDF output, sorted by energy. Projections
+// are stored orbital-major with one weight per projection label.
+struct OrbitalStore {
+    std::vector<double> energy_ev;
+    std::vector<double> occupation;
+    std::vector<double> projection;
+    std::vector<std::string> projection_labels;
+
+    size_t size() const { return energy_ev.size(); }
+};
+
+// Excitation energies of every point of a geometry scan: one flat column set
+// in which point p owns rows point_start[p] .. point_start[p + 1], sorted by
+// energy within each point
+struct ScanStore {
+    std::vector<double> coordinate;
+    std::vector<size_t> point_start;
+    std::vector<double> energy_ev;
+    std::vector<double> osc_strength;
+    std::vector<int> state_number;
+
+    size_t size() const { return coordinate.size(); }
+};
+
+// State-to-state transitions between excited states, stored column-wise and
+// sorted by transition energy
+struct StateTransitionStore {
+    std::vector<int> initial_state;
+    std::vector<int> final_state;
+    std::vector<double> energy_ev;
+    std::vector<double> osc_strength;
+
+    size_t size() const { return energy_ev.size(); }
+};
+
+// Real-time TDDFT dipole response after a delta kick: uniform time step
+// (a.u.) and one induced-dipole column per kick polarization
+struct DipoleTrace {
+    double time_step = 0.0;
+    std::vector<std::vector<double>> dipole;
+
+    size_t size() const { return dipole.empty() ? 0 : dipole.front().size(); }
+};
+
+// Displaced harmonic oscillator model of one electronic transition: 0-0
+// energy and per-mode frequencies of both states with Huang-Rhys factors
+struct VibronicModel {
+    double adiabatic_energy_ev = 0.0;
+    std::vector<double> ground_frequency_cm;
+    std::vector<double> excited_frequency_cm;
+    std::vector<double> huang_rhys;
+
+    size_t size() const { return huang_rhys.size(); }
+};
+
+// Sites of a molecular aggregate, stored column-wise: positions (Å), unit
+// orientations of the monomer transition dipole and site-energy offsets (eV)
+struct AggregateSites {
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> z;
+    std::vector<double> ux;
+    std::vector<double> uy;
+    std::vector<double> uz;
+    std::vector<double> energy_offset_ev;
+
+    size_t size() const { return x.size(); }
+};
+
+// Symmetric sparse matrix in compressed-row form with both triangles stored
+struct SparseSymmetricMatrix {
+    std::vector<size_t> row_start;
+    std::vector<size_t> column;
+    std::vector<double> value;
+};
+
+// A band maximum (or minimum of a negative CD band) of a computed spectrum
+struct SpectrumPeak {
+    double x = 0.0;           // position refined between grid points
+    double height = 0.0;
+    double prominence = 0.0;
+    std::vector<size_t> states; // dominant contributing states, most important first
+};
+
+// A shaded band between two curves, e.g. quantiles of an ensemble
+struct SpectrumBand {
+    std::vector<double> lower;
+    std::vector<double> upper;
+    std::string label;
 };
 
 // Spectral data structure
@@ -67,6 +332,15 @@ struct SpectrumData {
     std::string x_label;
     std::string y_label;
     std::string title;
+    ExcitedStateStore states;
+    VibrationalModeStore modes;
+    OrbitalStore orbitals;
+    VibronicModel vibronic;
+    // Additional curves drawn with the main one, e.g. projected DOS
+    std::vector<std::vector<double>> extra_y_values;
+    std::vector<std::string> extra_labels;
+    std::vector<SpectrumPeak> peaks;
+    std::vector<SpectrumBand> bands;
 };
 
 // Utility functions
@@ -91,6 +365,61 @@ bool ends_with(const std::string& value, const std::string& ending) {
     return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
 }
 
+bool starts_with_integer(const std::string& line, int& value) {
+    std::istringstream iss(line);
+    std::string token;
+    if (!(iss >> token)) return false;
+    if (token.find_first_not_of("0123456789") != std::string::npos) return false;
+    // from_chars reports digit runs too long for an int instead of throwing
+    auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+    return result.ec == std::errc();
+}
+
+bool parse_double_token(const std::string& token, double& value) {
+    try {
+        size_t pos = 0;
+        value = std::stod(token, &pos);
+        return pos == token.size();
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool is_vibrational_mode(const std::string& mode) {
+    return mode == "ir" || mode == "raman";
+}
+
+// Modes that write tables for a whole set of inputs instead of plotting spectra
+bool is_table_mode(const std::string& mode) {
+    return mode == "overlap" || mode == "similarity" || mode == "color" || mode == "descriptors";
+}
+
+// Offset from a grid coordinate to the absolute axis value; nonzero only for
+// edge-relative xas energy axes
+double x_axis_offset(const PlotSpecParams& params) {
+    return params.mode == "xas" && params.unit == "eV" ? params.xas_edge_ev : 0.0;
+}
+
+// Convert a grid coordinate in the display unit to wavenumber (cm-1)
+double x_to_wavenumber(double x, const std::string& unit) {
+    if (unit == "nm") {
+        return 1.0e7 / x;
+    } else if (unit == "eV") {
+        return x * EV_TO_CM_MINUS_1;
+    }
+    return x;
+}
+
+// Convert a wavenumber (cm-1) to a grid coordinate in the display unit
+double wavenumber_to_x(double wavenumber, const std::string& unit) {
+    if (unit == "nm") {
+        return 1.0e7 / wavenumber;
+    } else if (unit == "eV") {
+        return wavenumber / EV_TO_CM_MINUS_1;
+    }
+    return wavenumber;
+}
+
 void print_usage() {
     std::cout << "Usage: plotspec [options] file1.out file2.out ..." << std::endl;
     std::cout << "" << std::endl;
@@ -101,18 +430,54 @@ void print_usage() {
     std::cout << "Command line options:" << std::endl;
     std::cout << " -config=path                  Use specific config file" << std::endl;
     std::cout << " -no-interactive               Disable interactive viewer" << std::endl;
+    std::cout << " -force                        Render even if the output is up to date" << std::endl;
+    std::cout << " -batch=manifest               Run one figure per manifest line:" << std::endl;
+    std::cout << "                               output_name input1.out input2.out ..." << std::endl;
+    std::cout << " -resume                       Skip batch jobs recorded as done in the journal" << std::endl;
     std::cout << " -help                         Show this help message" << std::endl;
     std::cout << "" << std::endl;
     std::cout << "Example config file (spectrum_config.py):" << std::endl;
-    std::cout << "  mode = 'abs'                 # abs, emi, cd, cdl" << std::endl;
+    std::cout << "  mode = 'abs'                 # abs, emi, cd, cdl, ir, raman, dos, xas, vibronic, aggregate, esa, polarized, ld, rt, scan, overlap, similarity, color, descriptors" << std::endl;
     std::cout << "  unit = 'nm'                  # nm, eV, cm-1" << std::endl;
     std::cout << "  x_start = 200                # Start of range" << std::endl;
     std::cout << "  x_end = 1000                 # End of range" << std::endl;
     std::cout << "  interval = 1.0               # Grid interval" << std::endl;
     std::cout << "  fwhm_ev = 0.5                # FWHM in eV" << std::endl;
+    std::cout << "  vib_fwhm_cm = 10.0           # FWHM in cm-1 for ir/raman" << std::endl;
+    std::cout << "  freq_scale = 0.97            # Frequency scaling factor for ir/raman" << std::endl;
+    std::cout << "  kT_eV = 0.0257               # Thermal energy for emi and vibronic" << std::endl;
+    std::cout << "  scan_track = 'continuity'    # State tracking along a geometry scan" << std::endl;
+    std::cout << "  rt_pade = True               # Pade-accelerated transform of rt dipole traces" << std::endl;
+    std::cout << "  soc_states = True            # Spin-orbit states, sublevels merged (abs, emi)" << std::endl;
+    std::cout << "  emi_lineshape = 'mlj'        # Marcus-Levich-Jortner band shape for emi" << std::endl;
+    std::cout << "  vibronic_emission = False    # Vibronic emission instead of absorption" << std::endl;
+    std::cout << "  orientation_averaging = 'fixed'  # fixed, uniaxial or isotropic (polarized, ld)" << std::endl;
+    std::cout << "  esa_states = [1, 2]          # Reference states for excited-state absorption" << std::endl;
+    std::cout << "  esa_populations = [0.8, 0.2] # Population of each reference state" << std::endl;
+    std::cout << "  aggregate_lattice = [10, 10, 1]  # Aggregate sites (or aggregate_sites = 'sites.txt')" << std::endl;
+    std::cout << "  aggregate_disorder_ev = 0.05 # Static site-energy disorder for aggregates" << std::endl;
+    std::cout << "  overlap_acceptors = ['a.out']  # Acceptors paired with the input donors (overlap)" << std::endl;
+    std::cout << "  overlap_top_pairs = 20       # Largest overlaps listed for overlap" << std::endl;
+    std::cout << "  similarity_metric = 'cosine' # cosine or pearson (similarity)" << std::endl;
+    std::cout << "  similarity_linkage = 'average'  # Hierarchical clustering of the similarity matrix" << std::endl;
+    std::cout << "  color_spectrum = 'abs'       # Perceived color of abs (transmitted) or emi spectra (color)" << std::endl;
+    std::cout << "  descriptors = ['peak', 'onset']  # Columns of the descriptor table (descriptors)" << std::endl;
+    std::cout << "  xas_window = [395, 420]      # Roots parsed for xas (eV)" << std::endl;
+    std::cout << "  xas_edge_ev = 400.0          # Plot xas relative to this edge (eV)" << std::endl;
     std::cout << "  output_format = 'svg'        # svg, png, jpg, eps, pdf" << std::endl;
     std::cout << "  output_filename = 'spectrum' # Output filename (no extension)" << std::endl;
     std::cout << "  legend_names = ['A', 'B']    # Legend names for multiple files" << std::endl;
+    std::cout << "  expressions = {'B - A': 'B - A', 'norm': 'A / max(A)'}  # Derived series" << std::endl;
+    std::cout << "  plot_series = ['A', 'B - A'] # Series drawn and exported (default: all)" << std::endl;
+    std::cout << "  ensemble = True              # Inputs as one ensemble: median and quantile bands" << std::endl;
+    std::cout << "  ensemble_bands = [[0.05, 0.95]]  # Shaded quantile bands of the ensemble" << std::endl;
+    std::cout << "  stick_overlay = True         # Draw excited-state sticks under curves" << std::endl;
+    std::cout << "  stick_axis = True            # Sticks on a secondary f/R axis" << std::endl;
+    std::cout << "  hover_states = 5             # States listed when hovering a band" << std::endl;
+    std::cout << "  derivatives = [1, 2]         # Analytic d/dx and d2/dx2 series" << std::endl;
+    std::cout << "  export_data = True           # Also write the plotted series as CSV" << std::endl;
+    std::cout << "  peak_labels = 5              # Label the most prominent band maxima" << std::endl;
+    std::cout << "  peak_table = True            # Write detected band maxima as CSV" << std::endl;
 }
 
 // Function to initialize Python interpreter
@@ -151,6 +516,30 @@ double get_python_double(PyObject* obj) {
     return 0.0;
 }
 
+// Helper function to get Python object value as bool
+bool get_python_bool(PyObject* obj) {
+    int truth = PyObject_IsTrue(obj);
+    if (truth < 0) {
+        PyErr_Clear();
+        return false;
+    }
+    return truth == 1;
+}
+
+// Helper function to get Python list as vector of doubles
+std::vector<double> get_python_double_list(PyObject* obj) {
+    std::vector<double> result;
+    if (PyList_Check(obj) || PyTuple_Check(obj)) {
+        PyObject* sequence = PySequence_Fast(obj, "expected a sequence");
+        Py_ssize_t size = PySequence_Fast_GET_SIZE(sequence);
+        for (Py_ssize_t i = 0; i < size; ++i) {
+            result.push_back(get_python_double(PySequence_Fast_GET_ITEM(sequence, i)));
+        }
+        Py_DECREF(sequence);
+    }
+    return result;
+}
+
 // Helper function to get Python list as vector of strings
 std::vector<std::string> get_python_string_list(PyObject* obj) {
     std::vector<std::string> result;
@@ -230,296 +619,4776 @@ PlotSpecParams read_config_file(const std::string& config_path) {
             params.fwhm_cm_minus_1 = get_python_double(fwhm_obj) * EV_TO_CM_MINUS_1;
         }
 
-        PyObject* format_obj = PyDict_GetItemString(module_dict, "output_format");
-        if (format_obj) {
-            params.output_format = get_python_string(format_obj);
+        PyObject* vib_fwhm_obj = PyDict_GetItemString(module_dict, "vib_fwhm_cm");
+        if (vib_fwhm_obj) {
+            params.vib_fwhm_cm_minus_1 = get_python_double(vib_fwhm_obj);
         }
 
-        PyObject* filename_obj = PyDict_GetItemString(module_dict, "output_filename");
-        if (filename_obj) {
-            params.output_filename = get_python_string(filename_obj);
+        PyObject* freq_scale_obj = PyDict_GetItemString(module_dict, "freq_scale");
+        if (freq_scale_obj) {
+            params.freq_scale = get_python_double(freq_scale_obj);
         }
 
-        PyObject* legend_obj = PyDict_GetItemString(module_dict, "legend_names");
-        if (legend_obj) {
-            params.legend_names = get_python_string_list(legend_obj);
+        PyObject* kT_obj = PyDict_GetItemString(module_dict, "kT_eV");
+        if (kT_obj) {
+            params.kT_eV = get_python_double(kT_obj);
+            if (params.kT_eV < 0.0) {
+                throw std::runtime_error("kT_eV must be non-negative");
+            }
         }
 
-        Py_DECREF(config_module);
+        PyObject* vibronic_emission_obj = PyDict_GetItemString(module_dict, "vibronic_emission");
+        if (vibronic_emission_obj) {
+            params.vibronic_emission = get_python_bool(vibronic_emission_obj);
+        }
 
-    } catch (...) {
-        finalize_python();
-        throw;
-    }
+        PyObject* kick_obj = PyDict_GetItemString(module_dict, "rt_kick_strength");
+        if (kick_obj) {
+            params.rt_kick_strength = get_python_double(kick_obj);
+        }
 
-    finalize_python();
+        PyObject* rt_window_obj = PyDict_GetItemString(module_dict, "rt_window");
+        if (rt_window_obj) {
+            params.rt_window = get_python_string(rt_window_obj);
+        }
 
-    // Set default interval if not specified
-    if (!params.user_set_interval) {
-        if (params.unit == "cm-1") {
-            params.interval = 100.0;
-        } else if (params.unit == "eV") {
-            params.interval = 0.01;
-        } else {
-            params.interval = 1.0;
+        PyObject* pade_obj = PyDict_GetItemString(module_dict, "rt_pade");
+        if (pade_obj) {
+            params.rt_pade = get_python_bool(pade_obj);
         }
-    }
 
-    return params;
-}
+        PyObject* scan_states_obj = PyDict_GetItemString(module_dict, "scan_states");
+        if (scan_states_obj) {
+            params.scan_states = static_cast<int>(get_python_double(scan_states_obj));
+        }
 
-// Function to find and load config file
-std::string find_config_file() {
-    // 1. Check current directory
-    std::string local_config = "./spectrum_config.py";
-    if (std::filesystem::exists(local_config)) {
-        return local_config;
-    }
+        PyObject* scan_track_obj = PyDict_GetItemString(module_dict, "scan_track");
+        if (scan_track_obj) {
+            params.scan_track = get_python_string(scan_track_obj);
+        }
 
-    // 2. Check home directory
-    const char* home = getenv("HOME");
-    if (home) {
-        std::string home_config = std::string(home) + "/spectrum_config.py";
-        if (std::filesystem::exists(home_config)) {
-            return home_config;
+        PyObject* scan_swaps_obj = PyDict_GetItemString(module_dict, "scan_swaps");
+        if (scan_swaps_obj && (PyList_Check(scan_swaps_obj) || PyTuple_Check(scan_swaps_obj))) {
+            PyObject* sequence = PySequence_Fast(scan_swaps_obj, "expected a sequence");
+            for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(sequence); ++i) {
+                std::vector<int> swap;
+                for (double value : get_python_double_list(PySequence_Fast_GET_ITEM(sequence, i))) {
+                    swap.push_back(static_cast<int>(value));
+                }
+                params.scan_swaps.push_back(swap);
+            }
+            Py_DECREF(sequence);
         }
-    }
 
-    throw std::runtime_error("Config file not found. Please create spectrum_config.py in current directory or home directory.");
-}
+        PyObject* scan_quantity_obj = PyDict_GetItemString(module_dict, "scan_quantity");
+        if (scan_quantity_obj) {
+            params.scan_quantity = get_python_string(scan_quantity_obj);
+        }
 
-PlotSpecParams parse_arguments(int argc, char* argv[]) {
-    if (argc == 1) {
-        print_usage();
-        exit(1);
-    }
+        PyObject* scan_heatmap_obj = PyDict_GetItemString(module_dict, "scan_heatmap");
+        if (scan_heatmap_obj) {
+            params.scan_heatmap = get_python_bool(scan_heatmap_obj);
+        }
 
-    std::string config_file_path;
-    std::vector<std::string> input_files;
-    bool interactive = true;
+        PyObject* emi_root_obj = PyDict_GetItemString(module_dict, "emi_root");
+        if (emi_root_obj) {
+            params.emi_root = static_cast<int>(get_python_double(emi_root_obj));
+        }
 
-    // Parse command line for config file and options
-    for (int i = 1; i < argc; ++i) {
-        std::string arg = argv[i];
+        PyObject* soc_obj = PyDict_GetItemString(module_dict, "soc_states");
+        if (soc_obj) {
+            params.soc_states = get_python_bool(soc_obj);
+        }
 
-        if (arg == "-help" || arg == "--help") {
-            print_usage();
-            exit(0);
-        } else if (arg == "-no-interactive") {
-            interactive = false;
-        } else if (arg.substr(0, 8) == "-config=") {
-            config_file_path = arg.substr(8);
-        } else {
-            // Assume it's an input file
-            input_files.push_back(arg);
+        PyObject* soc_tolerance_obj = PyDict_GetItemString(module_dict, "soc_merge_tolerance_ev");
+        if (soc_tolerance_obj) {
+            params.soc_merge_tolerance_ev = get_python_double(soc_tolerance_obj);
         }
-    }
 
-    if (input_files.empty()) {
-        throw std::runtime_error("No input files provided");
-    }
+        PyObject* lineshape_obj = PyDict_GetItemString(module_dict, "emi_lineshape");
+        if (lineshape_obj) {
+            params.emi_lineshape = get_python_string(lineshape_obj);
+        }
 
-    // Find config file if not specified
-    if (config_file_path.empty()) {
-        config_file_path = find_config_file();
-    }
+        PyObject* lambda_s_obj = PyDict_GetItemString(module_dict, "mlj_lambda_s_ev");
+        if (lambda_s_obj) {
+            params.mlj_lambda_s_ev = get_python_double(lambda_s_obj);
+        }
 
-    // Read configuration
-    PlotSpecParams params = read_config_file(config_file_path);
+        PyObject* lambda_v_obj = PyDict_GetItemString(module_dict, "mlj_lambda_v_ev");
+        if (lambda_v_obj) {
+            params.mlj_lambda_v_ev = get_python_double(lambda_v_obj);
+        }
 
-    // Override with command line options
-    params.input_filenames = input_files;
-    params.interactive = interactive;
+        PyObject* mlj_mode_obj = PyDict_GetItemString(module_dict, "mlj_mode_ev");
+        if (mlj_mode_obj) {
+            params.mlj_mode_ev = get_python_double(mlj_mode_obj);
+        }
 
-    // If no legend names in config or wrong number, use filenames
-    if (params.legend_names.empty() || params.legend_names.size() != input_files.size()) {
-        params.legend_names.clear();
-        for (const auto& filename : input_files) {
-            std::string name = std::filesystem::path(filename).stem().string();
-            params.legend_names.push_back(name);
+        PyObject* averaging_obj = PyDict_GetItemString(module_dict, "orientation_averaging");
+        if (averaging_obj) {
+            params.orientation_averaging = get_python_string(averaging_obj);
         }
-    }
 
-    std::cout << "Using config file: " << config_file_path << std::endl;
-    return params;
-}
+        PyObject* euler_obj = PyDict_GetItemString(module_dict, "orientation_euler");
+        if (euler_obj) {
+            params.orientation_euler = get_python_double_list(euler_obj);
+        }
 
-// Function to calculate spectrum from single BDF output file
-SpectrumData calculate_single_spectrum(const std::string& filename, const PlotSpecParams& params, int file_index) {
-    // Try to open input file
-    std::ifstream infile;
-    std::string full_filename = filename;
-    infile.open(full_filename);
+        PyObject* axis_obj = PyDict_GetItemString(module_dict, "orientation_axis");
+        if (axis_obj) {
+            params.orientation_axis = get_python_double_list(axis_obj);
+        }
 
-    if (!infile.is_open()) {
-        if (!ends_with(filename, ".out") && !ends_with(filename, ".log")) {
-            full_filename = filename + ".out";
-            infile.open(full_filename);
-            if (!infile.is_open()) {
-                full_filename = filename + ".log";
-                infile.open(full_filename);
+        PyObject* order_obj = PyDict_GetItemString(module_dict, "order_parameter");
+        if (order_obj) {
+            params.order_parameter = get_python_double(order_obj);
+        }
+
+        PyObject* esa_states_obj = PyDict_GetItemString(module_dict, "esa_states");
+        if (esa_states_obj) {
+            params.esa_states.clear();
+            for (double state : get_python_double_list(esa_states_obj)) {
+                params.esa_states.push_back(static_cast<int>(state));
             }
         }
-    }
 
-    if (!infile.is_open()) {
-        throw std::runtime_error("Cannot open BDF output file: " + filename);
-    }
+        PyObject* esa_populations_obj = PyDict_GetItemString(module_dict, "esa_populations");
+        if (esa_populations_obj) {
+            params.esa_populations = get_python_double_list(esa_populations_obj);
+        } else if (esa_states_obj) {
+            params.esa_populations.assign(params.esa_states.size(), 1.0 / std::max<size_t>(params.esa_states.size(), 1));
+        }
 
-    std::cout << "Processing: " << full_filename << std::endl;
+        PyObject* esa_bleach_obj = PyDict_GetItemString(module_dict, "esa_bleach");
+        if (esa_bleach_obj) {
+            params.esa_bleach = get_python_bool(esa_bleach_obj);
+        }
 
-    SpectrumData spectrum;
+        PyObject* sites_obj = PyDict_GetItemString(module_dict, "aggregate_sites");
+        if (sites_obj) {
+            params.aggregate_sites = get_python_string(sites_obj);
+        }
 
-    // Generate x-axis values
-    double current_x = params.x_start;
-    while (current_x <= params.x_end + 1e-8) {
-        spectrum.x_values.push_back(current_x);
-        current_x += params.interval;
-    }
+        PyObject* lattice_obj = PyDict_GetItemString(module_dict, "aggregate_lattice");
+        if (lattice_obj) {
+            params.aggregate_lattice.clear();
+            for (double count : get_python_double_list(lattice_obj)) {
+                params.aggregate_lattice.push_back(static_cast<int>(count));
+            }
+        }
 
-    // For demonstration, create synthetic spectrum with slight variations per file
-    spectrum.y_values.resize(spectrum.x_values.size(), 0.0);
+        PyObject* spacing_obj = PyDict_GetItemString(module_dict, "aggregate_spacing");
+        if (spacing_obj) {
+            params.aggregate_spacing = get_python_double_list(spacing_obj);
+        }
 
-    // Add file-specific variation to create different spectra
-    double shift_factor = file_index * 20.0; // Shift peaks slightly for different files
-    double intensity_factor = 1.0 - file_index * 0.15; // Vary intensity
+        PyObject* aggregate_state_obj = PyDict_GetItemString(module_dict, "aggregate_state");
+        if (aggregate_state_obj) {
+            params.aggregate_state = static_cast<int>(get_python_double(aggregate_state_obj));
+        }
 
-    if (params.mode == "abs") {
-        for (size_t i = 0; i < spectrum.x_values.size(); ++i) {
-            double x = spectrum.x_values[i];
-            double intensity = 0.0;
-
-            if (params.unit == "nm") {
-                intensity += intensity_factor * 15000 * exp(-pow((x - 280 - shift_factor) / 15, 2));
-                intensity += intensity_factor * 12000 * exp(-pow((x - 320 - shift_factor) / 20, 2));
-                intensity += intensity_factor * 8000 * exp(-pow((x - 420 - shift_factor) / 25, 2));
-                intensity += intensity_factor * 5000 * exp(-pow((x - 520 - shift_factor) / 30, 2));
-            } else if (params.unit == "eV") {
-                double eV_shift = shift_factor / 1000.0; // Convert to eV scale
-                intensity += intensity_factor * 15000 * exp(-pow((x - 3.1 - eV_shift) / 0.15, 2));
-                intensity += intensity_factor * 12000 * exp(-pow((x - 3.9 - eV_shift) / 0.2, 2));
-                intensity += intensity_factor * 8000 * exp(-pow((x - 4.4 - eV_shift) / 0.1, 2));
-            } else if (params.unit == "cm-1") {
-                double cm_shift = shift_factor * 100; // Convert to cm-1 scale
-                intensity += intensity_factor * 15000 * exp(-pow((x - 25000 - cm_shift) / 2000, 2));
-                intensity += intensity_factor * 12000 * exp(-pow((x - 31000 - cm_shift) / 1500, 2));
-                intensity += intensity_factor * 8000 * exp(-pow((x - 35000 - cm_shift) / 1000, 2));
-            }
-
-            spectrum.y_values[i] = intensity;
+        PyObject* coupling_obj = PyDict_GetItemString(module_dict, "aggregate_coupling");
+        if (coupling_obj) {
+            params.aggregate_coupling = get_python_string(coupling_obj);
         }
-        spectrum.y_label = "Molar Absorptivity (L/(mol·cm))";
-        spectrum.title = "Absorption Spectra";
 
-    } else if (params.mode == "emi") {
-        for (size_t i = 0; i < spectrum.x_values.size(); ++i) {
-            double x = spectrum.x_values[i];
-            double intensity = 0.0;
+        PyObject* dipole_length_obj = PyDict_GetItemString(module_dict, "aggregate_dipole_length");
+        if (dipole_length_obj) {
+            params.aggregate_dipole_length_angstrom = get_python_double(dipole_length_obj);
+        }
 
-            if (params.unit == "nm") {
-                intensity += intensity_factor * 0.9 * exp(-pow((x - 350 - shift_factor) / 20, 2));
-                intensity += intensity_factor * 0.7 * exp(-pow((x - 450 - shift_factor) / 25, 2));
-                intensity += intensity_factor * 0.5 * exp(-pow((x - 550 - shift_factor) / 30, 2));
-            } else if (params.unit == "eV") {
-                double eV_shift = shift_factor / 1000.0;
-                intensity += intensity_factor * 0.9 * exp(-pow((x - 2.8 - eV_shift) / 0.15, 2));
-                intensity += intensity_factor * 0.7 * exp(-pow((x - 3.2 - eV_shift) / 0.2, 2));
-                intensity += intensity_factor * 0.5 * exp(-pow((x - 3.6 - eV_shift) / 0.1, 2));
-            }
+        PyObject* cutoff_obj = PyDict_GetItemString(module_dict, "aggregate_cutoff");
+        if (cutoff_obj) {
+            params.aggregate_cutoff_angstrom = get_python_double(cutoff_obj);
+        }
 
-            spectrum.y_values[i] = intensity;
+        PyObject* disorder_obj = PyDict_GetItemString(module_dict, "aggregate_disorder_ev");
+        if (disorder_obj) {
+            params.aggregate_disorder_ev = get_python_double(disorder_obj);
         }
-        spectrum.y_label = "Emission Intensity (arb. units)";
-        spectrum.title = "Emission Spectra";
 
-    } else if (params.mode == "cd" || params.mode == "cdl") {
-        for (size_t i = 0; i < spectrum.x_values.size(); ++i) {
-            double x = spectrum.x_values[i];
-            double intensity = 0.0;
+        PyObject* realizations_obj = PyDict_GetItemString(module_dict, "aggregate_realizations");
+        if (realizations_obj) {
+            params.aggregate_realizations = static_cast<int>(get_python_double(realizations_obj));
+        }
 
-            if (params.unit == "nm") {
-                intensity += intensity_factor * 50 * exp(-pow((x - 260 - shift_factor) / 15, 2));
-                intensity -= intensity_factor * 40 * exp(-pow((x - 300 - shift_factor) / 20, 2));
-                intensity += intensity_factor * 30 * exp(-pow((x - 340 - shift_factor) / 18, 2));
-                intensity -= intensity_factor * 20 * exp(-pow((x - 380 - shift_factor) / 25, 2));
-            } else if (params.unit == "eV") {
-                double eV_shift = shift_factor / 1000.0;
-                intensity += intensity_factor * 50 * exp(-pow((x - 4.0 - eV_shift) / 0.15, 2));
-                intensity -= intensity_factor * 40 * exp(-pow((x - 3.5 - eV_shift) / 0.2, 2));
-                intensity += intensity_factor * 30 * exp(-pow((x - 3.0 - eV_shift) / 0.18, 2));
-            }
+        PyObject* acceptors_obj = PyDict_GetItemString(module_dict, "overlap_acceptors");
+        if (acceptors_obj) {
+            params.overlap_acceptors = get_python_string_list(acceptors_obj);
+        }
 
-            spectrum.y_values[i] = intensity;
+        PyObject* top_pairs_obj = PyDict_GetItemString(module_dict, "overlap_top_pairs");
+        if (top_pairs_obj) {
+            params.overlap_top_pairs = static_cast<int>(get_python_double(top_pairs_obj));
         }
-        spectrum.y_label = "Δε (L/(mol·cm))";
-        spectrum.title = "Circular Dichroism Spectra";
-    }
 
-    // Set x-axis label
-    if (params.unit == "nm") {
-        spectrum.x_label = "Wavelength (nm)";
-    } else if (params.unit == "eV") {
-        spectrum.x_label = "Energy (eV)";
-    } else if (params.unit == "cm-1") {
-        spectrum.x_label = "Wavenumber (cm⁻¹)";
-    }
+        PyObject* similarity_spectrum_obj = PyDict_GetItemString(module_dict, "similarity_spectrum");
+        if (similarity_spectrum_obj) {
+            params.similarity_spectrum = get_python_string(similarity_spectrum_obj);
+        }
 
-    return spectrum;
-}
+        PyObject* metric_obj = PyDict_GetItemString(module_dict, "similarity_metric");
+        if (metric_obj) {
+            params.similarity_metric = get_python_string(metric_obj);
+        }
 
-// Function to calculate multiple spectra
-std::vector<SpectrumData> calculate_multiple_spectra(const PlotSpecParams& params) {
-    std::cout << "==================================" << std::endl;
-    std::cout << "   BDF Spectrum Calculator" << std::endl;
-    std::cout << "==================================" << std::endl;
-    std::cout << std::endl;
+        PyObject* linkage_obj = PyDict_GetItemString(module_dict, "similarity_linkage");
+        if (linkage_obj) {
+            params.similarity_linkage = get_python_string(linkage_obj);
+        }
 
-    std::cout << "Mode: " << params.mode << ", Unit: " << params.unit << std::endl;
-    std::cout << "Range: " << params.x_start << " - " << params.x_end << " " << params.unit << std::endl;
-    std::cout << "FWHM: " << std::fixed << std::setprecision(4) << (params.fwhm_cm_minus_1 / EV_TO_CM_MINUS_1) << " eV" << std::endl;
-    std::cout << "Processing " << params.input_filenames.size() << " files..." << std::endl;
-    std::cout << std::endl;
+        PyObject* similarity_heatmap_obj = PyDict_GetItemString(module_dict, "similarity_heatmap");
+        if (similarity_heatmap_obj) {
+            params.similarity_heatmap = get_python_bool(similarity_heatmap_obj);
+        }
 
-    std::vector<SpectrumData> spectra;
+        PyObject* color_spectrum_obj = PyDict_GetItemString(module_dict, "color_spectrum");
+        if (color_spectrum_obj) {
+            params.color_spectrum = get_python_string(color_spectrum_obj);
+        }
 
-    for (size_t i = 0; i < params.input_filenames.size(); ++i) {
-        SpectrumData spectrum = calculate_single_spectrum(params.input_filenames[i], params, i);
-        spectra.push_back(spectrum);
-    }
+        PyObject* illuminant_obj = PyDict_GetItemString(module_dict, "color_illuminant");
+        if (illuminant_obj) {
+            params.color_illuminant = get_python_string(illuminant_obj);
+        }
 
-    std::cout << std::endl;
-    std::cout << "All spectra calculated successfully." << std::endl;
-    std::cout << "Generated " << spectra[0].x_values.size() << " data points per spectrum." << std::endl;
+        PyObject* peak_absorbance_obj = PyDict_GetItemString(module_dict, "color_peak_absorbance");
+        if (peak_absorbance_obj) {
+            params.color_peak_absorbance = get_python_double(peak_absorbance_obj);
+        }
 
-    return spectra;
-}
+        PyObject* descriptors_obj = PyDict_GetItemString(module_dict, "descriptors");
+        if (descriptors_obj) {
+            params.descriptors = get_python_string_list(descriptors_obj);
+        }
 
-// Function to create VTK plot with multiple spectra and export
-void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra, const PlotSpecParams& params) {
-    std::cout << std::endl;
-    std::cout << "Creating visualization with " << spectra.size() << " spectra..." << std::endl;
+        PyObject* bands_obj = PyDict_GetItemString(module_dict, "descriptor_bands");
+        if (bands_obj && (PyList_Check(bands_obj) || PyTuple_Check(bands_obj))) {
+            PyObject* sequence = PySequence_Fast(bands_obj, "expected a sequence");
+            for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(sequence); ++i) {
+                params.descriptor_bands.push_back(get_python_double_list(PySequence_Fast_GET_ITEM(sequence, i)));
+            }
+            Py_DECREF(sequence);
+        }
 
-    auto view = vtkSmartPointer<vtkContextView>::New();
-    view->GetRenderer()->SetBackground(1.0, 1.0, 1.0);
+        PyObject* ensemble_obj = PyDict_GetItemString(module_dict, "ensemble");
+        if (ensemble_obj) {
+            params.ensemble = get_python_bool(ensemble_obj);
+        }
 
-    auto chart = vtkSmartPointer<vtkChartXY>::New();
-    view->GetScene()->AddItem(chart);
-    chart->SetAutoAxes(false);
+        PyObject* ensemble_bands_obj = PyDict_GetItemString(module_dict, "ensemble_bands");
+        if (ensemble_bands_obj && (PyList_Check(ensemble_bands_obj) || PyTuple_Check(ensemble_bands_obj))) {
+            params.ensemble_bands.clear();
+            PyObject* sequence = PySequence_Fast(ensemble_bands_obj, "expected a sequence");
+            for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(sequence); ++i) {
+                params.ensemble_bands.push_back(get_python_double_list(PySequence_Fast_GET_ITEM(sequence, i)));
+            }
+            Py_DECREF(sequence);
+        }
 
-    // Calculate nice round tick positions
-    auto calculateNiceTicks = [](double min_val, double max_val, int target_ticks) -> std::vector<double> {
-        double range = max_val - min_val;
-        double rough_step = range / (target_ticks - 1);
+        PyObject* rank_error_obj = PyDict_GetItemString(module_dict, "ensemble_rank_error");
+        if (rank_error_obj) {
+            params.ensemble_rank_error = get_python_double(rank_error_obj);
+        }
 
-        // Find a nice step size (power of 10 times 1, 2, or 5)
-        double magnitude = std::pow(10, std::floor(std::log10(rough_step)));
-        double normalized = rough_step / magnitude;
-        double nice_step;
+        PyObject* onset_obj = PyDict_GetItemString(module_dict, "descriptor_onset_fraction");
+        if (onset_obj) {
+            params.descriptor_onset_fraction = get_python_double(onset_obj);
+        }
 
-        if (normalized <= 1.0) nice_step = magnitude;
-        else if (normalized <= 2.0) nice_step = 2 * magnitude;
-        else if (normalized <= 5.0) nice_step = 5 * magnitude;
-        else nice_step = 10 * magnitude;
+        PyObject* cd_states_obj = PyDict_GetItemString(module_dict, "descriptor_cd_states");
+        if (cd_states_obj) {
+            params.descriptor_cd_states = static_cast<int>(get_python_double(cd_states_obj));
+        }
+
+        PyObject* edge_obj = PyDict_GetItemString(module_dict, "xas_edge_ev");
+        if (edge_obj) {
+            params.xas_edge_ev = get_python_double(edge_obj);
+        }
+
+        PyObject* window_obj = PyDict_GetItemString(module_dict, "xas_window");
+        if (window_obj) {
+            std::vector<double> window = get_python_double_list(window_obj);
+            if (window.size() == 2) {
+                params.xas_window_min_ev = std::min(window[0], window[1]);
+                params.xas_window_max_ev = std::max(window[0], window[1]);
+            }
+        }
+
+        PyObject* format_obj = PyDict_GetItemString(module_dict, "output_format");
+        if (format_obj) {
+            params.output_format = get_python_string(format_obj);
+        }
+
+        PyObject* filename_obj = PyDict_GetItemString(module_dict, "output_filename");
+        if (filename_obj) {
+            params.output_filename = get_python_string(filename_obj);
+        }
+
+        PyObject* legend_obj = PyDict_GetItemString(module_dict, "legend_names");
+        if (legend_obj) {
+            params.legend_names = get_python_string_list(legend_obj);
+        }
+
+        PyObject* expressions_obj = PyDict_GetItemString(module_dict, "expressions");
+        if (expressions_obj) {
+            // A dict maps series names to expressions; a list names each by its text
+            if (PyDict_Check(expressions_obj)) {
+                PyObject* key = nullptr;
+                PyObject* value = nullptr;
+                Py_ssize_t position = 0;
+                while (PyDict_Next(expressions_obj, &position, &key, &value)) {
+                    params.expression_names.push_back(get_python_string(key));
+                    params.expressions.push_back(get_python_string(value));
+                }
+            } else {
+                params.expressions = get_python_string_list(expressions_obj);
+                params.expression_names = params.expressions;
+            }
+        }
+
+        PyObject* plot_series_obj = PyDict_GetItemString(module_dict, "plot_series");
+        if (plot_series_obj) {
+            params.plot_series = get_python_string_list(plot_series_obj);
+        }
+
+        PyObject* stick_obj = PyDict_GetItemString(module_dict, "stick_overlay");
+        if (stick_obj) {
+            params.stick_overlay = get_python_bool(stick_obj);
+        }
+
+        PyObject* stick_axis_obj = PyDict_GetItemString(module_dict, "stick_axis");
+        if (stick_axis_obj) {
+            params.stick_axis = get_python_bool(stick_axis_obj);
+        }
+
+        PyObject* hover_obj = PyDict_GetItemString(module_dict, "hover_states");
+        if (hover_obj) {
+            params.hover_states = static_cast<int>(get_python_double(hover_obj));
+        }
+
+        PyObject* derivatives_obj = PyDict_GetItemString(module_dict, "derivatives");
+        if (derivatives_obj) {
+            for (double order : get_python_double_list(derivatives_obj)) {
+                params.derivatives.push_back(static_cast<int>(order));
+            }
+        }
+
+        PyObject* export_data_obj = PyDict_GetItemString(module_dict, "export_data");
+        if (export_data_obj) {
+            params.export_data = get_python_bool(export_data_obj);
+        }
+
+        PyObject* peak_labels_obj = PyDict_GetItemString(module_dict, "peak_labels");
+        if (peak_labels_obj) {
+            params.peak_labels = static_cast<int>(get_python_double(peak_labels_obj));
+        }
+
+        PyObject* peak_prominence_obj = PyDict_GetItemString(module_dict, "peak_prominence");
+        if (peak_prominence_obj) {
+            params.peak_prominence = get_python_double(peak_prominence_obj);
+        }
+
+        PyObject* peak_table_obj = PyDict_GetItemString(module_dict, "peak_table");
+        if (peak_table_obj) {
+            params.peak_table = get_python_bool(peak_table_obj);
+        }
+
+        Py_DECREF(config_module);
+
+    } catch (...) {
+        finalize_python();
+        throw;
+    }
+
+    finalize_python();
+
+    if (params.mode == "xas" && params.xas_edge_ev != 0.0 && params.unit != "eV") {
+        throw std::runtime_error("Edge-relative xas axes require unit = 'eV'");
+    }
+
+    if (params.mode == "scan") {
+        if (params.scan_track != "energy" && params.scan_track != "number" && params.scan_track != "continuity") {
+            throw std::runtime_error("scan_track must be 'energy', 'number' or 'continuity'");
+        }
+        if (params.scan_quantity != "energy" && params.scan_quantity != "osc") {
+            throw std::runtime_error("scan_quantity must be 'energy' or 'osc'");
+        }
+    }
+
+    if (params.mode == "rt") {
+        if (params.rt_window != "gaussian" && params.rt_window != "exponential") {
+            throw std::runtime_error("rt_window must be 'gaussian' or 'exponential'");
+        }
+        if (params.rt_kick_strength == 0.0) {
+            throw std::runtime_error("rt_kick_strength must be non-zero");
+        }
+    }
+
+    if (params.soc_states && params.mode != "abs" && params.mode != "emi") {
+        throw std::runtime_error("soc_states is supported in modes 'abs' and 'emi' only");
+    }
+
+    if (params.mode == "emi" && params.emi_lineshape != "gaussian" && params.emi_lineshape != "mlj") {
+        throw std::runtime_error("emi_lineshape must be 'gaussian' or 'mlj'");
+    }
+    if (params.mode == "emi" && params.emi_lineshape == "mlj" &&
+        (params.mlj_mode_ev <= 0.0 || params.mlj_lambda_v_ev < 0.0 || params.mlj_lambda_s_ev < 0.0)) {
+        throw std::runtime_error("MLJ emission requires mlj_mode_ev > 0 and non-negative reorganization energies");
+    }
+
+    if (params.mode == "polarized" || params.mode == "ld") {
+        if (params.orientation_averaging != "fixed" && params.orientation_averaging != "uniaxial" &&
+            params.orientation_averaging != "isotropic") {
+            throw std::runtime_error("orientation_averaging must be 'fixed', 'uniaxial' or 'isotropic'");
+        }
+        if (params.orientation_euler.size() != 3 || params.orientation_axis.size() != 3) {
+            throw std::runtime_error("orientation_euler and orientation_axis must have 3 elements");
+        }
+        if (params.orientation_axis[0] == 0.0 && params.orientation_axis[1] == 0.0 && params.orientation_axis[2] == 0.0) {
+            throw std::runtime_error("orientation_axis must be non-zero");
+        }
+    }
+
+    if (params.mode == "esa" && (params.esa_states.empty() || params.esa_states.size() != params.esa_populations.size())) {
+        throw std::runtime_error("esa_states and esa_populations must be non-empty lists of equal length");
+    }
+
+    if (params.mode == "aggregate") {
+        if (params.aggregate_coupling != "point" && params.aggregate_coupling != "extended") {
+            throw std::runtime_error("aggregate_coupling must be 'point' or 'extended'");
+        }
+        if (params.aggregate_coupling == "extended" && params.aggregate_dipole_length_angstrom <= 0.0) {
+            throw std::runtime_error("Extended-dipole coupling requires aggregate_dipole_length > 0");
+        }
+        if (params.aggregate_sites.empty() &&
+            (params.aggregate_lattice.size() != 3 || params.aggregate_spacing.size() != 3)) {
+            throw std::runtime_error("Mode 'aggregate' requires aggregate_sites or a 3-element aggregate_lattice and aggregate_spacing");
+        }
+    }
+
+    if (params.mode == "overlap" && params.overlap_top_pairs < 0) {
+        throw std::runtime_error("overlap_top_pairs must be non-negative");
+    }
+
+    if (params.mode == "similarity") {
+        if (params.similarity_metric != "cosine" && params.similarity_metric != "pearson") {
+            throw std::runtime_error("similarity_metric must be 'cosine' or 'pearson'");
+        }
+        if (params.similarity_linkage != "none" && params.similarity_linkage != "single" &&
+            params.similarity_linkage != "complete" && params.similarity_linkage != "average") {
+            throw std::runtime_error("similarity_linkage must be 'none', 'single', 'complete' or 'average'");
+        }
+        if (params.similarity_spectrum == "scan" || is_table_mode(params.similarity_spectrum)) {
+            throw std::runtime_error("similarity_spectrum must be a mode producing a spectrum on the grid");
+        }
+        if (is_vibrational_mode(params.similarity_spectrum) && params.unit != "cm-1") {
+            throw std::runtime_error("Mode '" + params.similarity_spectrum + "' requires unit = 'cm-1'");
+        }
+    }
+
+    if (params.mode == "color") {
+        if (params.color_spectrum != "abs" && params.color_spectrum != "emi") {
+            throw std::runtime_error("color_spectrum must be 'abs' or 'emi'");
+        }
+        if (params.color_illuminant != "D65" && params.color_illuminant != "A" && params.color_illuminant != "E") {
+            throw std::runtime_error("color_illuminant must be 'D65', 'A' or 'E'");
+        }
+        if (params.color_peak_absorbance < 0.0) {
+            throw std::runtime_error("color_peak_absorbance must be non-negative");
+        }
+    }
+
+    if (params.mode == "descriptors") {
+        static const std::set<std::string> known = {"peak", "peak_height", "onset", "f_total", "s1", "bands", "cd_signs",
+                                                    "peaks"};
+        for (const auto& name : params.descriptors) {
+            if (!known.count(name)) {
+                throw std::runtime_error("Unknown descriptor '" + name +
+                                         "'; use peak, peak_height, onset, f_total, s1, bands, cd_signs or peaks");
+            }
+        }
+        for (const auto& band : params.descriptor_bands) {
+            if (band.size() != 2) {
+                throw std::runtime_error("descriptor_bands must be [start, end] pairs");
+            }
+        }
+        if (params.descriptor_onset_fraction <= 0.0 || params.descriptor_onset_fraction >= 1.0) {
+            throw std::runtime_error("descriptor_onset_fraction must be between 0 and 1");
+        }
+    }
+
+    for (int order : params.derivatives) {
+        if (order != 1 && order != 2) {
+            throw std::runtime_error("derivatives may only contain the orders 1 and 2");
+        }
+    }
+
+    if (params.peak_labels < 0 || params.peak_prominence < 0.0) {
+        throw std::runtime_error("peak_labels and peak_prominence must be non-negative");
+    }
+
+    if (params.ensemble) {
+        if (params.mode == "scan" || is_table_mode(params.mode)) {
+            throw std::runtime_error("ensemble is not available in mode '" + params.mode + "'");
+        }
+        for (const auto& band : params.ensemble_bands) {
+            if (band.size() != 2 || band[0] < 0.0 || band[0] >= band[1] || band[1] > 1.0) {
+                throw std::runtime_error("ensemble_bands must be [lower, upper] quantile pairs with 0 <= lower < upper <= 1");
+            }
+        }
+        if (params.ensemble_rank_error <= 0.0 || params.ensemble_rank_error >= 0.5) {
+            throw std::runtime_error("ensemble_rank_error must be between 0 and 0.5");
+        }
+    }
+
+    if (params.mode == "dos" && params.unit != "eV") {
+        throw std::runtime_error("Mode 'dos' requires unit = 'eV'");
+    }
+
+    // Vibrational spectra are broadened on a wavenumber grid
+    if (is_vibrational_mode(params.mode) && params.unit != "cm-1") {
+        throw std::runtime_error("Mode '" + params.mode + "' requires unit = 'cm-1'");
+    }
+
+    // Set default interval if not specified
+    if (!params.user_set_interval) {
+        if (is_vibrational_mode(params.mode)) {
+            params.interval = 1.0;
+        } else if (params.unit == "cm-1") {
+            params.interval = 100.0;
+        } else if (params.unit == "eV") {
+            params.interval = 0.01;
+        } else {
+            params.interval = 1.0;
+        }
+    }
+
+    return params;
+}
+
+// Function to find and load config file
+std::string find_config_file() {
+    // 1. Check current directory
+    std::string local_config = "./spectrum_config.py";
+    if (std::filesystem::exists(local_config)) {
+        return local_config;
+    }
+
+    // 2. Check home directory
+    const char* home = getenv("HOME");
+    if (home) {
+        std::string home_config = std::string(home) + "/spectrum_config.py";
+        if (std::filesystem::exists(home_config)) {
+            return home_config;
+        }
+    }
+
+    throw std::runtime_error("Config file not found. Please create spectrum_config.py in current directory or home directory.");
+}
+
+// Function to use input file stems as legend names when the configured
+// names are missing or do not match the number of inputs
+void assign_legend_names(PlotSpecParams& params) {
+    if (params.ensemble) {
+        // One series for the whole ensemble, named by a single configured name
+        if (params.legend_names.size() != 1) {
+            params.legend_names = { "Median" };
+        }
+        return;
+    }
+    if (params.legend_names.empty() || params.legend_names.size() != params.input_filenames.size()) {
+        params.legend_names.clear();
+        for (const auto& filename : params.input_filenames) {
+            std::string name = std::filesystem::path(filename).stem().string();
+            params.legend_names.push_back(name);
+        }
+    }
+}
+
+PlotSpecParams parse_arguments(int argc, char* argv[]) {
+    if (argc == 1) {
+        print_usage();
+        exit(1);
+    }
+
+    std::string config_file_path;
+    std::string batch_manifest;
+    std::vector<std::string> input_files;
+    bool interactive = true;
+    bool force_render = false;
+    bool resume = false;
+
+    // Parse command line for config file and options
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "-help" || arg == "--help") {
+            print_usage();
+            exit(0);
+        } else if (arg == "-no-interactive") {
+            interactive = false;
+        } else if (arg == "-force") {
+            force_render = true;
+        } else if (arg == "-resume") {
+            resume = true;
+        } else if (arg.substr(0, 8) == "-config=") {
+            config_file_path = arg.substr(8);
+        } else if (arg.substr(0, 7) == "-batch=") {
+            batch_manifest = arg.substr(7);
+        } else {
+            // Assume it's an input file
+            input_files.push_back(arg);
+        }
+    }
+
+    if (input_files.empty() && batch_manifest.empty()) {
+        throw std::runtime_error("No input files provided");
+    }
+
+    // Find config file if not specified
+    if (config_file_path.empty()) {
+        config_file_path = find_config_file();
+    }
+
+    // Read configuration
+    PlotSpecParams params = read_config_file(config_file_path);
+
+    // Override with command line options
+    params.input_filenames = input_files;
+    params.interactive = interactive && batch_manifest.empty();
+    params.force_render = force_render;
+    params.batch_manifest = batch_manifest;
+    params.resume = resume;
+
+    // Batch jobs assign legend names per job
+    if (batch_manifest.empty()) {
+        assign_legend_names(params);
+    }
+
+    std::cout << "Using config file: " << config_file_path << std::endl;
+    return params;
+}
+
+// Function to resolve an input name to an existing BDF output file
+std::string resolve_input_filename(const std::string& filename) {
+    if (std::filesystem::is_regular_file(filename)) {
+        return filename;
+    }
+    if (!ends_with(filename, ".out") && !ends_with(filename, ".log")) {
+        if (std::filesystem::is_regular_file(filename + ".out")) {
+            return filename + ".out";
+        }
+        if (std::filesystem::is_regular_file(filename + ".log")) {
+            return filename + ".log";
+        }
+    }
+    throw std::runtime_error("Cannot open BDF output file: " + filename);
+}
+
+// Function to read the excitation energy and oscillator strength of a TDDFT
+// summary table row: the numbers before its "eV" and after its "nm" columns
+bool parse_summary_row(const std::string& line, double& energy, double& osc) {
+    std::istringstream iss(line);
+    std::vector<std::string> tokens;
+    std::string token;
+    while (iss >> token) {
+        tokens.push_back(token);
+    }
+    auto ev_it = std::find(tokens.begin(), tokens.end(), "eV");
+    auto nm_it = std::find(tokens.begin(), tokens.end(), "nm");
+    return ev_it != tokens.begin() && ev_it != tokens.end() && nm_it != tokens.end() && nm_it + 1 != tokens.end() &&
+           parse_double_token(*(ev_it - 1), energy) && parse_double_token(*(nm_it + 1), osc);
+}
+
+// Function to reorder rows [begin, end) of parallel columns so that row
+// begin + i becomes row order[i], with order holding rows of that range
+template <typename... Columns>
+void permute_columns(size_t begin, size_t end, const std::vector<size_t>& order, Columns&... columns) {
+    auto permute = [&order, begin, end](auto& column) {
+        std::remove_reference_t<decltype(column)> sorted(end - begin);
+        for (size_t i = 0; i < order.size(); ++i) {
+            sorted[i] = column[order[i]];
+        }
+        std::move(sorted.begin(), sorted.end(), column.begin() + begin);
+    };
+    (permute(columns), ...);
+}
+
+// Function to reorder parallel columns so that row i becomes row order[i]
+template <typename... Columns>
+void permute_columns(const std::vector<size_t>& order, Columns&... columns) {
+    permute_columns(0, order.size(), order, columns...);
+}
+
+// Function to get the row order that sorts energies in rows [begin, end)
+// ascending; equal energies keep their order in the file
+std::vector<size_t> energy_order(const std::vector<double>& energy_ev, size_t begin, size_t end) {
+    std::vector<size_t> order(end - begin);
+    std::iota(order.begin(), order.end(), begin);
+    std::stable_sort(order.begin(), order.end(), [&energy_ev](size_t a, size_t b) {
+        return energy_ev[a] < energy_ev[b];
+    });
+    return order;
+}
+
+// Function to get the row order that sorts all energies ascending
+std::vector<size_t> energy_order(const std::vector<double>& energy_ev) {
+    return energy_order(energy_ev, 0, energy_ev.size());
+}
+
+// Function to sort all columns of a store by excitation energy
+void sort_states_by_energy(ExcitedStateStore& store) {
+    permute_columns(energy_order(store.energy_ev), store.energy_ev, store.osc_strength, store.rot_strength_len,
+                    store.rot_strength_vel, store.dipole_x, store.dipole_y, store.dipole_z, store.state_number,
+                    store.summary_offset, store.detail_offset);
+}
+
+// Function to parse excited states from a BDF TDDFT output file.
+// Summary table rows follow the "No. Pair ExSym ExEnergies Wavelengths f ..." header:
+//     1   A    2   A    3.8120 eV   325.25 nm   0.0226   0.0000  97.8%  CO(   1 )   ->  CV(   1 )   4.233  0.621  0.0000
+// Rotatory strength tables start each row with the state number and end it
+// with R(length) and R(velocity) in 10^-40 cgs; transition dipole tables end
+// it with the x, y and z components in a.u. Only file offsets are kept for
+// the orbital-composition text; see load_state_composition(). States outside
+// [min_energy_ev, max_energy_ev] are skipped without being stored. Reading
+// starts at start_offset, e.g. the last cycle of an optimization.
+ExcitedStateStore parse_bdf_excited_states(const std::string& filename,
+                                           double min_energy_ev = std::numeric_limits<double>::lowest(),
+                                           double max_energy_ev = std::numeric_limits<double>::max(),
+                                           std::streamoff start_offset = 0) {
+    std::ifstream infile(filename);
+    if (!infile.is_open()) {
+        throw std::runtime_error("Cannot open BDF output file: " + filename);
+    }
+    infile.seekg(start_offset);
+
+    ExcitedStateStore store;
+    store.source_file = filename;
+
+    enum class Section { NONE, SUMMARY, ROTATORY, DIPOLE };
+    Section section = Section::NONE;
+    size_t rows_in_section = 0;
+    std::unordered_map<int, size_t> block_states; // state number -> row of the current TDDFT block
+
+    std::string line;
+    std::streamoff offset = start_offset;
+    while (std::getline(infile, line)) {
+        std::streamoff line_offset = offset;
+        offset += static_cast<std::streamoff>(line.size()) + 1;
+
+        if (line.find("ExEnergies") != std::string::npos && line.find("Wavelengths") != std::string::npos) {
+            section = Section::SUMMARY;
+            rows_in_section = 0;
+            block_states.clear();
+            continue;
+        }
+
+        std::string lower = to_lower_cpp(line);
+        if (lower.find("rotatory strength") != std::string::npos) {
+            section = Section::ROTATORY;
+            rows_in_section = 0;
+            continue;
+        }
+        if (lower.find("transition dipole") != std::string::npos) {
+            section = Section::DIPOLE;
+            rows_in_section = 0;
+            continue;
+        }
+
+        int number = 0;
+        if (section != Section::NONE && starts_with_integer(line, number)) {
+            std::istringstream iss(line);
+            std::vector<std::string> tokens;
+            std::string token;
+            while (iss >> token) {
+                tokens.push_back(token);
+            }
+
+            if (section == Section::SUMMARY) {
+                double energy = 0.0;
+                double osc = 0.0;
+                if (parse_summary_row(line, energy, osc)) {
+                    ++rows_in_section;
+                    if (energy < min_energy_ev || energy > max_energy_ev) {
+                        continue;
+                    }
+                    block_states[number] = store.size();
+                    store.energy_ev.push_back(energy);
+                    store.osc_strength.push_back(osc);
+                    store.rot_strength_len.push_back(0.0);
+                    store.rot_strength_vel.push_back(0.0);
+                    store.dipole_x.push_back(0.0);
+                    store.dipole_y.push_back(0.0);
+                    store.dipole_z.push_back(0.0);
+                    store.state_number.push_back(number);
+                    store.summary_offset.push_back(line_offset);
+                    store.detail_offset.push_back(-1);
+                }
+            } else {
+                auto state_it = block_states.find(number);
+                std::vector<double> values;
+                for (size_t t = 1; t < tokens.size(); ++t) {
+                    double value = 0.0;
+                    if (parse_double_token(tokens[t], value)) {
+                        values.push_back(value);
+                    }
+                }
+                if (!values.empty()) {
+                    ++rows_in_section;
+                }
+                if (section == Section::DIPOLE) {
+                    if (state_it != block_states.end() && values.size() >= 3) {
+                        size_t row = state_it->second;
+                        store.dipole_x[row] = values[values.size() - 3];
+                        store.dipole_y[row] = values[values.size() - 2];
+                        store.dipole_z[row] = values.back();
+                        store.has_transition_dipoles = true;
+                    }
+                } else if (state_it != block_states.end() && !values.empty()) {
+                    size_t row = state_it->second;
+                    store.rot_strength_len[row] = values.size() >= 2 ? values[values.size() - 2] : values.back();
+                    store.rot_strength_vel[row] = values.back();
+                }
+            }
+            continue;
+        }
+
+        // Blank and column-header lines may precede the rows; any other text ends the table
+        if (section != Section::NONE && rows_in_section > 0 &&
+            line.find_first_not_of(" \t\r") != std::string::npos) {
+            section = Section::NONE;
+        }
+
+        size_t header_pos = lower.find("excited state");
+        if (header_pos != std::string::npos && starts_with_integer(lower.substr(header_pos + 13), number)) {
+            auto state_it = block_states.find(number);
+            if (state_it != block_states.end()) {
+                store.detail_offset[state_it->second] = line_offset;
+            }
+        }
+    }
+
+    sort_states_by_energy(store);
+    return store;
+}
+
+// Function to parse spin-orbit-coupled states from a BDF SOC-TDDFT output.
+// Rows follow a "SOC-SI" or "spin-orbit states" header as
+//     State   Energy(eV)          f    Label
+//         2       2.3412   0.000012    T1
+// with the energy above the ground state first and the oscillator strength
+// second; the ground state (energy 0) is skipped. The store is sorted by
+// energy and shares the column layout of scalar TDDFT states.
+ExcitedStateStore parse_bdf_soc_states(const std::string& filename) {
+    std::ifstream infile(filename);
+    if (!infile.is_open()) {
+        throw std::runtime_error("Cannot open BDF output file: " + filename);
+    }
+
+    ExcitedStateStore store;
+    store.source_file = filename;
+    bool in_table = false;
+    size_t rows_in_table = 0;
+    std::string line;
+    std::streamoff offset = 0;
+    while (std::getline(infile, line)) {
+        std::streamoff line_offset = offset;
+        offset += static_cast<std::streamoff>(line.size()) + 1;
+
+        std::string lower = to_lower_cpp(line);
+        if (lower.find("soc-si") != std::string::npos || lower.find("spin-orbit states") != std::string::npos) {
+            // A later SOC block supersedes earlier ones
+            in_table = true;
+            rows_in_table = 0;
+            store = ExcitedStateStore();
+            store.source_file = filename;
+            continue;
+        }
+
+        bool blank = line.find_first_not_of(" \t\r") == std::string::npos;
+        int number = 0;
+        if (in_table && !blank && starts_with_integer(line, number)) {
+            std::istringstream iss(line);
+            std::string token;
+            iss >> token;
+            std::vector<double> values;
+            double value = 0.0;
+            while (values.size() < 2 && iss >> token) {
+                if (parse_double_token(token, value)) {
+                    values.push_back(value);
+                }
+            }
+            if (values.size() < 2) continue;
+            ++rows_in_table;
+            if (values[0] <= 0.0) continue;
+            store.energy_ev.push_back(values[0]);
+            store.osc_strength.push_back(values[1]);
+            store.rot_strength_len.push_back(0.0);
+            store.rot_strength_vel.push_back(0.0);
+            store.dipole_x.push_back(0.0);
+            store.dipole_y.push_back(0.0);
+            store.dipole_z.push_back(0.0);
+            store.state_number.push_back(number);
+            store.summary_offset.push_back(line_offset);
+            store.detail_offset.push_back(-1);
+            continue;
+        }
+        if (in_table && rows_in_table > 0 && !blank) {
+            in_table = false;
+        }
+    }
+
+    sort_states_by_energy(store);
+    return store;
+}
+
+// Function to merge near-degenerate spin sublevels of an energy-sorted store.
+// Runs of states whose neighbours lie within tolerance_ev become one state at
+// the strength-weighted centroid, keeping the row of the brightest sublevel.
+// With a positive kT_eV, the sublevel strengths are Boltzmann-weighted
+// relative to the merged level, so the population weighting of emi applied to
+// the merged state reproduces the sum over the thermally populated sublevels.
+void merge_spin_sublevels(ExcitedStateStore& states, double tolerance_ev, double kT_eV) {
+    ExcitedStateStore merged;
+    merged.source_file = states.source_file;
+    merged.has_transition_dipoles = states.has_transition_dipoles;
+
+    size_t i = 0;
+    while (i < states.size()) {
+        size_t j = i + 1;
+        while (j < states.size() && states.energy_ev[j] - states.energy_ev[j - 1] <= tolerance_ev) {
+            ++j;
+        }
+
+        double strength = 0.0;
+        double moment = 0.0;
+        size_t brightest = i;
+        for (size_t k = i; k < j; ++k) {
+            strength += states.osc_strength[k];
+            moment += states.osc_strength[k] * states.energy_ev[k];
+            if (states.osc_strength[k] > states.osc_strength[brightest]) {
+                brightest = k;
+            }
+        }
+        double energy = strength > 0.0 ? moment / strength
+                                       : 0.5 * (states.energy_ev[i] + states.energy_ev[j - 1]);
+        if (kT_eV > 0.0) {
+            strength = 0.0;
+            for (size_t k = i; k < j; ++k) {
+                strength += states.osc_strength[k] * std::exp(-(states.energy_ev[k] - energy) / kT_eV);
+            }
+        }
+
+        merged.energy_ev.push_back(energy);
+        merged.osc_strength.push_back(strength);
+        merged.rot_strength_len.push_back(states.rot_strength_len[brightest]);
+        merged.rot_strength_vel.push_back(states.rot_strength_vel[brightest]);
+        merged.dipole_x.push_back(states.dipole_x[brightest]);
+        merged.dipole_y.push_back(states.dipole_y[brightest]);
+        merged.dipole_z.push_back(states.dipole_z[brightest]);
+        merged.state_number.push_back(states.state_number[brightest]);
+        merged.summary_offset.push_back(states.summary_offset[brightest]);
+        merged.detail_offset.push_back(states.detail_offset[brightest]);
+        i = j;
+    }
+    states = std::move(merged);
+}
+
+// Function to parse every TDDFT block of a geometry scan in one streaming
+// pass. A line containing "scan point" opens a point whose coordinate is the
+// last number on that line (the point index if it is the only one); all
+// summary tables up to the next marker belong to that point. Outputs without
+// markers get one point per summary table, numbered from 1.
+ScanStore parse_bdf_scan(const std::string& filename) {
+    std::ifstream infile(filename);
+    if (!infile.is_open()) {
+        throw std::runtime_error("Cannot open BDF output file: " + filename);
+    }
+
+    ScanStore scan;
+    bool markers_seen = false;
+    bool in_table = false;
+    size_t rows_in_table = 0;
+    auto open_point = [&scan](double coordinate) {
+        scan.coordinate.push_back(coordinate);
+        scan.point_start.push_back(scan.energy_ev.size());
+    };
+
+    std::string line;
+    while (std::getline(infile, line)) {
+        std::string lower = to_lower_cpp(line);
+        size_t marker = lower.find("scan point");
+        if (marker != std::string::npos) {
+            std::istringstream iss(line.substr(marker + 10));
+            std::string token;
+            double value = 0.0;
+            std::vector<double> values;
+            while (iss >> token) {
+                if (parse_double_token(token, value)) {
+                    values.push_back(value);
+                }
+            }
+            open_point(values.empty() ? static_cast<double>(scan.size() + 1) : values.back());
+            markers_seen = true;
+            in_table = false;
+            continue;
+        }
+
+        if (line.find("ExEnergies") != std::string::npos && line.find("Wavelengths") != std::string::npos) {
+            if (!markers_seen || scan.size() == 0) {
+                open_point(static_cast<double>(scan.size() + 1));
+            }
+            in_table = true;
+            rows_in_table = 0;
+            continue;
+        }
+
+        int number = 0;
+        if (in_table && starts_with_integer(line, number)) {
+            double energy = 0.0;
+            double osc = 0.0;
+            if (parse_summary_row(line, energy, osc)) {
+                scan.energy_ev.push_back(energy);
+                scan.osc_strength.push_back(osc);
+                scan.state_number.push_back(number);
+                ++rows_in_table;
+            }
+            continue;
+        }
+        if (in_table && rows_in_table > 0 && line.find_first_not_of(" \t\r") != std::string::npos) {
+            in_table = false;
+        }
+    }
+    scan.point_start.push_back(scan.energy_ev.size());
+
+    // Sort the states of each point by energy
+    for (size_t p = 0; p < scan.size(); ++p) {
+        size_t begin = scan.point_start[p];
+        size_t end = scan.point_start[p + 1];
+        permute_columns(begin, end, energy_order(scan.energy_ev, begin, end), scan.energy_ev, scan.osc_strength,
+                        scan.state_number);
+    }
+    return scan;
+}
+
+// Function to assign the states of each scan point to n_curves tracked curves,
+// returning the store row of curve k at point p as tracked[p * n_curves + k]:
+//   energy      k-th lowest state (adiabatic ordering)
+//   number      the state numbers of the k-th lowest states at the first point
+//   continuity  greedy matching to the curves at the previous point by
+//               extrapolated energy and oscillator strength
+// User swaps {point, a, b} (1-based) then exchange curves a and b from that
+// point on.
+std::vector<size_t> track_scan_states(const ScanStore& scan, size_t n_curves, const PlotSpecParams& params) {
+    std::vector<size_t> tracked(scan.size() * n_curves);
+    for (size_t p = 0; p < scan.size(); ++p) {
+        size_t begin = scan.point_start[p];
+        size_t end = scan.point_start[p + 1];
+        size_t* row = &tracked[p * n_curves];
+
+        if (params.scan_track == "number" && p > 0) {
+            for (size_t k = 0; k < n_curves; ++k) {
+                int wanted = scan.state_number[tracked[k]];
+                row[k] = begin + k;
+                for (size_t i = begin; i < end; ++i) {
+                    if (scan.state_number[i] == wanted) {
+                        row[k] = i;
+                        break;
+                    }
+                }
+            }
+        } else if (params.scan_track == "continuity" && p > 0) {
+            const size_t* previous = &tracked[(p - 1) * n_curves];
+            std::vector<std::tuple<double, size_t, size_t>> costs;
+            for (size_t k = 0; k < n_curves; ++k) {
+                double predicted = scan.energy_ev[previous[k]];
+                if (p > 1) {
+                    predicted = 2.0 * predicted - scan.energy_ev[tracked[(p - 2) * n_curves + k]];
+                }
+                for (size_t i = begin; i < end; ++i) {
+                    double cost = std::abs(scan.energy_ev[i] - predicted) +
+                                  SCAN_OSC_WEIGHT_EV * std::abs(scan.osc_strength[i] - scan.osc_strength[previous[k]]);
+                    costs.emplace_back(cost, k, i);
+                }
+            }
+            std::sort(costs.begin(), costs.end());
+            std::vector<bool> curve_done(n_curves, false);
+            std::vector<bool> row_used(end - begin, false);
+            for (const auto& [cost, k, i] : costs) {
+                if (curve_done[k] || row_used[i - begin]) continue;
+                row[k] = i;
+                curve_done[k] = true;
+                row_used[i - begin] = true;
+            }
+        } else {
+            for (size_t k = 0; k < n_curves; ++k) {
+                row[k] = begin + k;
+            }
+        }
+    }
+
+    for (const auto& swap : params.scan_swaps) {
+        if (swap.size() != 3 || swap[1] < 1 || swap[2] < 1 ||
+            static_cast<size_t>(swap[1]) > n_curves || static_cast<size_t>(swap[2]) > n_curves) {
+            std::cerr << "Warning: ignoring invalid scan swap" << std::endl;
+            continue;
+        }
+        for (size_t p = static_cast<size_t>(std::max(swap[0], 1) - 1); p < scan.size(); ++p) {
+            std::swap(tracked[p * n_curves + swap[1] - 1], tracked[p * n_curves + swap[2] - 1]);
+        }
+    }
+    return tracked;
+}
+
+// Function to write a matrix as CSV with one labelled row per entry of
+// row_values and a header listing column_values, replacing the file atomically.
+// A square matrix can be written with its rows and columns permuted by order.
+void write_matrix_csv(const std::string& path, const std::string& corner, const std::vector<double>& row_values,
+                      const std::vector<double>& column_values, const std::vector<double>& matrix,
+                      const std::vector<size_t>& order = {}) {
+    auto row = [&](size_t r) { return order.empty() ? r : order[r]; };
+    auto column = [&](size_t c) { return order.empty() ? c : order[c]; };
+    std::string temp_path = path + ".partial";
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write file: " + path);
+        }
+        out << std::setprecision(10) << corner;
+        for (size_t c = 0; c < column_values.size(); ++c) {
+            out << "," << column_values[column(c)];
+        }
+        out << "\n";
+        for (size_t r = 0; r < row_values.size(); ++r) {
+            out << row_values[row(r)];
+            for (size_t c = 0; c < column_values.size(); ++c) {
+                out << "," << matrix[row(r) * column_values.size() + column(c)];
+            }
+            out << "\n";
+        }
+    }
+    std::filesystem::rename(temp_path, path);
+}
+
+// Function to write a dense row-major matrix as raw binary: rows and columns
+// as uint64, then the values as native doubles, replacing the file atomically
+void write_matrix_binary(const std::string& path, size_t rows, size_t columns, const std::vector<double>& matrix) {
+    std::string temp_path = path + ".partial";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write file: " + path);
+        }
+        uint64_t shape[2] = { rows, columns };
+        out.write(reinterpret_cast<const char*>(shape), sizeof(shape));
+        out.write(reinterpret_cast<const char*>(matrix.data()), static_cast<std::streamsize>(rows * columns * sizeof(double)));
+        if (!out) {
+            throw std::runtime_error("Cannot write file: " + path);
+        }
+    }
+    std::filesystem::rename(temp_path, path);
+}
+
+// Function to find the byte offset of the last occurrence of needle in a file
+// by reading fixed-size blocks backwards from the end, so the cost depends on
+// the distance from the end rather than the file size; returns -1 if absent
+std::streamoff find_last_occurrence(const std::string& filename, const std::string& needle) {
+    std::ifstream infile(filename, std::ios::binary);
+    if (!infile.is_open()) {
+        throw std::runtime_error("Cannot open BDF output file: " + filename);
+    }
+    infile.seekg(0, std::ios::end);
+    std::streamoff end = infile.tellg();
+
+    std::string carry; // start of the block read before, for matches spanning two blocks
+    std::string block;
+    while (end > 0) {
+        std::streamoff start = std::max<std::streamoff>(0, end - BACKWARD_SCAN_BLOCK);
+        block.resize(static_cast<size_t>(end - start));
+        infile.seekg(start);
+        infile.read(&block[0], static_cast<std::streamsize>(block.size()));
+        std::string window = block + carry;
+        size_t found = window.rfind(needle);
+        if (found != std::string::npos) {
+            return start + static_cast<std::streamoff>(found);
+        }
+        carry = block.substr(0, std::min(block.size(), needle.size() - 1));
+        end = start;
+    }
+    return -1;
+}
+
+// Function to find the root followed by an excited-state optimization from the
+// input echoed at the top of a BDF output ("iroot" with its value on the same
+// or the next line); returns 0 if not found
+int find_followed_root(const std::string& filename) {
+    std::ifstream infile(filename);
+    std::string line;
+    bool value_on_next_line = false;
+    for (size_t n = 0; n < TDOPT_HEADER_LINES && std::getline(infile, line); ++n) {
+        std::istringstream iss(line);
+        std::string token;
+        if (value_on_next_line) {
+            int root = 0;
+            return iss >> token && starts_with_integer(token, root) ? root : 0;
+        }
+        std::string lower = to_lower_cpp(line);
+        size_t pos = lower.find("iroot");
+        if (pos == std::string::npos) continue;
+
+        std::istringstream rest(lower.substr(pos + 5));
+        while (rest >> token) {
+            int root = 0;
+            if (token != "=" && starts_with_integer(token, root)) {
+                return root;
+            }
+        }
+        value_on_next_line = true;
+    }
+    return 0;
+}
+
+// Function to keep a single row of an excited-state store
+ExcitedStateStore select_state(const ExcitedStateStore& states, size_t row) {
+    ExcitedStateStore selected;
+    selected.source_file = states.source_file;
+    selected.has_transition_dipoles = states.has_transition_dipoles;
+    selected.energy_ev.push_back(states.energy_ev[row]);
+    selected.osc_strength.push_back(states.osc_strength[row]);
+    selected.rot_strength_len.push_back(states.rot_strength_len[row]);
+    selected.rot_strength_vel.push_back(states.rot_strength_vel[row]);
+    selected.dipole_x.push_back(states.dipole_x[row]);
+    selected.dipole_y.push_back(states.dipole_y[row]);
+    selected.dipole_z.push_back(states.dipole_z[row]);
+    selected.state_number.push_back(states.state_number[row]);
+    selected.summary_offset.push_back(states.summary_offset[row]);
+    selected.detail_offset.push_back(states.detail_offset[row]);
+    return selected;
+}
+
+// Function to extract the dominant-excitation column from a summary table row
+std::string extract_dominant_excitation(const std::string& row) {
+    std::istringstream iss(row);
+    std::vector<std::string> tokens;
+    std::string token;
+    while (iss >> token) {
+        tokens.push_back(token);
+    }
+
+    size_t first = 0;
+    while (first < tokens.size() && tokens[first].find('%') == std::string::npos) {
+        ++first;
+    }
+    // Drop the trailing IPA, Ova and En-E1 columns
+    size_t last = tokens.size();
+    double value = 0.0;
+    for (int k = 0; k < 3 && last > first + 1 && parse_double_token(tokens[last - 1], value); ++k) {
+        --last;
+    }
+
+    std::string result;
+    for (size_t t = first; t < last; ++t) {
+        if (!result.empty()) result += " ";
+        result += tokens[t];
+    }
+    return result;
+}
+
+// Function to load the orbital-composition text of one state on demand.
+// The text is read from the output file at the indexed offset and cached.
+const std::string& load_state_composition(const ExcitedStateStore& states, size_t index) {
+    auto cached = states.composition_cache.find(index);
+    if (cached != states.composition_cache.end()) {
+        return cached->second;
+    }
+
+    std::string composition;
+    std::ifstream infile(states.source_file);
+    std::string line;
+    if (infile.is_open() && states.detail_offset[index] >= 0) {
+        infile.seekg(states.detail_offset[index]);
+        std::getline(infile, line); // section header
+        int lines_read = 0;
+        while (lines_read < 8 && std::getline(infile, line)) {
+            size_t begin = line.find_first_not_of(" \t\r");
+            if (begin == std::string::npos) {
+                if (lines_read > 0) break;
+                continue;
+            }
+            if (to_lower_cpp(line).find("excited state") != std::string::npos) break;
+            size_t end = line.find_last_not_of(" \t\r");
+            if (!composition.empty()) composition += "; ";
+            composition += line.substr(begin, end - begin + 1);
+            ++lines_read;
+        }
+    } else if (infile.is_open()) {
+        infile.seekg(states.summary_offset[index]);
+        if (std::getline(infile, line)) {
+            composition = extract_dominant_excitation(line);
+        }
+    }
+
+    return states.composition_cache.emplace(index, composition).first->second;
+}
+
+// Function to get the stick intensity of one state for the current mode
+double stick_strength(const ExcitedStateStore& states, size_t index, const PlotSpecParams& params) {
+    double energy = states.energy_ev[index];
+    if (params.mode == "cd") {
+        return PREFAC_ECD_BASE * energy * states.rot_strength_vel[index];
+    } else if (params.mode == "cdl") {
+        return PREFAC_ECD_BASE * energy * states.rot_strength_len[index];
+    } else if (params.mode == "emi") {
+        // Boltzmann population of the emitting states, rate scaling as f * E^2;
+        // at T = 0 only the lowest state emits
+        double population = params.kT_eV > 0.0 ? std::exp(-(energy - states.energy_ev.front()) / params.kT_eV)
+                                                : (index == 0 ? 1.0 : 0.0);
+        return population * states.osc_strength[index] * energy * energy;
+    }
+    return PREFAC_BROADENING_BASE * states.osc_strength[index];
+}
+
+// Function to run body(begin, end) over [0, count), split into contiguous
+// chunks across the hardware threads; small ranges run on the calling thread
+template <typename Body>
+void parallel_for_chunks(size_t count, size_t min_chunk, Body body) {
+    size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t n_threads = std::min(hardware_threads, count / std::max<size_t>(min_chunk, 1));
+    if (n_threads <= 1) {
+        body(size_t(0), count);
+        return;
+    }
+
+    size_t chunk = (count + n_threads - 1) / n_threads;
+    std::vector<std::thread> workers;
+    for (size_t begin = 0; begin < count; begin += chunk) {
+        workers.emplace_back(body, begin, std::min(count, begin + chunk));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Function to merge sorted sticks falling into the same bin of width bin_width
+// into one stick at their |strength|-weighted centroid. Summed strengths are
+// exact, the position error is below bin_width, and dark sticks are dropped.
+void coalesce_sticks(const std::vector<double>& positions, const std::vector<double>& strengths, double bin_width,
+                     std::vector<double>& merged_positions, std::vector<double>& merged_strengths) {
+    size_t i = 0;
+    while (i < positions.size()) {
+        double bin = std::floor(positions[i] / bin_width);
+        double sum = 0.0;
+        double weight = 0.0;
+        double moment = 0.0;
+        size_t j = i;
+        for (; j < positions.size() && std::floor(positions[j] / bin_width) == bin; ++j) {
+            double w = std::abs(strengths[j]);
+            sum += strengths[j];
+            weight += w;
+            moment += w * positions[j];
+        }
+        if (weight > 0.0) {
+            merged_positions.push_back(moment / weight);
+            merged_strengths.push_back(sum);
+        }
+        i = j;
+    }
+}
+
+// Function to broaden sticks onto the grid with area-normalized Gaussians.
+// Positions are in cm-1 and sorted ascending; each grid point only visits the
+// sticks inside its cutoff window, and large grids are split across threads.
+// Large stick sets are first coalesced on a grid much finer than the width.
+// When requested, the first and second derivatives with respect to the grid
+// coordinate are accumulated in the same pass from the Gaussian derivatives
+// and the chain rule through x_to_wavenumber.
+std::vector<double> broaden_sticks(const std::vector<double>& positions_cm, const std::vector<double>& strengths,
+                                   const std::vector<double>& x_values, const std::string& unit, double fwhm_cm,
+                                   std::vector<double>* first_derivative = nullptr,
+                                   std::vector<double>* second_derivative = nullptr) {
+    const double sigma = fwhm_cm * FWHM_TO_SIGMA;
+    const double norm = 1.0 / (sigma * std::sqrt(2.0 * PI));
+    const double inv_two_sigma_sq = 1.0 / (2.0 * sigma * sigma);
+    const double inv_sigma_sq = 2.0 * inv_two_sigma_sq;
+    const double window = GAUSSIAN_WINDOW_SIGMAS * sigma;
+    const bool derivatives = first_derivative || second_derivative;
+
+    std::vector<double> merged_positions;
+    std::vector<double> merged_strengths;
+    bool coalesced = positions_cm.size() > LARGE_N_STICKS;
+    if (coalesced) {
+        coalesce_sticks(positions_cm, strengths, sigma * STICK_MERGE_SIGMA_FRACTION, merged_positions, merged_strengths);
+    }
+    const std::vector<double>& positions = coalesced ? merged_positions : positions_cm;
+    const std::vector<double>& weights = coalesced ? merged_strengths : strengths;
+
+    std::vector<double> y_values(x_values.size(), 0.0);
+    if (first_derivative) first_derivative->assign(x_values.size(), 0.0);
+    if (second_derivative) second_derivative->assign(x_values.size(), 0.0);
+    parallel_for_chunks(x_values.size(), BROADENING_MIN_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t g = begin; g < end; ++g) {
+            double wavenumber = x_to_wavenumber(x_values[g], unit);
+            auto first = std::lower_bound(positions.begin(), positions.end(), wavenumber - window);
+            auto last = std::upper_bound(first, positions.end(), wavenumber + window);
+
+            double sum = 0.0;
+            double moment1 = 0.0; // sum of w delta g
+            double moment2 = 0.0; // sum of w delta^2 g
+            for (auto it = first; it != last; ++it) {
+                double delta = wavenumber - *it;
+                double term = weights[static_cast<size_t>(it - positions.begin())] * std::exp(-delta * delta * inv_two_sigma_sq);
+                sum += term;
+                if (derivatives) {
+                    moment1 += term * delta;
+                    moment2 += term * delta * delta;
+                }
+            }
+            y_values[g] = norm * sum;
+
+            if (derivatives) {
+                double dy = -norm * moment1 * inv_sigma_sq;
+                double d2y = norm * (moment2 * inv_sigma_sq - sum) * inv_sigma_sq;
+                double dnu = 1.0;
+                double d2nu = 0.0;
+                if (unit == "nm") {
+                    dnu = -wavenumber / x_values[g];
+                    d2nu = -2.0 * dnu / x_values[g];
+                } else if (unit == "eV") {
+                    dnu = EV_TO_CM_MINUS_1;
+                }
+                if (first_derivative) (*first_derivative)[g] = dy * dnu;
+                if (second_derivative) (*second_derivative)[g] = d2y * dnu * dnu + dy * d2nu;
+            }
+        }
+    });
+    return y_values;
+}
+
+// Function to broaden the excited states of the current mode onto the grid
+std::vector<double> broaden_states(const ExcitedStateStore& states, const std::vector<double>& x_values,
+                                   const PlotSpecParams& params, std::vector<double>* first_derivative = nullptr,
+                                   std::vector<double>* second_derivative = nullptr) {
+    std::vector<double> positions(states.size());
+    std::vector<double> strengths(states.size());
+    for (size_t i = 0; i < states.size(); ++i) {
+        positions[i] = states.energy_ev[i] * EV_TO_CM_MINUS_1;
+        strengths[i] = stick_strength(states, i, params);
+    }
+    return broaden_sticks(positions, strengths, x_values, params.unit, params.fwhm_cm_minus_1,
+                          first_derivative, second_derivative);
+}
+
+// Function to compute a Marcus-Levich-Jortner emission band. Each emitting
+// state contributes a Poisson progression in one effective high-frequency
+// mode (S = lambda_v / hw), each line broadened by the classical low-frequency
+// and solvent reorganization lambda_s:
+//   I(E) ~ E^3 |mu|^2 sum_n e^-S S^n / n! exp(-(E00 - lambda_s - n hw - E)^2 / (4 lambda_s kT))
+// with E00 = E_vertical + lambda_s + lambda_v. Poisson weights follow by
+// recurrence and the sum stops once the remaining tail is below
+// MLJ_POISSON_TAIL, so all lines of all states share one broadening pass.
+std::vector<double> mlj_emission(const ExcitedStateStore& states, const std::vector<double>& x_values,
+                                 const PlotSpecParams& params) {
+    const double huang_rhys = params.mlj_lambda_v_ev / params.mlj_mode_ev;
+    const double sigma_ev = std::sqrt(2.0 * params.mlj_lambda_s_ev * params.kT_eV);
+    // Without a classical width (lambda_s or kT zero) the lines take fwhm_ev
+    const double fwhm_cm = sigma_ev > 0.0 ? sigma_ev / FWHM_TO_SIGMA * EV_TO_CM_MINUS_1 : params.fwhm_cm_minus_1;
+
+    // Truncated Poisson progression, shared by all states
+    std::vector<double> poisson;
+    double weight = std::exp(-huang_rhys);
+    double remaining = 1.0;
+    for (size_t n = 0; remaining > MLJ_POISSON_TAIL && n < MLJ_MAX_QUANTA; ++n) {
+        poisson.push_back(weight);
+        remaining -= weight;
+        weight *= huang_rhys / static_cast<double>(n + 1);
+    }
+
+    // Lines of all states, |mu|^2 ~ f / E; positions descend within each progression
+    std::vector<std::pair<double, double>> lines;
+    lines.reserve(states.size() * poisson.size());
+    for (size_t i = 0; i < states.size(); ++i) {
+        double energy = states.energy_ev[i];
+        // At T = 0 only the lowest state emits
+        double population = params.kT_eV > 0.0 ? std::exp(-(energy - states.energy_ev.front()) / params.kT_eV)
+                                                : (i == 0 ? 1.0 : 0.0);
+        double electronic = population * states.osc_strength[i] / energy;
+        double origin = energy + params.mlj_lambda_v_ev;
+        for (size_t n = 0; n < poisson.size(); ++n) {
+            double position = origin - static_cast<double>(n) * params.mlj_mode_ev;
+            if (position <= 0.0) break;
+            lines.emplace_back(position * EV_TO_CM_MINUS_1, electronic * poisson[n]);
+        }
+    }
+    std::sort(lines.begin(), lines.end());
+    std::vector<double> positions(lines.size());
+    std::vector<double> strengths(lines.size());
+    for (size_t k = 0; k < lines.size(); ++k) {
+        positions[k] = lines[k].first;
+        strengths[k] = lines[k].second;
+    }
+
+    std::vector<double> y_values = broaden_sticks(positions, strengths, x_values, params.unit, fwhm_cm);
+    for (size_t g = 0; g < x_values.size(); ++g) {
+        double photon_ev = x_to_wavenumber(x_values[g], params.unit) / EV_TO_CM_MINUS_1;
+        y_values[g] *= photon_ev * photon_ev * photon_ev;
+    }
+    return y_values;
+}
+
+// Function to pick the states contributing most to the spectrum at a grid
+// coordinate. The energy-sorted store yields the candidate window by binary
+// search, so picking costs O(log N + K) for K states inside the window.
+std::vector<size_t> pick_contributing_states(const ExcitedStateStore& states, double x,
+                                             const PlotSpecParams& params, size_t max_states) {
+    std::vector<std::pair<double, size_t>> candidates;
+    if (states.size() == 0 || max_states == 0) {
+        return {};
+    }
+
+    const double sigma = params.fwhm_cm_minus_1 * FWHM_TO_SIGMA;
+    const double inv_two_sigma_sq = 1.0 / (2.0 * sigma * sigma);
+    const double window_ev = GAUSSIAN_WINDOW_SIGMAS * sigma / EV_TO_CM_MINUS_1;
+    double wavenumber = x_to_wavenumber(x + x_axis_offset(params), params.unit);
+    double energy = wavenumber / EV_TO_CM_MINUS_1;
+
+    auto first = std::lower_bound(states.energy_ev.begin(), states.energy_ev.end(), energy - window_ev);
+    auto last = std::upper_bound(first, states.energy_ev.end(), energy + window_ev);
+    for (auto it = first; it != last; ++it) {
+        size_t i = static_cast<size_t>(it - states.energy_ev.begin());
+        double delta = wavenumber - *it * EV_TO_CM_MINUS_1;
+        double contribution = std::abs(stick_strength(states, i, params)) * std::exp(-delta * delta * inv_two_sigma_sq);
+        if (contribution > 0.0) {
+            candidates.emplace_back(contribution, i);
+        }
+    }
+
+    size_t count = std::min(max_states, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+                      [](const auto& a, const auto& b) { return a.first > b.first; });
+
+    std::vector<size_t> picked;
+    for (size_t k = 0; k < count; ++k) {
+        picked.push_back(candidates[k].second);
+    }
+    return picked;
+}
+
+// Function to find the positive band maxima of sign * y in linear time. Two sweeps
+// with a monotonic stack give, for every point, the lowest value between it
+// and the nearest higher point on each side, so the prominence of each local
+// maximum is known without searching. Peaks at least min_prominence high are
+// refined by a parabola through the neighbouring grid points (uniform grid).
+std::vector<SpectrumPeak> find_peaks(const std::vector<double>& x_values, const std::vector<double>& y_values,
+                                     double sign, double min_prominence) {
+    const size_t n = y_values.size();
+    std::vector<SpectrumPeak> peaks;
+    if (n < 3) {
+        return peaks;
+    }
+
+    std::vector<double> base_left(n);
+    std::vector<double> base_right(n);
+    std::vector<std::pair<double, double>> stack; // height and lowest value since the entry below it
+    auto sweep = [&](bool forward, std::vector<double>& base) {
+        stack.clear();
+        for (size_t step = 0; step < n; ++step) {
+            size_t k = forward ? step : n - 1 - step;
+            double y = sign * y_values[k];
+            double between = std::numeric_limits<double>::infinity();
+            while (!stack.empty() && stack.back().first <= y) {
+                between = std::min({ between, stack.back().first, stack.back().second });
+                stack.pop_back();
+            }
+            base[k] = between;
+            stack.emplace_back(y, between);
+        }
+    };
+    sweep(true, base_left);
+    sweep(false, base_right);
+
+    for (size_t k = 1; k + 1 < n; ++k) {
+        double left = sign * y_values[k - 1];
+        double center = sign * y_values[k];
+        double right = sign * y_values[k + 1];
+        if (!(center > left && center >= right) || center <= 0.0) continue;
+        double prominence = center - std::max(base_left[k], base_right[k]);
+        if (prominence < min_prominence) continue;
+
+        SpectrumPeak peak;
+        double curvature = left - 2.0 * center + right;
+        double offset = curvature < 0.0 ? 0.5 * (left - right) / curvature : 0.0;
+        peak.x = x_values[k] + offset * 0.5 * (x_values[k + 1] - x_values[k - 1]);
+        peak.height = sign * (center - 0.25 * (left - right) * offset);
+        peak.prominence = prominence;
+        peaks.push_back(peak);
+    }
+    return peaks;
+}
+
+// Function to detect the band maxima of a computed spectrum, and the minima of
+// negative bands for signed spectra (CD, LD, ESA), ordered by prominence and
+// annotated with their dominant excited states
+void detect_peaks(SpectrumData& spectrum, const PlotSpecParams& params) {
+    double largest = 0.0;
+    bool has_negative = false;
+    for (double y : spectrum.y_values) {
+        largest = std::max(largest, std::abs(y));
+        has_negative = has_negative || y < 0.0;
+    }
+    if (largest <= 0.0) {
+        return;
+    }
+    double threshold = params.peak_prominence * largest;
+    spectrum.peaks = find_peaks(spectrum.x_values, spectrum.y_values, 1.0, threshold);
+    if (has_negative) {
+        std::vector<SpectrumPeak> minima = find_peaks(spectrum.x_values, spectrum.y_values, -1.0, threshold);
+        spectrum.peaks.insert(spectrum.peaks.end(), minima.begin(), minima.end());
+    }
+    std::sort(spectrum.peaks.begin(), spectrum.peaks.end(),
+              [](const SpectrumPeak& a, const SpectrumPeak& b) { return a.prominence > b.prominence; });
+    for (auto& peak : spectrum.peaks) {
+        peak.states = pick_contributing_states(spectrum.states, peak.x, params, PEAK_LABEL_STATES);
+    }
+}
+
+// Function to parse harmonic frequencies, IR intensities and Raman activities
+// from a BDF frequency output. Normal modes are printed in column blocks:
+//        Frequencies       1603.3786       3768.8398       3891.7624
+//     IR intensities         73.3708          3.6330         26.5044
+// Frequencies are multiplied by freq_scale; imaginary modes (negative or with
+// an "i" suffix) are dropped.
+VibrationalModeStore parse_bdf_frequencies(const std::string& filename, double freq_scale) {
+    std::ifstream infile(filename);
+    if (!infile.is_open()) {
+        throw std::runtime_error("Cannot open BDF output file: " + filename);
+    }
+
+    auto read_values = [](const std::string& line, size_t label_end, std::vector<double>& column) {
+        std::istringstream iss(line.substr(label_end));
+        std::string token;
+        while (iss >> token) {
+            double value = 0.0;
+            if (ends_with(token, "i") && parse_double_token(token.substr(0, token.size() - 1), value)) {
+                column.push_back(-value);
+            } else if (parse_double_token(token, value)) {
+                column.push_back(value);
+            }
+        }
+    };
+
+    std::vector<double> frequencies;
+    std::vector<double> ir_intensities;
+    std::vector<double> raman_activities;
+    std::string line;
+    while (std::getline(infile, line)) {
+        size_t begin = line.find_first_not_of(" \t");
+        if (begin == std::string::npos) continue;
+        if (line.compare(begin, 11, "Frequencies") == 0) {
+            read_values(line, begin + 11, frequencies);
+        } else if (line.compare(begin, 14, "IR intensities") == 0) {
+            read_values(line, begin + 14, ir_intensities);
+        } else if (line.compare(begin, 16, "Raman activities") == 0) {
+            read_values(line, begin + 16, raman_activities);
+        }
+    }
+
+    if (ir_intensities.empty()) ir_intensities.assign(frequencies.size(), 0.0);
+    if (raman_activities.empty()) raman_activities.assign(frequencies.size(), 0.0);
+    if (ir_intensities.size() != frequencies.size() || raman_activities.size() != frequencies.size()) {
+        throw std::runtime_error("Inconsistent normal mode table in BDF output file: " + filename);
+    }
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < frequencies.size(); ++i) {
+        if (frequencies[i] > 0.0) {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&frequencies](size_t a, size_t b) {
+        return frequencies[a] < frequencies[b];
+    });
+
+    VibrationalModeStore modes;
+    for (size_t i : order) {
+        modes.frequency_cm.push_back(frequencies[i] * freq_scale);
+        modes.ir_intensity.push_back(ir_intensities[i]);
+        modes.raman_activity.push_back(raman_activities[i]);
+    }
+    return modes;
+}
+
+// Function to broaden sticks carrying several weight channels in one pass.
+// weights is row-major (stick-major) with n_channels values per stick; the
+// Gaussian of each stick is evaluated once per grid point and accumulated
+// into every channel, instead of one broadening pass per channel.
+std::vector<std::vector<double>> broaden_sticks_multichannel(const std::vector<double>& positions_cm,
+                                                             const std::vector<double>& weights, size_t n_channels,
+                                                             const std::vector<double>& x_values,
+                                                             const std::string& unit, double fwhm_cm) {
+    const double sigma = fwhm_cm * FWHM_TO_SIGMA;
+    const double norm = 1.0 / (sigma * std::sqrt(2.0 * PI));
+    const double inv_two_sigma_sq = 1.0 / (2.0 * sigma * sigma);
+    const double window = GAUSSIAN_WINDOW_SIGMAS * sigma;
+
+    // Grid-major accumulation keeps each grid point's channels contiguous
+    std::vector<double> accumulated(x_values.size() * n_channels, 0.0);
+    parallel_for_chunks(x_values.size(), BROADENING_MIN_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t g = begin; g < end; ++g) {
+            double wavenumber = x_to_wavenumber(x_values[g], unit);
+            auto first = std::lower_bound(positions_cm.begin(), positions_cm.end(), wavenumber - window);
+            auto last = std::upper_bound(first, positions_cm.end(), wavenumber + window);
+
+            double* out = &accumulated[g * n_channels];
+            for (auto it = first; it != last; ++it) {
+                double delta = wavenumber - *it;
+                double gaussian = norm * std::exp(-delta * delta * inv_two_sigma_sq);
+                const double* w = &weights[static_cast<size_t>(it - positions_cm.begin()) * n_channels];
+                for (size_t c = 0; c < n_channels; ++c) {
+                    out[c] += gaussian * w[c];
+                }
+            }
+        }
+    });
+
+    std::vector<std::vector<double>> channels(n_channels, std::vector<double>(x_values.size()));
+    for (size_t g = 0; g < x_values.size(); ++g) {
+        for (size_t c = 0; c < n_channels; ++c) {
+            channels[c][g] = accumulated[g * n_channels + c];
+        }
+    }
+    return channels;
+}
+
+// Function to parse molecular orbital energies and optional projections from
+// a BDF output. Orbital rows follow an "Orbital energies" header as
+//       12    2.0000    -0.352100    -9.5812
+// (index, occupation, ..., energy in eV as the last column). Projections are
+// read from a "Fragment contributions" table whose first line names the
+// fragments and whose rows give the orbital index and one weight per fragment.
+OrbitalStore parse_bdf_orbitals(const std::string& filename) {
+    std::ifstream infile(filename);
+    if (!infile.is_open()) {
+        throw std::runtime_error("Cannot open BDF output file: " + filename);
+    }
+
+    enum class Section { NONE, ENERGIES, PROJECTIONS };
+    Section section = Section::NONE;
+    size_t rows_in_section = 0;
+    bool need_labels = false;
+
+    std::vector<double> energies;
+    std::vector<double> occupations;
+    std::unordered_map<int, size_t> block_orbitals; // orbital index -> row of the current block
+    std::vector<std::string> labels;
+    std::map<size_t, std::vector<double>> projection_rows;
+
+    std::string line;
+    while (std::getline(infile, line)) {
+        std::string lower = to_lower_cpp(line);
+        if (lower.find("orbital energies") != std::string::npos) {
+            section = Section::ENERGIES;
+            rows_in_section = 0;
+            block_orbitals.clear();
+            continue;
+        }
+        if (lower.find("fragment contributions") != std::string::npos) {
+            section = Section::PROJECTIONS;
+            rows_in_section = 0;
+            need_labels = true;
+            continue;
+        }
+
+        bool blank = line.find_first_not_of(" \t\r") == std::string::npos;
+        int number = 0;
+        if (section != Section::NONE && !blank && starts_with_integer(line, number)) {
+            std::istringstream iss(line);
+            std::string token;
+            iss >> token;
+            std::vector<double> values;
+            double value = 0.0;
+            while (iss >> token) {
+                if (parse_double_token(token, value)) {
+                    values.push_back(value);
+                }
+            }
+
+            if (section == Section::ENERGIES && values.size() >= 2) {
+                block_orbitals[number] = energies.size();
+                occupations.push_back(values.front());
+                energies.push_back(values.back());
+                ++rows_in_section;
+            } else if (section == Section::PROJECTIONS && !labels.empty()) {
+                auto orbital_it = block_orbitals.find(number);
+                if (orbital_it != block_orbitals.end()) {
+                    values.resize(labels.size(), 0.0);
+                    projection_rows[orbital_it->second] = values;
+                    ++rows_in_section;
+                }
+            }
+            continue;
+        }
+
+        if (section == Section::PROJECTIONS && need_labels && !blank) {
+            std::istringstream iss(line);
+            std::string token;
+            labels.clear();
+            while (iss >> token) {
+                labels.push_back(token);
+            }
+            need_labels = false;
+            continue;
+        }
+        if (section != Section::NONE && rows_in_section > 0 && !blank) {
+            section = Section::NONE;
+        }
+    }
+
+    std::vector<size_t> order(energies.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&energies](size_t a, size_t b) {
+        return energies[a] < energies[b];
+    });
+
+    OrbitalStore orbitals;
+    orbitals.projection_labels = projection_rows.empty() ? std::vector<std::string>() : labels;
+    size_t n_projections = orbitals.projection_labels.size();
+    orbitals.projection.assign(energies.size() * n_projections, 0.0);
+    for (size_t row = 0; row < order.size(); ++row) {
+        size_t i = order[row];
+        orbitals.energy_ev.push_back(energies[i]);
+        orbitals.occupation.push_back(occupations[i]);
+        auto projection_it = projection_rows.find(i);
+        if (projection_it != projection_rows.end()) {
+            std::copy(projection_it->second.begin(), projection_it->second.end(),
+                      orbitals.projection.begin() + row * n_projections);
+        }
+    }
+    return orbitals;
+}
+
+// Function to broaden the orbitals into total and projected DOS (states/eV)
+// with a single fused pass over the sorted orbital array
+std::vector<std::vector<double>> broaden_orbitals(const OrbitalStore& orbitals, const std::vector<double>& x_values,
+                                                  const PlotSpecParams& params) {
+    size_t n_projections = orbitals.projection_labels.size();
+    size_t n_channels = 1 + n_projections;
+    std::vector<double> positions(orbitals.size());
+    std::vector<double> weights(orbitals.size() * n_channels);
+    for (size_t i = 0; i < orbitals.size(); ++i) {
+        positions[i] = orbitals.energy_ev[i] * EV_TO_CM_MINUS_1;
+        weights[i * n_channels] = EV_TO_CM_MINUS_1;
+        for (size_t k = 0; k < n_projections; ++k) {
+            weights[i * n_channels + 1 + k] = EV_TO_CM_MINUS_1 * orbitals.projection[i * n_projections + k];
+        }
+    }
+    return broaden_sticks_multichannel(positions, weights, n_channels, x_values, params.unit, params.fwhm_cm_minus_1);
+}
+
+// Function to get the lab-frame absorption weight of each excited state along
+// x, y and z (stick-major, three per state) for the orientation scheme in
+// params. Weights are 3 f (mu.e)^2 / |mu|^2, so their mean over the axes is the
+// isotropic strength:
+//   fixed     molecular frame rotated by ZYZ Euler angles (degrees)
+//   uniaxial  molecular orientation_axis ordered along lab z with order
+//             parameter S, uniform about z
+//   isotropic random orientations
+std::vector<double> polarized_state_weights(const ExcitedStateStore& states, const PlotSpecParams& params) {
+    const double deg = PI / 180.0;
+    const double ca = std::cos(params.orientation_euler[0] * deg), sa = std::sin(params.orientation_euler[0] * deg);
+    const double cb = std::cos(params.orientation_euler[1] * deg), sb = std::sin(params.orientation_euler[1] * deg);
+    const double cg = std::cos(params.orientation_euler[2] * deg), sg = std::sin(params.orientation_euler[2] * deg);
+    const double rotation[3][3] = {
+        {ca * cb * cg - sa * sg, -ca * cb * sg - sa * cg, ca * sb},
+        {sa * cb * cg + ca * sg, -sa * cb * sg + ca * cg, sa * sb},
+        {-sb * cg, sb * sg, cb}};
+
+    double axis[3] = {params.orientation_axis[0], params.orientation_axis[1], params.orientation_axis[2]};
+    double axis_norm = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+
+    std::vector<double> weights(states.size() * 3);
+    size_t unpolarized = 0;
+    for (size_t i = 0; i < states.size(); ++i) {
+        double mu[3] = {states.dipole_x[i], states.dipole_y[i], states.dipole_z[i]};
+        double mu_norm = std::sqrt(mu[0] * mu[0] + mu[1] * mu[1] + mu[2] * mu[2]);
+        double strength = PREFAC_BROADENING_BASE * states.osc_strength[i];
+        double* w = &weights[i * 3];
+
+        if (params.orientation_averaging == "isotropic" || mu_norm <= 0.0) {
+            unpolarized += params.orientation_averaging != "isotropic" && strength != 0.0;
+            w[0] = w[1] = w[2] = strength;
+        } else if (params.orientation_averaging == "uniaxial") {
+            double cos_beta = (mu[0] * axis[0] + mu[1] * axis[1] + mu[2] * axis[2]) / (mu_norm * axis_norm);
+            double p2 = params.order_parameter * 0.5 * (3.0 * cos_beta * cos_beta - 1.0);
+            w[0] = w[1] = strength * (1.0 - p2);
+            w[2] = strength * (1.0 + 2.0 * p2);
+        } else {
+            for (int a = 0; a < 3; ++a) {
+                double projection = (rotation[a][0] * mu[0] + rotation[a][1] * mu[1] + rotation[a][2] * mu[2]) / mu_norm;
+                w[a] = 3.0 * strength * projection * projection;
+            }
+        }
+    }
+    if (unpolarized > 0) {
+        std::cerr << "Warning: " << unpolarized << " state(s) without transition dipoles treated as isotropic" << std::endl;
+    }
+    return weights;
+}
+
+// Function to parse state-to-state transitions from a BDF excited-state
+// absorption calculation. Rows follow a "State-to-state" header as
+//     From   To   Energy(eV)        f
+//        1    3       1.2000   0.0500
+// with the transition energy first and the oscillator strength last.
+// Downward transitions (non-positive energies) are skipped.
+StateTransitionStore parse_bdf_state_transitions(const std::string& filename) {
+    std::ifstream infile(filename);
+    if (!infile.is_open()) {
+        throw std::runtime_error("Cannot open BDF output file: " + filename);
+    }
+
+    StateTransitionStore store;
+    bool in_table = false;
+    size_t rows_in_table = 0;
+    std::string line;
+    while (std::getline(infile, line)) {
+        if (to_lower_cpp(line).find("state-to-state") != std::string::npos) {
+            in_table = true;
+            rows_in_table = 0;
+            continue;
+        }
+
+        bool blank = line.find_first_not_of(" \t\r") == std::string::npos;
+        int initial = 0;
+        if (in_table && !blank && starts_with_integer(line, initial)) {
+            std::istringstream iss(line);
+            std::string token;
+            iss >> token;
+            int final_state = 0;
+            if (!(iss >> token) || !starts_with_integer(token, final_state)) continue;
+            std::vector<double> values;
+            double value = 0.0;
+            while (iss >> token) {
+                if (parse_double_token(token, value)) {
+                    values.push_back(value);
+                }
+            }
+            if (values.size() < 2) continue;
+            ++rows_in_table;
+            if (values.front() <= 0.0) continue;
+            store.initial_state.push_back(initial);
+            store.final_state.push_back(final_state);
+            store.energy_ev.push_back(values.front());
+            store.osc_strength.push_back(values.back());
+            continue;
+        }
+        if (in_table && rows_in_table > 0 && !blank) {
+            in_table = false;
+        }
+    }
+
+    permute_columns(energy_order(store.energy_ev), store.initial_state, store.final_state, store.energy_ev,
+                    store.osc_strength);
+    return store;
+}
+
+// Function to compute transient absorption channels: one excited-state
+// absorption channel per reference state weighted by its population, then the
+// ground-state bleach of the total excited population. Ground-state and
+// state-to-state sticks are merged into one sorted set and broadened in a
+// single multichannel pass.
+std::vector<std::vector<double>> transient_absorption_channels(const ExcitedStateStore& ground,
+                                                               const StateTransitionStore& transitions,
+                                                               const std::vector<double>& x_values,
+                                                               const PlotSpecParams& params) {
+    const size_t n_references = params.esa_states.size();
+    const size_t n_channels = n_references + 1;
+    double excited_population = 0.0;
+    for (double population : params.esa_populations) {
+        excited_population += population;
+    }
+
+    std::vector<std::pair<double, size_t>> sticks; // position, index into the weight rows
+    std::vector<double> stick_weights;
+    auto add_stick = [&](double energy_ev, size_t channel, double weight) {
+        sticks.emplace_back(energy_ev * EV_TO_CM_MINUS_1, stick_weights.size() / n_channels);
+        stick_weights.resize(stick_weights.size() + n_channels, 0.0);
+        stick_weights[stick_weights.size() - n_channels + channel] = weight;
+    };
+
+    for (size_t i = 0; i < transitions.size(); ++i) {
+        for (size_t r = 0; r < n_references; ++r) {
+            if (transitions.initial_state[i] == params.esa_states[r]) {
+                add_stick(transitions.energy_ev[i], r,
+                          params.esa_populations[r] * PREFAC_BROADENING_BASE * transitions.osc_strength[i]);
+            }
+        }
+    }
+    if (params.esa_bleach) {
+        for (size_t i = 0; i < ground.size(); ++i) {
+            add_stick(ground.energy_ev[i], n_references,
+                      -excited_population * PREFAC_BROADENING_BASE * ground.osc_strength[i]);
+        }
+    }
+
+    std::sort(sticks.begin(), sticks.end());
+    std::vector<double> positions(sticks.size());
+    std::vector<double> weights(sticks.size() * n_channels);
+    for (size_t k = 0; k < sticks.size(); ++k) {
+        positions[k] = sticks[k].first;
+        std::copy_n(&stick_weights[sticks[k].second * n_channels], n_channels, &weights[k * n_channels]);
+    }
+    return broaden_sticks_multichannel(positions, weights, n_channels, x_values, params.unit, params.fwhm_cm_minus_1);
+}
+
+// Function to transform data in place with an iterative radix-2 FFT.
+// The size must be a power of two; inverse uses exp(+2 pi i jn/N) without
+// the 1/N normalization.
+void fft_in_place(std::vector<std::complex<double>>& data, bool inverse) {
+    const size_t n = data.size();
+    for (size_t i = 1, j = 0; i < n; ++i) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(data[i], data[j]);
+        }
+    }
+
+    for (size_t length = 2; length <= n; length <<= 1) {
+        double angle = 2.0 * PI / static_cast<double>(length) * (inverse ? 1.0 : -1.0);
+        std::complex<double> step(std::cos(angle), std::sin(angle));
+        for (size_t start = 0; start < n; start += length) {
+            std::complex<double> twiddle(1.0, 0.0);
+            for (size_t k = 0; k < length / 2; ++k) {
+                std::complex<double> even = data[start + k];
+                std::complex<double> odd = data[start + k + length / 2] * twiddle;
+                data[start + k] = even + odd;
+                data[start + k + length / 2] = even - odd;
+                twiddle *= step;
+            }
+        }
+    }
+}
+
+size_t next_power_of_two(size_t n) {
+    size_t power = 1;
+    while (power < n) {
+        power <<= 1;
+    }
+    return power;
+}
+
+// Function to read a real-time TDDFT dipole trace recorded after a delta kick.
+// Each line holds the time (a.u.) followed by one to three induced-dipole
+// columns (a.u.), column c being the dipole along the kick of polarization c:
+//     # t        mu_x        mu_y        mu_z
+//     0.00   0.0000000   0.0000000   0.0000000
+// Lines starting with '#' are comments; the time step must be uniform.
+DipoleTrace parse_rt_dipole_trace(const std::string& filename) {
+    std::ifstream infile(filename);
+    if (!infile.is_open()) {
+        throw std::runtime_error("Cannot open dipole trace file: " + filename);
+    }
+
+    DipoleTrace trace;
+    std::vector<double> times;
+    std::string line;
+    while (std::getline(infile, line)) {
+        size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos || line[begin] == '#') continue;
+        std::istringstream iss(line);
+        std::vector<double> values;
+        std::string token;
+        double value = 0.0;
+        while (iss >> token && parse_double_token(token, value)) {
+            values.push_back(value);
+        }
+        if (values.size() < 2) continue;
+        if (trace.dipole.empty()) {
+            trace.dipole.resize(std::min<size_t>(values.size() - 1, 3));
+        }
+        if (values.size() - 1 < trace.dipole.size()) {
+            throw std::runtime_error("Inconsistent column count in dipole trace: " + line);
+        }
+        times.push_back(values[0]);
+        for (size_t c = 0; c < trace.dipole.size(); ++c) {
+            trace.dipole[c].push_back(values[c + 1]);
+        }
+    }
+    if (times.size() < 2) {
+        return trace;
+    }
+
+    trace.time_step = (times.back() - times.front()) / static_cast<double>(times.size() - 1);
+    for (size_t n = 1; n < times.size(); ++n) {
+        if (std::abs(times[n] - times[n - 1] - trace.time_step) > 1e-6 * std::abs(trace.time_step) + 1e-12) {
+            throw std::runtime_error("Non-uniform time step in dipole trace: " + filename);
+        }
+    }
+    if (trace.time_step <= 0.0) {
+        throw std::runtime_error("Dipole trace times must increase: " + filename);
+    }
+    return trace;
+}
+
+// Function to solve a dense linear system (row-major n x n) in place by
+// Gaussian elimination with partial pivoting; the solution replaces rhs
+void solve_linear_system(std::vector<std::complex<double>>& matrix, std::vector<std::complex<double>>& rhs) {
+    const size_t n = rhs.size();
+    for (size_t col = 0; col < n; ++col) {
+        size_t pivot = col;
+        for (size_t row = col + 1; row < n; ++row) {
+            if (std::abs(matrix[row * n + col]) > std::abs(matrix[pivot * n + col])) {
+                pivot = row;
+            }
+        }
+        if (std::abs(matrix[pivot * n + col]) == 0.0) {
+            throw std::runtime_error("Singular linear system");
+        }
+        if (pivot != col) {
+            std::swap_ranges(matrix.begin() + col * n, matrix.begin() + (col + 1) * n, matrix.begin() + pivot * n);
+            std::swap(rhs[col], rhs[pivot]);
+        }
+        for (size_t row = col + 1; row < n; ++row) {
+            std::complex<double> factor = matrix[row * n + col] / matrix[col * n + col];
+            if (factor == 0.0) continue;
+            for (size_t k = col; k < n; ++k) {
+                matrix[row * n + k] -= factor * matrix[col * n + k];
+            }
+            rhs[row] -= factor * rhs[col];
+        }
+    }
+    for (size_t i = n; i-- > 0;) {
+        std::complex<double> sum = rhs[i];
+        for (size_t k = i + 1; k < n; ++k) {
+            sum -= matrix[i * n + k] * rhs[k];
+        }
+        rhs[i] = sum / matrix[i * n + i];
+    }
+}
+
+// Function to compute c = a b^T for row-major a (rows_a x cols) and b
+// (rows_b x cols), i.e. all dot products between rows of a and rows of b.
+// Operands are padded to multiples of 4 rows, cache tiles of both are reused
+// across the tile loops, a 4x4 block of c is accumulated in registers, and
+// row tiles of a are spread over the hardware threads. c is written in place
+// without a padded copy, so only the operands are duplicated. When a and b
+// are the same vector, only tiles on and above the diagonal are computed and
+// the rest is mirrored; row tiles are then paired first with last so every
+// thread gets a similar share.
+void matrix_multiply_transposed(const std::vector<double>& a, size_t rows_a, const std::vector<double>& b,
+                                size_t rows_b, size_t cols, std::vector<double>& c) {
+    const bool symmetric = &a == &b && rows_a == rows_b;
+    const size_t padded_a = (rows_a + 3) / 4 * 4;
+    const size_t padded_b = (rows_b + 3) / 4 * 4;
+    std::vector<double> a_packed(padded_a * cols, 0.0);
+    std::copy(a.begin(), a.begin() + rows_a * cols, a_packed.begin());
+    std::vector<double> b_packed;
+    if (!symmetric) {
+        b_packed.assign(padded_b * cols, 0.0);
+        std::copy(b.begin(), b.begin() + rows_b * cols, b_packed.begin());
+    }
+    const std::vector<double>& b_rows_packed = symmetric ? a_packed : b_packed;
+    c.assign(rows_a * rows_b, 0.0);
+
+    auto multiply_row_tile = [&](size_t tile) {
+        size_t i0 = tile * GEMM_TILE_ROWS;
+        size_t i1 = std::min(padded_a, i0 + GEMM_TILE_ROWS);
+        for (size_t k0 = 0; k0 < cols; k0 += GEMM_TILE_DEPTH) {
+            size_t k1 = std::min(cols, k0 + GEMM_TILE_DEPTH);
+            for (size_t j0 = symmetric ? i0 : 0; j0 < padded_b; j0 += GEMM_TILE_ROWS) {
+                size_t j1 = std::min(padded_b, j0 + GEMM_TILE_ROWS);
+                for (size_t i = i0; i < i1; i += 4) {
+                    const double* a_rows = &a_packed[i * cols];
+                    for (size_t j = j0; j < j1; j += 4) {
+                        const double* b_rows = &b_rows_packed[j * cols];
+                        double acc[4][4] = {};
+                        for (size_t k = k0; k < k1; ++k) {
+                            double a_col[4] = { a_rows[k], a_rows[cols + k], a_rows[2 * cols + k], a_rows[3 * cols + k] };
+                            double b_col[4] = { b_rows[k], b_rows[cols + k], b_rows[2 * cols + k], b_rows[3 * cols + k] };
+                            for (int r = 0; r < 4; ++r) {
+                                for (int s = 0; s < 4; ++s) {
+                                    acc[r][s] += a_col[r] * b_col[s];
+                                }
+                            }
+                        }
+                        for (size_t r = 0; r < 4 && i + r < rows_a; ++r) {
+                            for (size_t s = 0; s < 4 && j + s < rows_b; ++s) {
+                                c[(i + r) * rows_b + j + s] += acc[r][s];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    size_t row_tiles = (padded_a + GEMM_TILE_ROWS - 1) / GEMM_TILE_ROWS;
+    size_t work_items = symmetric ? (row_tiles + 1) / 2 : row_tiles;
+    parallel_for_chunks(work_items, 1, [&](size_t begin, size_t end) {
+        for (size_t item = begin; item < end; ++item) {
+            multiply_row_tile(item);
+            if (symmetric && row_tiles - 1 - item != item) {
+                multiply_row_tile(row_tiles - 1 - item);
+            }
+        }
+    });
+
+    if (symmetric) {
+        for (size_t i = GEMM_TILE_ROWS; i < rows_a; ++i) {
+            size_t diagonal_tile_start = i / GEMM_TILE_ROWS * GEMM_TILE_ROWS;
+            for (size_t j = 0; j < diagonal_tile_start; ++j) {
+                c[i * rows_b + j] = c[j * rows_b + i];
+            }
+        }
+    }
+}
+
+// Function to get the imaginary part of one polarizability component,
+// Im alpha(w) = Im integral mu(t) exp(i w t) dt / kick, at the frequencies
+// omega (Hartree) from a damped dipole signal with time step dt.
+// The FFT path zero-pads so the bins are finer than resolution and
+// interpolates; the Pade path fits P(z)/Q(z), z = exp(i w dt), to the series
+// and evaluates it directly, resolving narrow lines from short traces.
+std::vector<double> rt_polarizability_imag(const std::vector<double>& signal, double dt, const std::vector<double>& omega,
+                                           double resolution, double kick, bool pade) {
+    std::vector<double> imag_alpha(omega.size(), 0.0);
+
+    if (!pade) {
+        size_t n_points = next_power_of_two(std::max(signal.size(),
+                                                     static_cast<size_t>(std::ceil(2.0 * PI / (dt * resolution)))));
+        n_points = std::min(n_points, std::max(RT_MAX_FFT_POINTS, next_power_of_two(signal.size())));
+        std::vector<std::complex<double>> data(n_points);
+        for (size_t n = 0; n < signal.size(); ++n) {
+            data[n] = signal[n] * dt;
+        }
+        fft_in_place(data, true);
+
+        const double bin = 2.0 * PI / (static_cast<double>(n_points) * dt);
+        for (size_t g = 0; g < omega.size(); ++g) {
+            double position = omega[g] / bin;
+            size_t j = static_cast<size_t>(position);
+            if (j + 1 >= n_points / 2) continue;
+            double fraction = position - static_cast<double>(j);
+            imag_alpha[g] = ((1.0 - fraction) * data[j].imag() + fraction * data[j + 1].imag()) / kick;
+        }
+        return imag_alpha;
+    }
+
+    // Pade approximant of order M: sum_k c_k z^k = P(z) / Q(z) with Q(0) = 1
+    const size_t order = (std::min(signal.size(), RT_PADE_MAX_POINTS) - 1) / 2;
+    std::vector<std::complex<double>> toeplitz(order * order);
+    std::vector<std::complex<double>> q(order);
+    for (size_t k = 0; k < order; ++k) {
+        for (size_t m = 0; m < order; ++m) {
+            toeplitz[k * order + m] = signal[order + k - m];
+        }
+        q[k] = -signal[order + k + 1];
+    }
+    solve_linear_system(toeplitz, q);
+    std::vector<double> q_coeff(order + 1, 1.0);
+    std::vector<double> p_coeff(order + 1, 0.0);
+    for (size_t m = 0; m < order; ++m) {
+        q_coeff[m + 1] = q[m].real();
+    }
+    for (size_t k = 0; k <= order; ++k) {
+        for (size_t m = 0; m <= k; ++m) {
+            p_coeff[k] += q_coeff[m] * signal[k - m];
+        }
+    }
+
+    parallel_for_chunks(omega.size(), RT_PADE_MIN_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t g = begin; g < end; ++g) {
+            std::complex<double> z = std::polar(1.0, omega[g] * dt);
+            std::complex<double> p(0.0, 0.0);
+            std::complex<double> qz(0.0, 0.0);
+            for (size_t k = order + 1; k-- > 0;) {
+                p = p * z + p_coeff[k];
+                qz = qz * z + q_coeff[k];
+            }
+            imag_alpha[g] = (p / qz).imag() * dt / kick;
+        }
+    });
+    return imag_alpha;
+}
+
+// Function to compute the absorption of a real-time TDDFT dipole trace on the
+// grid. The induced dipole is damped by a window that gives lines of width
+// fwhm_ev, transformed per polarization (in parallel), and averaged into the
+// dipole strength function S(w) = 2 w / pi Im alpha(w), which integrates to
+// the oscillator strengths and is scaled like broadened abs spectra.
+std::vector<double> rt_absorption(const DipoleTrace& trace, const std::vector<double>& x_values,
+                                  const PlotSpecParams& params) {
+    const double fwhm_hartree = params.fwhm_cm_minus_1 / EV_TO_CM_MINUS_1 / HARTREE_TO_EV;
+    const double sigma = fwhm_hartree * FWHM_TO_SIGMA;
+
+    std::vector<double> omega(x_values.size());
+    double omega_max = 0.0;
+    for (size_t g = 0; g < x_values.size(); ++g) {
+        omega[g] = x_to_wavenumber(x_values[g], params.unit) / EV_TO_CM_MINUS_1 / HARTREE_TO_EV;
+        omega_max = std::max(omega_max, omega[g]);
+    }
+
+    // The Pade fit runs on a decimated trace that still resolves omega_max
+    size_t stride = 1;
+    if (params.rt_pade && omega_max > 0.0) {
+        stride = std::max<size_t>(1, static_cast<size_t>(PI / (RT_PADE_NYQUIST_MARGIN * omega_max * trace.time_step)));
+    }
+    const double dt = trace.time_step * static_cast<double>(stride);
+    const size_t n_samples = (trace.size() + stride - 1) / stride;
+
+    std::vector<std::vector<double>> imag_alpha(trace.dipole.size());
+    parallel_for_chunks(trace.dipole.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; ++c) {
+            const std::vector<double>& dipole = trace.dipole[c];
+            std::vector<double> signal(n_samples);
+            for (size_t n = 0; n < n_samples; ++n) {
+                double t = static_cast<double>(n) * dt;
+                double window = params.rt_window == "exponential" ? std::exp(-0.5 * fwhm_hartree * t)
+                                                                  : std::exp(-0.5 * sigma * sigma * t * t);
+                signal[n] = (dipole[n * stride] - dipole.front()) * window;
+            }
+            imag_alpha[c] = rt_polarizability_imag(signal, dt, omega, 0.25 * sigma, params.rt_kick_strength,
+                                                   params.rt_pade);
+        }
+    });
+
+    // Dipole strength per Hartree, converted to per cm-1 like the broadened sticks
+    std::vector<double> y_values(x_values.size(), 0.0);
+    const double per_cm = 1.0 / (HARTREE_TO_EV * EV_TO_CM_MINUS_1);
+    for (size_t g = 0; g < x_values.size(); ++g) {
+        double mean = 0.0;
+        for (const auto& column : imag_alpha) {
+            mean += column[g];
+        }
+        mean /= static_cast<double>(imag_alpha.size());
+        y_values[g] = PREFAC_BROADENING_BASE * 2.0 * omega[g] / PI * mean * per_cm;
+    }
+    return y_values;
+}
+
+// Function to parse a displaced harmonic oscillator model from a BDF output:
+//     Adiabatic excitation energy:     3.2150 eV
+//     Huang-Rhys factors
+//      Mode   Freq(GS)/cm-1   Freq(ES)/cm-1   Displacement        S
+//         1        120.50          118.20         0.3500     0.0613
+// The S column is optional and defaults to displacement^2 / 2.
+VibronicModel parse_bdf_vibronic(const std::string& filename) {
+    std::ifstream infile(filename);
+    if (!infile.is_open()) {
+        throw std::runtime_error("Cannot open BDF output file: " + filename);
+    }
+
+    VibronicModel model;
+    bool in_table = false;
+    size_t rows_in_table = 0;
+    std::string line;
+    while (std::getline(infile, line)) {
+        std::string lower = to_lower_cpp(line);
+        if (lower.find("adiabatic") != std::string::npos && lower.find("ev") != std::string::npos) {
+            std::istringstream iss(line);
+            std::string token;
+            double value = 0.0;
+            while (iss >> token) {
+                if (parse_double_token(token, value)) {
+                    model.adiabatic_energy_ev = value;
+                    break;
+                }
+            }
+            continue;
+        }
+        if (lower.find("huang-rhys") != std::string::npos) {
+            in_table = true;
+            rows_in_table = 0;
+            model = VibronicModel{model.adiabatic_energy_ev, {}, {}, {}};
+            continue;
+        }
+
+        bool blank = line.find_first_not_of(" \t\r") == std::string::npos;
+        int number = 0;
+        if (in_table && !blank && starts_with_integer(line, number)) {
+            std::istringstream iss(line);
+            std::string token;
+            iss >> token;
+            std::vector<double> values;
+            double value = 0.0;
+            while (iss >> token) {
+                if (parse_double_token(token, value)) {
+                    values.push_back(value);
+                }
+            }
+            if (values.size() >= 3 && values[0] > 0.0 && values[1] > 0.0) {
+                model.ground_frequency_cm.push_back(values[0]);
+                model.excited_frequency_cm.push_back(values[1]);
+                model.huang_rhys.push_back(values.size() >= 4 ? values[3] : 0.5 * values[2] * values[2]);
+                ++rows_in_table;
+            }
+            continue;
+        }
+        if (in_table && rows_in_table > 0 && !blank) {
+            in_table = false;
+        }
+    }
+    return model;
+}
+
+// Function to compute the Franck-Condon line shape of a displaced harmonic
+// oscillator model by FFT of its time-domain correlation function
+//     C(t) = exp( sum_k S_k [ (n_k + 1)(exp(-i w_k t) - 1) + n_k (exp(i w_k t) - 1) ] )
+// with thermal occupations n_k from kT_eV and Gaussian damping for fwhm_ev.
+// Modes enter the exponent additively, so the cost is linear in the number of
+// modes with no enumeration of overtone and combination bands. The time grid
+// is evaluated in parallel over contiguous per-mode arrays.
+// Returns the line shape (area 1, per cm-1) on offsets j * spacing_cm from the
+// 0-0 line, wrapped so negative offsets occupy the upper half.
+std::vector<double> vibronic_lineshape(const VibronicModel& model, bool emission, double extent_cm,
+                                       const PlotSpecParams& params, double& spacing_cm) {
+    const std::vector<double>& progression = emission ? model.ground_frequency_cm : model.excited_frequency_cm;
+    const std::vector<double>& initial = emission ? model.excited_frequency_cm : model.ground_frequency_cm;
+    const size_t n_modes = model.size();
+
+    // Per-mode coefficients of the real and imaginary parts of the exponent
+    std::vector<double> real_coeff(n_modes);
+    std::vector<double> imag_coeff(n_modes);
+    double mean_cm = 0.0;
+    double variance_cm = 0.0;
+    for (size_t k = 0; k < n_modes; ++k) {
+        double quantum_ev = initial[k] / EV_TO_CM_MINUS_1;
+        double occupation = params.kT_eV > 0.0 ? 1.0 / std::expm1(quantum_ev / params.kT_eV) : 0.0;
+        real_coeff[k] = model.huang_rhys[k] * (2.0 * occupation + 1.0);
+        imag_coeff[k] = model.huang_rhys[k];
+        mean_cm += model.huang_rhys[k] * progression[k];
+        variance_cm += real_coeff[k] * progression[k] * progression[k];
+    }
+
+    // Frequency grid: fine against the line width and wide enough that the
+    // progression does not wrap around into the plotted range
+    const double sigma = params.fwhm_cm_minus_1 * FWHM_TO_SIGMA;
+    spacing_cm = sigma / 4.0;
+    double span_cm = std::max(extent_cm, mean_cm + 8.0 * std::sqrt(variance_cm)) + GAUSSIAN_WINDOW_SIGMAS * sigma;
+    size_t n_points = next_power_of_two(static_cast<size_t>(std::ceil(2.0 * span_cm / spacing_cm)));
+    if (n_points > VIBRONIC_MAX_FFT_POINTS) {
+        n_points = VIBRONIC_MAX_FFT_POINTS;
+        spacing_cm = 2.0 * span_cm / static_cast<double>(n_points);
+        std::cerr << "Warning: vibronic frequency grid coarsened to " << spacing_cm << " cm-1" << std::endl;
+    }
+    const double dt = 1.0 / (static_cast<double>(n_points) * spacing_cm); // time step in cm
+    const double damping = 2.0 * PI * PI * sigma * sigma;
+
+    std::vector<std::complex<double>> correlation(n_points);
+    const size_t half = n_points / 2;
+    parallel_for_chunks(half + 1, BROADENING_MIN_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t n = begin; n < end; ++n) {
+            double t = static_cast<double>(n) * dt;
+            double real_part = 0.0;
+            double imag_part = 0.0;
+            for (size_t k = 0; k < n_modes; ++k) {
+                double phase = 2.0 * PI * progression[k] * t;
+                real_part += real_coeff[k] * (std::cos(phase) - 1.0);
+                imag_part -= imag_coeff[k] * std::sin(phase);
+            }
+            double amplitude = std::exp(real_part - damping * t * t) * dt;
+            correlation[n] = std::complex<double>(amplitude * std::cos(imag_part), amplitude * std::sin(imag_part));
+        }
+    });
+    // C(-t) = conj(C(t)) fills the negative times
+    for (size_t n = 1; n < half; ++n) {
+        correlation[n_points - n] = std::conj(correlation[n]);
+    }
+
+    fft_in_place(correlation, true);
+
+    std::vector<double> lineshape(n_points);
+    for (size_t j = 0; j < n_points; ++j) {
+        lineshape[j] = correlation[j].real();
+    }
+    return lineshape;
+}
+
+// Function to compute a vibronic absorption or emission spectrum on the grid,
+// normalized to a peak of 1
+std::vector<double> vibronic_spectrum(const VibronicModel& model, const std::vector<double>& x_values,
+                                      const PlotSpecParams& params) {
+    const bool emission = params.vibronic_emission;
+    const double origin_cm = model.adiabatic_energy_ev * EV_TO_CM_MINUS_1;
+
+    // Offsets from the 0-0 line, positive along the progression
+    std::vector<double> wavenumbers(x_values.size());
+    std::vector<double> offsets(x_values.size());
+    double extent_cm = 0.0;
+    for (size_t g = 0; g < x_values.size(); ++g) {
+        wavenumbers[g] = x_to_wavenumber(x_values[g], params.unit);
+        offsets[g] = emission ? origin_cm - wavenumbers[g] : wavenumbers[g] - origin_cm;
+        extent_cm = std::max(extent_cm, std::abs(offsets[g]));
+    }
+
+    double spacing_cm = 0.0;
+    std::vector<double> lineshape = vibronic_lineshape(model, emission, extent_cm, params, spacing_cm);
+    const double n_points = static_cast<double>(lineshape.size());
+
+    std::vector<double> y_values(x_values.size(), 0.0);
+    double y_peak = 0.0;
+    for (size_t g = 0; g < x_values.size(); ++g) {
+        double position = offsets[g] / spacing_cm;
+        if (std::abs(position) >= n_points / 2.0 - 1.0 || wavenumbers[g] <= 0.0) continue;
+        double wrapped = position < 0.0 ? position + n_points : position;
+        size_t j = static_cast<size_t>(wrapped);
+        double fraction = wrapped - static_cast<double>(j);
+        double value = (1.0 - fraction) * lineshape[j] + fraction * lineshape[(j + 1) % lineshape.size()];
+
+        // Absorption scales with the photon energy, spontaneous emission with its cube
+        double prefactor = emission ? std::pow(wavenumbers[g], 3) : wavenumbers[g];
+        y_values[g] = std::max(0.0, value) * prefactor;
+        y_peak = std::max(y_peak, y_values[g]);
+    }
+    if (y_peak > 0.0) {
+        for (double& y : y_values) {
+            y /= y_peak;
+        }
+    }
+    return y_values;
+}
+
+// Function to read the sites of an aggregate from params.aggregate_sites or,
+// without a sites file, to build the aggregate_lattice. Each line of a sites
+// file holds "x y z [ux uy uz [offset_ev]]" with positions in Å; sites
+// without an orientation use the monomer transition dipole direction.
+AggregateSites load_aggregate_sites(const PlotSpecParams& params, const double direction[3]) {
+    AggregateSites sites;
+    auto add_site = [&sites](double x, double y, double z, const double u[3], double offset_ev) {
+        double norm = std::sqrt(u[0] * u[0] + u[1] * u[1] + u[2] * u[2]);
+        if (norm <= 0.0) {
+            throw std::runtime_error("Aggregate site with a zero transition dipole orientation");
+        }
+        sites.x.push_back(x);
+        sites.y.push_back(y);
+        sites.z.push_back(z);
+        sites.ux.push_back(u[0] / norm);
+        sites.uy.push_back(u[1] / norm);
+        sites.uz.push_back(u[2] / norm);
+        sites.energy_offset_ev.push_back(offset_ev);
+    };
+
+    if (!params.aggregate_sites.empty()) {
+        std::ifstream infile(params.aggregate_sites);
+        if (!infile.is_open()) {
+            throw std::runtime_error("Cannot open aggregate sites file: " + params.aggregate_sites);
+        }
+        std::string line;
+        while (std::getline(infile, line)) {
+            size_t begin = line.find_first_not_of(" \t\r");
+            if (begin == std::string::npos || line[begin] == '#') continue;
+            std::istringstream iss(line);
+            std::vector<double> values;
+            std::string token;
+            double value = 0.0;
+            while (iss >> token && parse_double_token(token, value)) {
+                values.push_back(value);
+            }
+            if (values.size() < 3) {
+                throw std::runtime_error("Invalid aggregate site line: " + line);
+            }
+            const double* orientation = values.size() >= 6 ? &values[3] : direction;
+            add_site(values[0], values[1], values[2], orientation, values.size() >= 7 ? values[6] : 0.0);
+        }
+    } else if (params.aggregate_lattice.size() == 3) {
+        for (int i = 0; i < params.aggregate_lattice[0]; ++i) {
+            for (int j = 0; j < params.aggregate_lattice[1]; ++j) {
+                for (int k = 0; k < params.aggregate_lattice[2]; ++k) {
+                    add_site(i * params.aggregate_spacing[0], j * params.aggregate_spacing[1],
+                             k * params.aggregate_spacing[2], direction, 0.0);
+                }
+            }
+        }
+    }
+
+    if (sites.size() == 0) {
+        throw std::runtime_error("Mode 'aggregate' requires aggregate_sites or aggregate_lattice");
+    }
+    return sites;
+}
+
+// Function to compute the excitonic coupling (eV) of two sites with transition
+// dipole magnitude mu (a.u.) along unit vectors a and b at separation r (bohr).
+// A positive length_bohr selects the extended-dipole model, with charges
+// +-mu/length placed +-length/2 along each dipole.
+double exciton_coupling(const double r[3], const double a[3], const double b[3], double mu, double length_bohr) {
+    if (length_bohr <= 0.0) {
+        double distance = std::sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2]);
+        double ab = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+        double ar = (a[0] * r[0] + a[1] * r[1] + a[2] * r[2]) / distance;
+        double br = (b[0] * r[0] + b[1] * r[1] + b[2] * r[2]) / distance;
+        return mu * mu * (ab - 3.0 * ar * br) / (distance * distance * distance) * HARTREE_TO_EV;
+    }
+
+    double charge = mu / length_bohr;
+    double sum = 0.0;
+    for (int s = -1; s <= 1; s += 2) {
+        for (int t = -1; t <= 1; t += 2) {
+            double d[3];
+            for (int c = 0; c < 3; ++c) {
+                d[c] = r[c] + 0.5 * length_bohr * (t * b[c] - s * a[c]);
+            }
+            sum += s * t / std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        }
+    }
+    return charge * charge * sum * HARTREE_TO_EV;
+}
+
+// Function to assemble the off-diagonal exciton couplings of an aggregate.
+// Pairs beyond aggregate_cutoff (Å, 0 for all pairs) are dropped; neighbours
+// are found through a cell list and rows are built in parallel.
+SparseSymmetricMatrix build_exciton_couplings(const AggregateSites& sites, double mu, const PlotSpecParams& params) {
+    const size_t n_sites = sites.size();
+    const double cutoff = params.aggregate_cutoff_angstrom;
+    const double length_bohr = params.aggregate_coupling == "extended"
+                                   ? params.aggregate_dipole_length_angstrom / BOHR_TO_ANGSTROM : 0.0;
+
+    // Cell list with cells as wide as the cutoff; without a cutoff one cell holds every site
+    const double x_min = *std::min_element(sites.x.begin(), sites.x.end());
+    const double y_min = *std::min_element(sites.y.begin(), sites.y.end());
+    const double z_min = *std::min_element(sites.z.begin(), sites.z.end());
+    auto cell_of = [&](size_t i, int64_t cell[3]) {
+        cell[0] = cutoff > 0.0 ? static_cast<int64_t>((sites.x[i] - x_min) / cutoff) : 0;
+        cell[1] = cutoff > 0.0 ? static_cast<int64_t>((sites.y[i] - y_min) / cutoff) : 0;
+        cell[2] = cutoff > 0.0 ? static_cast<int64_t>((sites.z[i] - z_min) / cutoff) : 0;
+    };
+    // Neighbour cells start at -1, so keys are shifted to stay non-negative
+    auto cell_key = [](int64_t cx, int64_t cy, int64_t cz) {
+        const int64_t base = int64_t(1) << 20;
+        return ((cx + 1) * base + (cy + 1)) * base + (cz + 1);
+    };
+    std::unordered_map<int64_t, std::vector<size_t>> cells;
+    for (size_t i = 0; i < n_sites; ++i) {
+        int64_t cell[3];
+        cell_of(i, cell);
+        cells[cell_key(cell[0], cell[1], cell[2])].push_back(i);
+    }
+    const int reach = cutoff > 0.0 ? 1 : 0;
+
+    std::vector<std::vector<std::pair<size_t, double>>> rows(n_sites);
+    parallel_for_chunks(n_sites, AGGREGATE_MIN_CHUNK, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            int64_t cell[3];
+            cell_of(i, cell);
+            const double a[3] = {sites.ux[i], sites.uy[i], sites.uz[i]};
+            for (int dx = -reach; dx <= reach; ++dx) {
+                for (int dy = -reach; dy <= reach; ++dy) {
+                    for (int dz = -reach; dz <= reach; ++dz) {
+                        auto found = cells.find(cell_key(cell[0] + dx, cell[1] + dy, cell[2] + dz));
+                        if (found == cells.end()) continue;
+                        for (size_t j : found->second) {
+                            if (j == i) continue;
+                            double r[3] = {sites.x[j] - sites.x[i], sites.y[j] - sites.y[i], sites.z[j] - sites.z[i]};
+                            double distance = std::sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2]);
+                            if ((cutoff > 0.0 && distance > cutoff) || distance <= 0.0) continue;
+                            for (double& component : r) {
+                                component /= BOHR_TO_ANGSTROM;
+                            }
+                            const double b[3] = {sites.ux[j], sites.uy[j], sites.uz[j]};
+                            rows[i].emplace_back(j, exciton_coupling(r, a, b, mu, length_bohr));
+                        }
+                    }
+                }
+            }
+            std::sort(rows[i].begin(), rows[i].end());
+        }
+    });
+
+    SparseSymmetricMatrix couplings;
+    couplings.row_start.push_back(0);
+    for (const auto& row : rows) {
+        for (const auto& entry : row) {
+            couplings.column.push_back(entry.first);
+            couplings.value.push_back(entry.second);
+        }
+        couplings.row_start.push_back(couplings.column.size());
+    }
+    return couplings;
+}
+
+// Function to diagonalize a dense symmetric matrix (column-major, n x n) by
+// Householder tridiagonalization and implicit QL iteration (EISPACK tred2 and
+// tql2). Returns the eigenvalues in d; instead of the eigenvectors, the
+// projections of each column of vectors (n x n_vectors, column-major) onto
+// them are returned in vectors, row n holding the projections onto eigenvector n.
+void symmetric_eigen_projections(std::vector<double>& a, int n, std::vector<double>& d,
+                                 std::vector<double>& vectors, int n_vectors) {
+    auto V = [&a, n](int row, int col) -> double& { return a[static_cast<size_t>(col) * n + row]; };
+    d.assign(n, 0.0);
+    std::vector<double> e(n, 0.0);
+
+    // Householder reduction to tridiagonal form, accumulating the transformation in a
+    for (int j = 0; j < n; ++j) {
+        d[j] = V(n - 1, j);
+    }
+    for (int i = n - 1; i > 0; --i) {
+        double scale = 0.0;
+        double h = 0.0;
+        for (int k = 0; k < i; ++k) {
+            scale += std::abs(d[k]);
+        }
+        if (scale == 0.0) {
+            e[i] = d[i - 1];
+            for (int j = 0; j < i; ++j) {
+                d[j] = V(i - 1, j);
+                V(i, j) = 0.0;
+                V(j, i) = 0.0;
+            }
+        } else {
+            for (int k = 0; k < i; ++k) {
+                d[k] /= scale;
+                h += d[k] * d[k];
+            }
+            double f = d[i - 1];
+            double g = f > 0.0 ? -std::sqrt(h) : std::sqrt(h);
+            e[i] = scale * g;
+            h -= f * g;
+            d[i - 1] = f - g;
+            for (int j = 0; j < i; ++j) {
+                e[j] = 0.0;
+            }
+            for (int j = 0; j < i; ++j) {
+                f = d[j];
+                V(j, i) = f;
+                g = e[j] + V(j, j) * f;
+                for (int k = j + 1; k <= i - 1; ++k) {
+                    g += V(k, j) * d[k];
+                    e[k] += V(k, j) * f;
+                }
+                e[j] = g;
+            }
+            f = 0.0;
+            for (int j = 0; j < i; ++j) {
+                e[j] /= h;
+                f += e[j] * d[j];
+            }
+            double hh = f / (h + h);
+            for (int j = 0; j < i; ++j) {
+                e[j] -= hh * d[j];
+            }
+            for (int j = 0; j < i; ++j) {
+                f = d[j];
+                g = e[j];
+                for (int k = j; k <= i - 1; ++k) {
+                    V(k, j) -= (f * e[k] + g * d[k]);
+                }
+                d[j] = V(i - 1, j);
+                V(i, j) = 0.0;
+            }
+        }
+        d[i] = h;
+    }
+    for (int i = 0; i < n - 1; ++i) {
+        V(n - 1, i) = V(i, i);
+        V(i, i) = 1.0;
+        double h = d[i + 1];
+        if (h != 0.0) {
+            for (int k = 0; k <= i; ++k) {
+                d[k] = V(k, i + 1) / h;
+            }
+            for (int j = 0; j <= i; ++j) {
+                double g = 0.0;
+                for (int k = 0; k <= i; ++k) {
+                    g += V(k, i + 1) * V(k, j);
+                }
+                for (int k = 0; k <= i; ++k) {
+                    V(k, j) -= g * d[k];
+                }
+            }
+        }
+        for (int k = 0; k <= i; ++k) {
+            V(k, i + 1) = 0.0;
+        }
+    }
+    for (int j = 0; j < n; ++j) {
+        d[j] = V(n - 1, j);
+        V(n - 1, j) = 0.0;
+    }
+    V(n - 1, n - 1) = 1.0;
+    e[0] = 0.0;
+
+    // Project the vectors onto the tridiagonal basis; the QL rotations are then
+    // applied to these n_vectors rows instead of a full eigenvector matrix
+    std::vector<double> projected(static_cast<size_t>(n_vectors) * n, 0.0); // row-major n_vectors x n
+    for (int c = 0; c < n_vectors; ++c) {
+        for (int col = 0; col < n; ++col) {
+            double sum = 0.0;
+            for (int row = 0; row < n; ++row) {
+                sum += V(row, col) * vectors[static_cast<size_t>(c) * n + row];
+            }
+            projected[static_cast<size_t>(c) * n + col] = sum;
+        }
+    }
+
+    // Implicit QL iteration on the tridiagonal matrix
+    for (int i = 1; i < n; ++i) {
+        e[i - 1] = e[i];
+    }
+    e[n - 1] = 0.0;
+    double f = 0.0;
+    double tst1 = 0.0;
+    const double eps = std::numeric_limits<double>::epsilon();
+    for (int l = 0; l < n; ++l) {
+        tst1 = std::max(tst1, std::abs(d[l]) + std::abs(e[l]));
+        int m = l;
+        while (m < n - 1 && std::abs(e[m]) > eps * tst1) {
+            ++m;
+        }
+        if (m > l) {
+            do {
+                double g = d[l];
+                double p = (d[l + 1] - g) / (2.0 * e[l]);
+                double r = std::hypot(p, 1.0);
+                if (p < 0.0) r = -r;
+                d[l] = e[l] / (p + r);
+                d[l + 1] = e[l] * (p + r);
+                double dl1 = d[l + 1];
+                double h = g - d[l];
+                for (int i = l + 2; i < n; ++i) {
+                    d[i] -= h;
+                }
+                f += h;
+
+                p = d[m];
+                double c = 1.0;
+                double c2 = c;
+                double c3 = c;
+                double el1 = e[l + 1];
+                double s = 0.0;
+                double s2 = 0.0;
+                for (int i = m - 1; i >= l; --i) {
+                    c3 = c2;
+                    c2 = c;
+                    s2 = s;
+                    g = c * e[i];
+                    h = c * p;
+                    r = std::hypot(p, e[i]);
+                    e[i + 1] = s * r;
+                    s = e[i] / r;
+                    c = p / r;
+                    p = c * d[i] - s * g;
+                    d[i + 1] = h + s * (c * g + s * d[i]);
+                    for (int k = 0; k < n_vectors; ++k) {
+                        double* row = &projected[static_cast<size_t>(k) * n];
+                        h = row[i + 1];
+                        row[i + 1] = s * row[i] + c * h;
+                        row[i] = c * row[i] - s * h;
+                    }
+                }
+                p = -s * s2 * c3 * el1 * e[l] / dl1;
+                e[l] = s * p;
+                d[l] = c * p;
+            } while (std::abs(e[l]) > eps * tst1);
+        }
+        d[l] += f;
+        e[l] = 0.0;
+    }
+
+    vectors.assign(static_cast<size_t>(n) * n_vectors, 0.0);
+    for (int row = 0; row < n; ++row) {
+        for (int c = 0; c < n_vectors; ++c) {
+            vectors[static_cast<size_t>(row) * n_vectors + c] = projected[static_cast<size_t>(c) * n + row];
+        }
+    }
+}
+
+// Function to get the exciton eigenstates of one aggregate realization as
+// energies (eV) and squared unit transition dipoles |sum_i c_i u_i|^2
+void dense_exciton_sticks(const SparseSymmetricMatrix& couplings, const std::vector<double>& site_ev,
+                          const AggregateSites& sites, std::vector<double>& energies, std::vector<double>& weights) {
+    const int n = static_cast<int>(site_ev.size());
+    std::vector<double> hamiltonian(static_cast<size_t>(n) * n, 0.0);
+    for (int i = 0; i < n; ++i) {
+        hamiltonian[static_cast<size_t>(i) * n + i] = site_ev[i];
+        for (size_t k = couplings.row_start[i]; k < couplings.row_start[i + 1]; ++k) {
+            hamiltonian[couplings.column[k] * n + i] = couplings.value[k];
+        }
+    }
+
+    std::vector<double> dipoles(static_cast<size_t>(3) * n);
+    std::copy(sites.ux.begin(), sites.ux.end(), dipoles.begin());
+    std::copy(sites.uy.begin(), sites.uy.end(), dipoles.begin() + n);
+    std::copy(sites.uz.begin(), sites.uz.end(), dipoles.begin() + 2 * n);
+
+    std::vector<double> eigenvalues;
+    symmetric_eigen_projections(hamiltonian, n, eigenvalues, dipoles, 3);
+    for (int state = 0; state < n; ++state) {
+        const double* p = &dipoles[static_cast<size_t>(state) * 3];
+        energies.push_back(eigenvalues[state]);
+        weights.push_back(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+    }
+}
+
+// Function to get the dipole-weighted exciton density of states of one large
+// aggregate realization with the kernel polynomial method: Chebyshev moments
+// of the site-dipole vectors under the rescaled Hamiltonian, damped by the
+// Jackson kernel and resolved to well below the line width. The x, y and z
+// dipole vectors share each sparse matrix-vector product.
+void kpm_exciton_sticks(const SparseSymmetricMatrix& couplings, const std::vector<double>& site_ev,
+                        const AggregateSites& sites, double fwhm_ev,
+                        std::vector<double>& energies, std::vector<double>& weights) {
+    const size_t n = site_ev.size();
+
+    // Spectral bounds from Gershgorin discs
+    double e_min = std::numeric_limits<double>::max();
+    double e_max = std::numeric_limits<double>::lowest();
+    for (size_t i = 0; i < n; ++i) {
+        double radius = 0.0;
+        for (size_t k = couplings.row_start[i]; k < couplings.row_start[i + 1]; ++k) {
+            radius += std::abs(couplings.value[k]);
+        }
+        e_min = std::min(e_min, site_ev[i] - radius);
+        e_max = std::max(e_max, site_ev[i] + radius);
+    }
+    const double center = 0.5 * (e_max + e_min);
+    const double half_width = std::max(0.5 * (e_max - e_min), 1e-3) / (1.0 - KPM_EDGE_MARGIN);
+
+    const double sigma = fwhm_ev * FWHM_TO_SIGMA;
+    // The Jackson kernel resolution pi * half_width / n_moments is kept well below sigma
+    size_t n_moments = static_cast<size_t>(std::ceil(PI * half_width / (KPM_RESOLUTION_FRACTION * sigma)));
+    n_moments = std::min(std::max<size_t>(n_moments + (n_moments & 1), 64), KPM_MAX_MOMENTS);
+
+    // y = (H - center) / half_width * x for three interleaved vectors
+    auto apply = [&](const std::vector<double>& x, std::vector<double>& y) {
+        for (size_t i = 0; i < n; ++i) {
+            double diagonal = site_ev[i] - center;
+            double y0 = diagonal * x[3 * i];
+            double y1 = diagonal * x[3 * i + 1];
+            double y2 = diagonal * x[3 * i + 2];
+            for (size_t k = couplings.row_start[i]; k < couplings.row_start[i + 1]; ++k) {
+                size_t j = couplings.column[k];
+                double value = couplings.value[k];
+                y0 += value * x[3 * j];
+                y1 += value * x[3 * j + 1];
+                y2 += value * x[3 * j + 2];
+            }
+            y[3 * i] = y0 / half_width;
+            y[3 * i + 1] = y1 / half_width;
+            y[3 * i + 2] = y2 / half_width;
+        }
+    };
+    auto dot = [](const std::vector<double>& a, const std::vector<double>& b) {
+        double sum = 0.0;
+        for (size_t i = 0; i < a.size(); ++i) {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    };
+
+    // Chebyshev moments, two per matrix-vector product
+    std::vector<double> previous(3 * n);
+    for (size_t i = 0; i < n; ++i) {
+        previous[3 * i] = sites.ux[i];
+        previous[3 * i + 1] = sites.uy[i];
+        previous[3 * i + 2] = sites.uz[i];
+    }
+    std::vector<double> current(3 * n);
+    std::vector<double> next(3 * n);
+    apply(previous, current);
+    std::vector<double> moments(n_moments, 0.0);
+    moments[0] = dot(previous, previous);
+    moments[1] = dot(current, previous);
+    for (size_t m = 1; 2 * m + 1 < n_moments; ++m) {
+        apply(current, next);
+        for (size_t i = 0; i < next.size(); ++i) {
+            next[i] = 2.0 * next[i] - previous[i];
+        }
+        moments[2 * m] = 2.0 * dot(current, current) - moments[0];
+        moments[2 * m + 1] = 2.0 * dot(next, current) - moments[1];
+        previous.swap(current);
+        current.swap(next);
+    }
+
+    // Jackson kernel
+    const double kernel_arg = PI / static_cast<double>(n_moments + 1);
+    for (size_t m = 0; m < n_moments; ++m) {
+        double kernel = ((n_moments - m + 1) * std::cos(kernel_arg * m) +
+                         std::sin(kernel_arg * m) / std::tan(kernel_arg)) / static_cast<double>(n_moments + 1);
+        moments[m] *= kernel;
+    }
+
+    // Chebyshev-node quadrature of the density; the weights sum to moments[0]
+    const size_t n_nodes = 2 * n_moments;
+    for (size_t node = 0; node < n_nodes; ++node) {
+        double theta = PI * (static_cast<double>(node) + 0.5) / static_cast<double>(n_nodes);
+        double sum = moments[0];
+        for (size_t m = 1; m < n_moments; ++m) {
+            sum += 2.0 * moments[m] * std::cos(theta * m);
+        }
+        energies.push_back(center + half_width * std::cos(theta));
+        weights.push_back(std::max(0.0, sum) / static_cast<double>(n_nodes));
+    }
+}
+
+// Function to compute the absorption sticks of an aggregate built from one
+// monomer state, averaged over static-disorder realizations. Couplings are
+// assembled once; the realizations draw their own site energies and run in
+// parallel. Strengths are per site, so aggregate and monomer share a scale.
+void aggregate_sticks(const ExcitedStateStore& monomer, const PlotSpecParams& params,
+                      std::vector<double>& positions_cm, std::vector<double>& strengths) {
+    auto state_it = std::find(monomer.state_number.begin(), monomer.state_number.end(), params.aggregate_state);
+    if (state_it == monomer.state_number.end()) {
+        throw std::runtime_error("Aggregate monomer state " + std::to_string(params.aggregate_state) +
+                                 " not found in " + monomer.source_file);
+    }
+    const size_t row = static_cast<size_t>(state_it - monomer.state_number.begin());
+    const double monomer_ev = monomer.energy_ev[row];
+
+    // Transition dipole from the output, or its magnitude from the oscillator strength along z
+    double direction[3] = {monomer.dipole_x[row], monomer.dipole_y[row], monomer.dipole_z[row]};
+    double mu = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+    if (mu <= 0.0) {
+        mu = std::sqrt(1.5 * monomer.osc_strength[row] / (monomer_ev / HARTREE_TO_EV));
+        direction[0] = 0.0;
+        direction[1] = 0.0;
+        direction[2] = 1.0;
+    }
+
+    AggregateSites sites = load_aggregate_sites(params, direction);
+    SparseSymmetricMatrix couplings = build_exciton_couplings(sites, mu, params);
+    const bool dense = sites.size() <= AGGREGATE_DENSE_MAX_SITES;
+    const size_t n_realizations = params.aggregate_disorder_ev > 0.0
+                                      ? static_cast<size_t>(std::max(1, params.aggregate_realizations)) : 1;
+    std::cout << "  Aggregate of " << sites.size() << " sites, " << couplings.column.size() / 2
+              << " couplings, " << n_realizations << " realization(s), "
+              << (dense ? "dense diagonalization" : "kernel polynomial method") << std::endl;
+
+    std::vector<std::vector<double>> energies(n_realizations);
+    std::vector<std::vector<double>> weights(n_realizations);
+    parallel_for_chunks(n_realizations, 1, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; ++r) {
+            std::mt19937_64 generator(AGGREGATE_DISORDER_SEED + r);
+            std::normal_distribution<double> disorder(0.0, std::max(params.aggregate_disorder_ev, 0.0));
+            std::vector<double> site_ev(sites.size());
+            for (size_t i = 0; i < sites.size(); ++i) {
+                site_ev[i] = monomer_ev + sites.energy_offset_ev[i] +
+                             (params.aggregate_disorder_ev > 0.0 ? disorder(generator) : 0.0);
+            }
+            if (dense) {
+                dense_exciton_sticks(couplings, site_ev, sites, energies[r], weights[r]);
+            } else {
+                kpm_exciton_sticks(couplings, site_ev, sites, params.fwhm_cm_minus_1 / EV_TO_CM_MINUS_1,
+                                   energies[r], weights[r]);
+            }
+        }
+    });
+
+    // f = 2/3 E |mu|^2 in atomic units, averaged over realizations and sites
+    std::vector<std::pair<double, double>> sticks;
+    const double scale = 1.0 / static_cast<double>(n_realizations * sites.size());
+    for (size_t r = 0; r < n_realizations; ++r) {
+        for (size_t k = 0; k < energies[r].size(); ++k) {
+            double energy = energies[r][k];
+            if (energy <= 0.0) continue;
+            double osc = 2.0 / 3.0 * (energy / HARTREE_TO_EV) * mu * mu * weights[r][k] * scale;
+            sticks.emplace_back(energy * EV_TO_CM_MINUS_1, PREFAC_BROADENING_BASE * osc);
+        }
+    }
+    std::sort(sticks.begin(), sticks.end());
+    for (const auto& stick : sticks) {
+        positions_cm.push_back(stick.first);
+        strengths.push_back(stick.second);
+    }
+}
+
+// Function to get the energy window of roots kept while parsing xas outputs:
+// the configured xas_window, or the plotted range widened by the line shape
+void xas_energy_window(const PlotSpecParams& params, double& min_ev, double& max_ev) {
+    if (params.xas_window_max_ev > params.xas_window_min_ev) {
+        min_ev = params.xas_window_min_ev;
+        max_ev = params.xas_window_max_ev;
+        return;
+    }
+    double offset = x_axis_offset(params);
+    double start_ev = x_to_wavenumber(params.x_start + offset, params.unit) / EV_TO_CM_MINUS_1;
+    double end_ev = x_to_wavenumber(params.x_end + offset, params.unit) / EV_TO_CM_MINUS_1;
+    double margin_ev = GAUSSIAN_WINDOW_SIGMAS * params.fwhm_cm_minus_1 * FWHM_TO_SIGMA / EV_TO_CM_MINUS_1;
+    min_ev = std::min(start_ev, end_ev) - margin_ev;
+    max_ev = std::max(start_ev, end_ev) + margin_ev;
+}
+
+// Function to generate the x-axis grid
+std::vector<double> make_grid(const PlotSpecParams& params) {
+    std::vector<double> x_values;
+    double current_x = params.x_start;
+    while (current_x <= params.x_end + 1e-8) {
+        x_values.push_back(current_x);
+        current_x += params.interval;
+    }
+    return x_values;
+}
+
+// Function to get the path of the per-point spectra written for a scan input
+std::string scan_heatmap_path(const PlotSpecParams& params, const std::string& full_filename) {
+    return params.output_filename + "_" + std::filesystem::path(full_filename).stem().string() + "_heatmap.csv";
+}
+
+// Function to calculate spectrum from single BDF output file
+SpectrumData calculate_single_spectrum(const std::string& filename, const PlotSpecParams& params) {
+    std::string full_filename = resolve_input_filename(filename);
+    std::cout << "Processing: " << full_filename << std::endl;
+
+    SpectrumData spectrum;
+    spectrum.x_values = make_grid(params);
+
+    // Analytic derivative series, filled by the Gaussian broadening paths
+    std::vector<double> first_derivative;
+    std::vector<double> second_derivative;
+    auto wants_order = [&](int order) {
+        return std::find(params.derivatives.begin(), params.derivatives.end(), order) != params.derivatives.end();
+    };
+    std::vector<double>* first_out = wants_order(1) ? &first_derivative : nullptr;
+    std::vector<double>* second_out = wants_order(2) ? &second_derivative : nullptr;
+
+    if (is_vibrational_mode(params.mode)) {
+        spectrum.modes = parse_bdf_frequencies(full_filename, params.freq_scale);
+        if (spectrum.modes.size() == 0) {
+            throw std::runtime_error("No vibrational frequencies found in BDF output file: " + full_filename);
+        }
+        std::cout << "  Found " << spectrum.modes.size() << " normal modes" << std::endl;
+
+        const auto& strengths = params.mode == "ir" ? spectrum.modes.ir_intensity : spectrum.modes.raman_activity;
+        spectrum.y_values = broaden_sticks(spectrum.modes.frequency_cm, strengths, spectrum.x_values,
+                                           params.unit, params.vib_fwhm_cm_minus_1, first_out, second_out);
+        if (params.mode == "ir") {
+            spectrum.y_label = "IR Intensity (km/(mol·cm⁻¹))";
+            spectrum.title = "IR Spectra";
+        } else {
+            spectrum.y_label = "Raman Activity (Å⁴/(amu·cm⁻¹))";
+            spectrum.title = "Raman Spectra";
+        }
+    } else if (params.mode == "scan") {
+        ScanStore scan = parse_bdf_scan(full_filename);
+        size_t n_curves = scan.size() > 0 ? static_cast<size_t>(std::max(params.scan_states, 1)) : 0;
+        for (size_t p = 0; p < scan.size(); ++p) {
+            n_curves = std::min(n_curves, scan.point_start[p + 1] - scan.point_start[p]);
+        }
+        if (n_curves == 0) {
+            throw std::runtime_error("No scan points with excited states found in BDF output file: " + full_filename);
+        }
+        std::cout << "  Found " << scan.size() << " scan points, tracking " << n_curves << " states" << std::endl;
+
+        std::vector<size_t> tracked = track_scan_states(scan, n_curves, params);
+        const std::vector<double>& quantity = params.scan_quantity == "osc" ? scan.osc_strength : scan.energy_ev;
+        spectrum.x_values = scan.coordinate;
+        for (size_t k = 0; k < n_curves; ++k) {
+            std::vector<double> curve(scan.size());
+            for (size_t p = 0; p < scan.size(); ++p) {
+                curve[p] = quantity[tracked[p * n_curves + k]];
+            }
+            if (k == 0) {
+                spectrum.y_values = std::move(curve);
+            } else {
+                spectrum.extra_y_values.push_back(std::move(curve));
+                spectrum.extra_labels.push_back("state " + std::to_string(k + 1));
+            }
+        }
+
+        if (params.scan_heatmap) {
+            std::vector<double> grid = make_grid(params);
+            std::vector<double> heatmap(scan.size() * grid.size());
+            for (size_t p = 0; p < scan.size(); ++p) {
+                std::vector<double> positions;
+                std::vector<double> strengths;
+                for (size_t i = scan.point_start[p]; i < scan.point_start[p + 1]; ++i) {
+                    positions.push_back(scan.energy_ev[i] * EV_TO_CM_MINUS_1);
+                    strengths.push_back(PREFAC_BROADENING_BASE * scan.osc_strength[i]);
+                }
+                std::vector<double> y = broaden_sticks(positions, strengths, grid, params.unit, params.fwhm_cm_minus_1);
+                std::copy(y.begin(), y.end(), heatmap.begin() + p * grid.size());
+            }
+            std::string heatmap_path = scan_heatmap_path(params, full_filename);
+            write_matrix_csv(heatmap_path, "coordinate", scan.coordinate, grid, heatmap);
+            std::cout << "  Spectrum per scan point written to " << heatmap_path << std::endl;
+        }
+
+        spectrum.x_label = "Scan coordinate";
+        spectrum.y_label = params.scan_quantity == "osc" ? "Oscillator Strength" : "Excitation Energy (eV)";
+        spectrum.title = "Geometry Scan";
+        return spectrum;
+    } else if (params.mode == "rt") {
+        DipoleTrace trace = parse_rt_dipole_trace(full_filename);
+        if (trace.size() < 2) {
+            throw std::runtime_error("No dipole trace found in file: " + full_filename);
+        }
+        std::cout << "  Found " << trace.size() << " time steps, " << trace.dipole.size() << " polarization(s)" << std::endl;
+
+        spectrum.y_values = rt_absorption(trace, spectrum.x_values, params);
+        spectrum.y_label = "Molar Absorptivity (L/(mol·cm))";
+        spectrum.title = "Real-Time TDDFT Absorption Spectra";
+    } else if (params.mode == "vibronic") {
+        spectrum.vibronic = parse_bdf_vibronic(full_filename);
+        if (spectrum.vibronic.size() == 0 || spectrum.vibronic.adiabatic_energy_ev <= 0.0) {
+            throw std::runtime_error("No adiabatic energy and Huang-Rhys factors found in BDF output file: " + full_filename);
+        }
+        std::cout << "  Found " << spectrum.vibronic.size() << " displaced modes, 0-0 energy "
+                  << spectrum.vibronic.adiabatic_energy_ev << " eV" << std::endl;
+
+        spectrum.y_values = vibronic_spectrum(spectrum.vibronic, spectrum.x_values, params);
+        spectrum.y_label = "Intensity (arb. units)";
+        spectrum.title = params.vibronic_emission ? "Vibronic Emission Spectra" : "Vibronic Absorption Spectra";
+    } else if (params.mode == "polarized" || params.mode == "ld") {
+        spectrum.states = parse_bdf_excited_states(full_filename);
+        if (spectrum.states.size() == 0) {
+            throw std::runtime_error("No excited states found in BDF output file: " + full_filename);
+        }
+        if (!spectrum.states.has_transition_dipoles && params.orientation_averaging != "isotropic") {
+            throw std::runtime_error("No transition dipole table found in BDF output file: " + full_filename);
+        }
+        std::cout << "  Found " << spectrum.states.size() << " excited states" << std::endl;
+
+        std::vector<double> positions(spectrum.states.size());
+        for (size_t i = 0; i < spectrum.states.size(); ++i) {
+            positions[i] = spectrum.states.energy_ev[i] * EV_TO_CM_MINUS_1;
+        }
+        std::vector<std::vector<double>> channels = broaden_sticks_multichannel(
+            positions, polarized_state_weights(spectrum.states, params), 3, spectrum.x_values, params.unit,
+            params.fwhm_cm_minus_1);
+
+        spectrum.y_values.resize(spectrum.x_values.size());
+        if (params.mode == "ld") {
+            for (size_t g = 0; g < spectrum.x_values.size(); ++g) {
+                spectrum.y_values[g] = channels[2][g] - channels[0][g];
+            }
+            spectrum.extra_y_values.push_back(std::move(channels[2]));
+            spectrum.extra_labels.push_back("A∥ (z)");
+            spectrum.extra_y_values.push_back(std::move(channels[0]));
+            spectrum.extra_labels.push_back("A⊥ (x)");
+            spectrum.y_label = "LD = ε∥ - ε⊥ (L/(mol·cm))";
+            spectrum.title = "Linear Dichroism Spectra";
+        } else {
+            for (size_t g = 0; g < spectrum.x_values.size(); ++g) {
+                spectrum.y_values[g] = (channels[0][g] + channels[1][g] + channels[2][g]) / 3.0;
+            }
+            const char* axes[3] = {"x", "y", "z"};
+            for (int a = 0; a < 3; ++a) {
+                spectrum.extra_y_values.push_back(std::move(channels[a]));
+                spectrum.extra_labels.push_back(std::string(axes[a]) + "-polarized");
+            }
+            spectrum.y_label = "Molar Absorptivity (L/(mol·cm))";
+            spectrum.title = "Polarized Absorption Spectra";
+        }
+    } else if (params.mode == "esa") {
+        ExcitedStateStore ground = parse_bdf_excited_states(full_filename);
+        StateTransitionStore transitions = parse_bdf_state_transitions(full_filename);
+        if (transitions.size() == 0) {
+            throw std::runtime_error("No state-to-state transitions found in BDF output file: " + full_filename);
+        }
+        std::cout << "  Found " << transitions.size() << " state-to-state transitions and "
+                  << ground.size() << " ground-state transitions" << std::endl;
+
+        std::vector<std::vector<double>> channels = transient_absorption_channels(ground, transitions,
+                                                                                  spectrum.x_values, params);
+        spectrum.y_values.assign(spectrum.x_values.size(), 0.0);
+        for (const auto& channel : channels) {
+            for (size_t g = 0; g < channel.size(); ++g) {
+                spectrum.y_values[g] += channel[g];
+            }
+        }
+        for (size_t r = 0; r < params.esa_states.size(); ++r) {
+            spectrum.extra_y_values.push_back(std::move(channels[r]));
+            spectrum.extra_labels.push_back("ESA from state " + std::to_string(params.esa_states[r]));
+        }
+        if (params.esa_bleach) {
+            spectrum.extra_y_values.push_back(std::move(channels.back()));
+            spectrum.extra_labels.push_back("Ground-state bleach");
+        }
+        spectrum.y_label = "Δε (L/(mol·cm))";
+        spectrum.title = "Transient Absorption Spectra";
+    } else if (params.mode == "aggregate") {
+        ExcitedStateStore monomer = parse_bdf_excited_states(full_filename);
+        if (monomer.size() == 0) {
+            throw std::runtime_error("No excited states found in BDF output file: " + full_filename);
+        }
+
+        std::vector<double> positions;
+        std::vector<double> strengths;
+        aggregate_sticks(monomer, params, positions, strengths);
+        spectrum.y_values = broaden_sticks(positions, strengths, spectrum.x_values, params.unit, params.fwhm_cm_minus_1,
+                                           first_out, second_out);
+        spectrum.y_label = "Molar Absorptivity per Site (L/(mol·cm))";
+        spectrum.title = "Exciton Aggregate Absorption Spectra";
+    } else if (params.mode == "xas") {
+        double min_ev = 0.0;
+        double max_ev = 0.0;
+        xas_energy_window(params, min_ev, max_ev);
+        spectrum.states = parse_bdf_excited_states(full_filename, min_ev, max_ev);
+        if (spectrum.states.size() == 0) {
+            throw std::runtime_error("No excited states inside the xas window in BDF output file: " + full_filename);
+        }
+        std::cout << "  Found " << spectrum.states.size() << " excited states in " << min_ev << " - "
+                  << max_ev << " eV" << std::endl;
+
+        std::vector<double> absolute_x = spectrum.x_values;
+        for (double& x : absolute_x) {
+            x += x_axis_offset(params);
+        }
+        spectrum.y_values = broaden_states(spectrum.states, absolute_x, params, first_out, second_out);
+        spectrum.y_label = "Molar Absorptivity (L/(mol·cm))";
+        spectrum.title = "X-ray Absorption Spectra";
+    } else if (params.mode == "dos") {
+        spectrum.orbitals = parse_bdf_orbitals(full_filename);
+        if (spectrum.orbitals.size() == 0) {
+            throw std::runtime_error("No orbital energies found in BDF output file: " + full_filename);
+        }
+        std::cout << "  Found " << spectrum.orbitals.size() << " orbitals, "
+                  << spectrum.orbitals.projection_labels.size() << " projections" << std::endl;
+
+        auto channels = broaden_orbitals(spectrum.orbitals, spectrum.x_values, params);
+        spectrum.y_values = std::move(channels[0]);
+        for (size_t k = 0; k < spectrum.orbitals.projection_labels.size(); ++k) {
+            spectrum.extra_y_values.push_back(std::move(channels[k + 1]));
+            spectrum.extra_labels.push_back("PDOS " + spectrum.orbitals.projection_labels[k]);
+        }
+        spectrum.y_label = "DOS (states/eV)";
+        spectrum.title = "Density of States";
+    } else {
+        // Excited-state optimizations emit from the followed root at the final
+        // geometry. The optimization marker alone is not enough, a ground-state
+        // optimization followed by a TDDFT single point prints it too, so a
+        // followed root must be given or echoed in the input.
+        std::streamoff cycle_offset = params.mode == "emi" && !params.soc_states
+                                          ? find_last_occurrence(full_filename, TDOPT_CYCLE_MARKER) : -1;
+        int root = 0;
+        if (cycle_offset >= 0) {
+            root = params.emi_root > 0 ? params.emi_root : find_followed_root(full_filename);
+            if (root <= 0) {
+                cycle_offset = -1;
+            }
+        }
+        spectrum.states = params.soc_states ? parse_bdf_soc_states(full_filename)
+                                            : parse_bdf_excited_states(full_filename, std::numeric_limits<double>::lowest(),
+                                                                       std::numeric_limits<double>::max(),
+                                                                       std::max<std::streamoff>(cycle_offset, 0));
+        if (spectrum.states.size() == 0) {
+            throw std::runtime_error("No excited states found in BDF output file: " + full_filename);
+        }
+        if (cycle_offset >= 0) {
+            auto root_it = std::find(spectrum.states.state_number.begin(), spectrum.states.state_number.end(), root);
+            if (root_it == spectrum.states.state_number.end()) {
+                throw std::runtime_error("Root " + std::to_string(root) +
+                                         " not found in the last optimization cycle of " + full_filename);
+            }
+            spectrum.states = select_state(spectrum.states, static_cast<size_t>(root_it - spectrum.states.state_number.begin()));
+            std::cout << "  Excited-state optimization: emitting root " << root << " at the final geometry, "
+                      << spectrum.states.energy_ev[0] << " eV" << std::endl;
+        }
+        std::cout << "  Found " << spectrum.states.size() << (params.soc_states ? " spin-orbit" : "")
+                  << " excited states" << std::endl;
+        if (params.soc_states && params.soc_merge_tolerance_ev > 0.0) {
+            merge_spin_sublevels(spectrum.states, params.soc_merge_tolerance_ev,
+                                 params.mode == "emi" ? params.kT_eV : 0.0);
+            std::cout << "  Merged into " << spectrum.states.size() << " levels" << std::endl;
+        }
+
+        if (params.mode == "emi" && params.emi_lineshape == "mlj") {
+            spectrum.y_values = mlj_emission(spectrum.states, spectrum.x_values, params);
+        } else {
+            spectrum.y_values = broaden_states(spectrum.states, spectrum.x_values, params, first_out, second_out);
+        }
+
+        if (params.mode == "emi") {
+            double y_peak = *std::max_element(spectrum.y_values.begin(), spectrum.y_values.end());
+            if (y_peak > 0.0) {
+                for (double& y : spectrum.y_values) {
+                    y /= y_peak;
+                }
+                for (double& dy : first_derivative) {
+                    dy /= y_peak;
+                }
+                for (double& d2y : second_derivative) {
+                    d2y /= y_peak;
+                }
+            }
+            spectrum.y_label = "Emission Intensity (arb. units)";
+            spectrum.title = "Emission Spectra";
+        } else if (params.mode == "cd" || params.mode == "cdl") {
+            spectrum.y_label = "Δε (L/(mol·cm))";
+            spectrum.title = "Circular Dichroism Spectra";
+        } else {
+            spectrum.y_label = "Molar Absorptivity (L/(mol·cm))";
+            spectrum.title = "Absorption Spectra";
+        }
+    }
+
+    if ((first_out && first_derivative.empty()) || (second_out && second_derivative.empty())) {
+        std::cerr << "Warning: analytic derivatives are not available for this line shape" << std::endl;
+    }
+    if (!first_derivative.empty()) {
+        spectrum.extra_y_values.push_back(std::move(first_derivative));
+        spectrum.extra_labels.push_back("d/dx");
+    }
+    if (!second_derivative.empty()) {
+        spectrum.extra_y_values.push_back(std::move(second_derivative));
+        spectrum.extra_labels.push_back("d²/dx²");
+    }
+
+    // Set x-axis label
+    if (params.unit == "nm") {
+        spectrum.x_label = "Wavelength (nm)";
+    } else if (params.unit == "eV") {
+        spectrum.x_label = "Energy (eV)";
+    } else if (params.unit == "cm-1") {
+        spectrum.x_label = "Wavenumber (cm⁻¹)";
+    }
+    if (x_axis_offset(params) != 0.0) {
+        spectrum.x_label = "Energy relative to edge (eV)";
+    }
+
+    if (params.peak_labels > 0 || params.peak_table) {
+        detect_peaks(spectrum, params);
+    }
+
+    return spectrum;
+}
+
+// Function to hash bytes with 64-bit FNV-1a
+uint64_t fnv1a_hash(const std::string& data, uint64_t hash = 14695981039346656037ULL) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Function to compute the content hash of a render: tool version, every
+// resolved parameter that affects the output, and the size and modification
+// time of each input file
+std::string compute_render_hash(const PlotSpecParams& params) {
+    std::ostringstream key;
+    key << std::hexfloat;
+    key << "version=" << PLOTSPEC_VERSION << "\n";
+    key << "mode=" << params.mode << "\nunit=" << params.unit << "\n";
+    key << "range=" << params.x_start << "," << params.x_end << "," << params.interval << "\n";
+    key << "fwhm=" << params.fwhm_cm_minus_1 << "\nkT=" << params.kT_eV << "\n";
+    key << "vib=" << params.vib_fwhm_cm_minus_1 << "," << params.freq_scale << "\n";
+    key << "vibronic=" << params.vibronic_emission << "\n";
+    key << "rt=" << params.rt_kick_strength << "," << params.rt_window << "," << params.rt_pade << "\n";
+    key << "scan=" << params.scan_states << "," << params.scan_track << "," << params.scan_quantity << ","
+        << params.scan_heatmap << "\n";
+    for (const auto& swap : params.scan_swaps) {
+        key << "swap=";
+        for (int value : swap) {
+            key << value << ",";
+        }
+        key << "\n";
+    }
+    key << "emi_root=" << params.emi_root << "\n";
+    key << "soc=" << params.soc_states << "," << params.soc_merge_tolerance_ev << "\n";
+    key << "lineshape=" << params.emi_lineshape << "," << params.mlj_lambda_s_ev << "," << params.mlj_lambda_v_ev
+        << "," << params.mlj_mode_ev << "\n";
+    for (size_t r = 0; r < params.esa_states.size() && r < params.esa_populations.size(); ++r) {
+        key << "esa=" << params.esa_states[r] << "," << params.esa_populations[r] << "\n";
+    }
+    key << "bleach=" << params.esa_bleach << "\n";
+    key << "orientation=" << params.orientation_averaging << "," << params.order_parameter << "\n";
+    for (double angle : params.orientation_euler) {
+        key << "euler=" << angle << "\n";
+    }
+    for (double component : params.orientation_axis) {
+        key << "axis=" << component << "\n";
+    }
+    key << "aggregate=" << params.aggregate_sites << "," << params.aggregate_state << "," << params.aggregate_coupling
+        << "," << params.aggregate_dipole_length_angstrom << "," << params.aggregate_cutoff_angstrom << ","
+        << params.aggregate_disorder_ev << "," << params.aggregate_realizations << "\n";
+    for (int count : params.aggregate_lattice) {
+        key << "lattice=" << count << "\n";
+    }
+    for (double spacing : params.aggregate_spacing) {
+        key << "spacing=" << spacing << "\n";
+    }
+    if (params.mode == "aggregate" && std::filesystem::is_regular_file(params.aggregate_sites)) {
+        auto mtime = std::filesystem::last_write_time(params.aggregate_sites).time_since_epoch().count();
+        key << "sites=" << std::filesystem::file_size(params.aggregate_sites) << "," << mtime << "\n";
+    }
+    key << "xas=" << params.xas_edge_ev << "," << params.xas_window_min_ev << "," << params.xas_window_max_ev << "\n";
+    key << "output=" << params.output_filename << "." << params.output_format << "\n";
+    key << "sticks=" << params.stick_overlay << "," << params.stick_axis << "\n";
+    for (int order : params.derivatives) {
+        key << "derivative=" << order << "\n";
+    }
+    key << "export_data=" << params.export_data << "\n";
+    key << "ensemble=" << params.ensemble << "," << params.ensemble_rank_error << "\n";
+    for (const auto& band : params.ensemble_bands) {
+        key << "ensemble_band=" << band[0] << "," << band[1] << "\n";
+    }
+    key << "peaks=" << params.peak_labels << "," << params.peak_prominence << "," << params.peak_table << "\n";
+    for (const auto& name : params.legend_names) {
+        key << "legend=" << name << "\n";
+    }
+    for (size_t i = 0; i < params.expressions.size(); ++i) {
+        key << "expression=" << params.expression_names[i] << "=" << params.expressions[i] << "\n";
+    }
+    for (const auto& name : params.plot_series) {
+        key << "series=" << name << "\n";
+    }
+    for (const auto& filename : params.input_filenames) {
+        std::string full_filename = resolve_input_filename(filename);
+        auto mtime = std::filesystem::last_write_time(full_filename).time_since_epoch().count();
+        key << "input=" << std::filesystem::absolute(full_filename).string() << ","
+            << std::filesystem::file_size(full_filename) << "," << mtime << "\n";
+    }
+
+    std::ostringstream hex;
+    hex << std::hex << std::setw(16) << std::setfill('0') << fnv1a_hash(key.str());
+    return hex.str();
+}
+
+// Function to get the path of the hash file stored next to an output file
+std::string render_hash_path(const std::string& output_name) {
+    return output_name + ".plotspec-hash";
+}
+
+// Function to list every file a render writes: the plot and the tables
+// requested alongside it
+std::vector<std::string> render_output_paths(const PlotSpecParams& params) {
+    std::vector<std::string> paths = { params.output_filename + "." + params.output_format };
+    if (params.export_data) {
+        paths.push_back(params.output_filename + "_data.csv");
+    }
+    if (params.peak_table) {
+        paths.push_back(params.output_filename + "_peaks.csv");
+    }
+    if (params.mode == "scan" && params.scan_heatmap) {
+        for (const auto& filename : params.input_filenames) {
+            paths.push_back(scan_heatmap_path(params, resolve_input_filename(filename)));
+        }
+    }
+    return paths;
+}
+
+// Function to check whether the output files were rendered from the same
+// inputs; a missing file makes the whole render stale
+bool render_is_up_to_date(const PlotSpecParams& params) {
+    if (params.render_hash.empty()) {
+        return false;
+    }
+    std::vector<std::string> paths = render_output_paths(params);
+    for (const auto& path : paths) {
+        if (!std::filesystem::exists(path)) {
+            return false;
+        }
+    }
+    std::string output_name = paths.front();
+    std::ifstream hash_file(render_hash_path(output_name));
+    std::string stored_hash;
+    return hash_file >> stored_hash && stored_hash == params.render_hash;
+}
+
+// Function to record the render hash next to an exported file
+void write_render_hash(const std::string& output_name, const std::string& hash) {
+    std::string hash_path = render_hash_path(output_name);
+    std::string temp_path = hash_path + ".tmp";
+    {
+        std::ofstream hash_file(temp_path, std::ios::trunc);
+        if (!hash_file) {
+            std::cerr << "Warning: cannot write render hash file: " << hash_path << std::endl;
+            return;
+        }
+        hash_file << hash << std::endl;
+    }
+    std::filesystem::rename(temp_path, hash_path);
+}
+
+// Streaming quantile sketch (merging t-digest): values are buffered, then
+// merged into weighted centroids whose size shrinks towards the tails, so
+// memory is bounded by the compression and not by the number of values.
+// With the arcsine scale function a centroid spans at most
+// 2 pi sqrt(q (1 - q)) / compression in rank, which bounds the error of an
+// interpolated quantile by pi / (2 compression) at the median and less in the
+// tails. Sketches merge exactly like buffers, so threads can fill their own.
+struct QuantileSketch {
+    std::vector<double> means;
+    std::vector<double> weights;
+    std::vector<std::pair<double, double>> buffer; // value and weight, not yet merged
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+};
+
+// Function to merge the buffered values of a sketch into its centroids
+void quantile_sketch_compress(QuantileSketch& sketch, double compression) {
+    if (sketch.buffer.empty()) {
+        return;
+    }
+    for (size_t c = 0; c < sketch.means.size(); ++c) {
+        sketch.buffer.emplace_back(sketch.means[c], sketch.weights[c]);
+    }
+    std::sort(sketch.buffer.begin(), sketch.buffer.end());
+    double total = 0.0;
+    for (const auto& item : sketch.buffer) {
+        total += item.second;
+    }
+
+    // Largest cumulative rank the current centroid may reach: one unit of
+    // k(q) = compression / (2 pi) asin(2q - 1) past its start
+    auto rank_limit = [compression](double q) {
+        double k = compression / (2.0 * PI) * std::asin(2.0 * q - 1.0) + 1.0;
+        return k >= compression / 4.0 ? 1.0 : 0.5 * (std::sin(2.0 * PI * k / compression) + 1.0);
+    };
+
+    sketch.means.clear();
+    sketch.weights.clear();
+    double mean = sketch.buffer.front().first;
+    double weight = sketch.buffer.front().second;
+    double before = 0.0;
+    double limit = rank_limit(0.0) * total;
+    for (size_t k = 1; k < sketch.buffer.size(); ++k) {
+        const auto& item = sketch.buffer[k];
+        if (before + weight + item.second <= limit) {
+            weight += item.second;
+            mean += (item.first - mean) * item.second / weight;
+        } else {
+            sketch.means.push_back(mean);
+            sketch.weights.push_back(weight);
+            before += weight;
+            limit = rank_limit(before / total) * total;
+            mean = item.first;
+            weight = item.second;
+        }
+    }
+    sketch.means.push_back(mean);
+    sketch.weights.push_back(weight);
+    sketch.buffer.clear();
+}
+
+void quantile_sketch_add(QuantileSketch& sketch, double value, double compression) {
+    sketch.buffer.emplace_back(value, 1.0);
+    sketch.min = std::min(sketch.min, value);
+    sketch.max = std::max(sketch.max, value);
+    if (sketch.buffer.size() >= QUANTILE_BUFFER_FACTOR * static_cast<size_t>(compression)) {
+        quantile_sketch_compress(sketch, compression);
+    }
+}
+
+void quantile_sketch_merge(QuantileSketch& sketch, const QuantileSketch& other, double compression) {
+    sketch.buffer.insert(sketch.buffer.end(), other.buffer.begin(), other.buffer.end());
+    for (size_t c = 0; c < other.means.size(); ++c) {
+        sketch.buffer.emplace_back(other.means[c], other.weights[c]);
+    }
+    sketch.min = std::min(sketch.min, other.min);
+    sketch.max = std::max(sketch.max, other.max);
+    quantile_sketch_compress(sketch, compression);
+}
+
+// Function to read a quantile from a compressed sketch, interpolating
+// between centroid centers and towards the exact minimum and maximum
+double quantile_sketch_quantile(const QuantileSketch& sketch, double q) {
+    if (sketch.means.empty()) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    double total = std::accumulate(sketch.weights.begin(), sketch.weights.end(), 0.0);
+    double target = q * total;
+    double center = 0.5 * sketch.weights.front();
+    if (target <= center) {
+        return sketch.min + (sketch.means.front() - sketch.min) * (center > 0.0 ? target / center : 1.0);
+    }
+    for (size_t c = 0; c + 1 < sketch.means.size(); ++c) {
+        double next_center = center + 0.5 * (sketch.weights[c] + sketch.weights[c + 1]);
+        if (target <= next_center) {
+            double fraction = (target - center) / (next_center - center);
+            return sketch.means[c] + fraction * (sketch.means[c + 1] - sketch.means[c]);
+        }
+        center = next_center;
+    }
+    double tail = total - center;
+    return sketch.means.back() + (sketch.max - sketch.means.back()) * (tail > 0.0 ? (target - center) / tail : 1.0);
+}
+
+// Function to reduce all input files to one ensemble spectrum: the median
+// with shaded quantile bands. Files are computed in parallel and each worker
+// streams its spectra into one sketch per grid point, so memory does not grow
+// with the number of files; the workers' sketches are merged at the end.
+SpectrumData calculate_ensemble_spectrum(const PlotSpecParams& params) {
+    const size_t n = params.input_filenames.size();
+    const double compression = std::ceil(PI / (2.0 * params.ensemble_rank_error));
+    std::cout << "Ensemble of " << n << " spectra, quantile rank error " << params.ensemble_rank_error
+              << " (compression " << compression << ")" << std::endl;
+
+    PlotSpecParams member_params = params;
+    member_params.derivatives.clear();
+    member_params.peak_labels = 0;
+    member_params.peak_table = false;
+
+    SpectrumData ensemble;
+    std::vector<std::vector<QuantileSketch>> partials;
+    std::string error;
+    std::mutex mutex;
+    parallel_for_chunks(n, 1, [&](size_t begin, size_t end) {
+        std::vector<QuantileSketch> sketches;
+        try {
+            for (size_t i = begin; i < end; ++i) {
+                SpectrumData spectrum = calculate_single_spectrum(params.input_filenames[i], member_params);
+                if (sketches.empty()) {
+                    sketches.resize(spectrum.y_values.size());
+                }
+                if (spectrum.y_values.size() != sketches.size()) {
+                    throw std::runtime_error("Ensemble member is on a different grid: " + params.input_filenames[i]);
+                }
+                for (size_t k = 0; k < sketches.size(); ++k) {
+                    quantile_sketch_add(sketches[k], spectrum.y_values[k], compression);
+                }
+                if (i == 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ensemble.x_values = spectrum.x_values;
+                    ensemble.x_label = spectrum.x_label;
+                    ensemble.y_label = spectrum.y_label;
+                    ensemble.title = spectrum.title;
+                }
+            }
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = e.what();
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        partials.push_back(std::move(sketches));
+    });
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+
+    std::vector<QuantileSketch>& merged = partials.front();
+    for (size_t p = 1; p < partials.size(); ++p) {
+        if (partials[p].size() != merged.size()) {
+            throw std::runtime_error("Ensemble members are on different grids");
+        }
+        for (size_t k = 0; k < merged.size(); ++k) {
+            quantile_sketch_merge(merged[k], partials[p][k], compression);
+        }
+    }
+
+    const size_t n_points = merged.size();
+    ensemble.y_values.resize(n_points);
+    for (size_t k = 0; k < n_points; ++k) {
+        quantile_sketch_compress(merged[k], compression);
+        ensemble.y_values[k] = quantile_sketch_quantile(merged[k], 0.5);
+    }
+    for (const auto& quantiles : params.ensemble_bands) {
+        SpectrumBand band;
+        band.lower.resize(n_points);
+        band.upper.resize(n_points);
+        for (size_t k = 0; k < n_points; ++k) {
+            band.lower[k] = quantile_sketch_quantile(merged[k], quantiles[0]);
+            band.upper[k] = quantile_sketch_quantile(merged[k], quantiles[1]);
+        }
+        std::ostringstream label;
+        label << quantiles[0] * 100.0 << "-" << quantiles[1] * 100.0 << "%";
+        band.label = label.str();
+        ensemble.bands.push_back(std::move(band));
+    }
+
+    if (params.peak_labels > 0 || params.peak_table) {
+        detect_peaks(ensemble, params);
+    }
+    return ensemble;
+}
+
+// Function to calculate multiple spectra
+std::vector<SpectrumData> calculate_multiple_spectra(const PlotSpecParams& params) {
+    std::cout << "==================================" << std::endl;
+    std::cout << "   BDF Spectrum Calculator" << std::endl;
+    std::cout << "==================================" << std::endl;
+    std::cout << std::endl;
+
+    std::cout << "Mode: " << params.mode << ", Unit: " << params.unit << std::endl;
+    std::cout << "Range: " << params.x_start << " - " << params.x_end << " " << params.unit << std::endl;
+    std::cout << "FWHM: " << std::fixed << std::setprecision(4) << (params.fwhm_cm_minus_1 / EV_TO_CM_MINUS_1) << " eV" << std::endl;
+    std::cout << "Processing " << params.input_filenames.size() << " files..." << std::endl;
+    std::cout << std::endl;
+
+    std::vector<SpectrumData> spectra;
+    if (params.ensemble) {
+        spectra.push_back(calculate_ensemble_spectrum(params));
+        return spectra;
+    }
+
+    for (size_t i = 0; i < params.input_filenames.size(); ++i) {
+        spectra.push_back(calculate_single_spectrum(params.input_filenames[i], params));
+    }
+
+    std::cout << std::endl;
+    std::cout << "All spectra calculated successfully." << std::endl;
+    std::cout << "Generated " << spectra[0].x_values.size() << " data points per spectrum." << std::endl;
+
+    return spectra;
+}
+
+// Instructions of a compiled spectral expression, run as a stack machine
+enum class ExpressionOpcode {
+    Series,   // push the spectrum at index
+    Constant, // push value
+    GridX,    // push the grid coordinate
+    Scalar,   // push the reduction at index
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Power,
+    Negate,
+    Abs,
+    Sqrt,
+    Exp,
+    Log,
+    Minimum,
+    Maximum
+};
+
+struct ExpressionOp {
+    ExpressionOpcode code = ExpressionOpcode::Constant;
+    size_t index = 0;
+    double value = 0.0;
+};
+
+// A compiled expression: postfix code evaluated over blocks of the grid, so
+// every operator works on one short block held in cache instead of a full
+// intermediate array. Reductions (max, min, mean over the grid) are programs
+// of their own, reduced to scalars before the pass that uses them.
+struct ExpressionProgram {
+    std::vector<ExpressionOp> ops;
+    std::vector<ExpressionProgram> reductions;
+    ExpressionOpcode reduce = ExpressionOpcode::Maximum; // Maximum, Minimum or Add (mean) when used as a reduction
+    size_t depth = 0;                                     // stack slots needed
+};
+
+// Recursive-descent compiler for expressions over named spectra:
+//   expression := term (('+' | '-') term)*
+//   term       := unary (('*' | '/') unary)*
+//   unary      := '-' unary | power
+//   power      := primary ('^' unary)?
+//   primary    := number | name | '{' any name '}' | function '(' arguments ')' | '(' expression ')'
+// Names are spectra, earlier expressions (inlined) or x, the grid coordinate.
+// max, min and mean of one argument reduce over the grid; max and min of two
+// are elementwise, as are abs, sqrt, exp and log.
+struct ExpressionParser {
+    const std::map<std::string, size_t>& series;
+    const std::map<std::string, std::string>& defined; // earlier expressions by name
+    std::string text;
+    size_t position = 0;
+};
+
+[[noreturn]] void fail_expression(const ExpressionParser& parser, const std::string& message) {
+    throw std::runtime_error("Expression '" + parser.text + "': " + message + " at position " +
+                             std::to_string(parser.position + 1));
+}
+
+void skip_expression_spaces(ExpressionParser& parser) {
+    while (parser.position < parser.text.size() && std::isspace(static_cast<unsigned char>(parser.text[parser.position]))) {
+        ++parser.position;
+    }
+}
+
+// Function to consume c if it is the next non-space character
+bool accept_expression_char(ExpressionParser& parser, char c) {
+    skip_expression_spaces(parser);
+    if (parser.position < parser.text.size() && parser.text[parser.position] == c) {
+        ++parser.position;
+        return true;
+    }
+    return false;
+}
+
+// Function to append an instruction, tracking the stack depth it needs
+void emit_expression_op(ExpressionProgram& program, size_t& stack, ExpressionOpcode code, size_t index = 0,
+                        double value = 0.0) {
+    switch (code) {
+    case ExpressionOpcode::Series:
+    case ExpressionOpcode::Constant:
+    case ExpressionOpcode::GridX:
+    case ExpressionOpcode::Scalar:
+        ++stack;
+        break;
+    case ExpressionOpcode::Negate:
+    case ExpressionOpcode::Abs:
+    case ExpressionOpcode::Sqrt:
+    case ExpressionOpcode::Exp:
+    case ExpressionOpcode::Log:
+        break;
+    default:
+        --stack;
+        break;
+    }
+    program.depth = std::max(program.depth, stack);
+    program.ops.push_back({ code, index, value });
+}
+
+void parse_expression_sum(ExpressionParser& parser, ExpressionProgram& program, size_t& stack);
+
+// Function to parse a complete text into program, for the top level and to
+// inline earlier expressions; the parser position is restored afterwards
+void parse_expression_text(ExpressionParser& parser, const std::string& text, ExpressionProgram& program,
+                           size_t& stack) {
+    std::string outer_text = parser.text;
+    size_t outer_position = parser.position;
+    parser.text = text;
+    parser.position = 0;
+    parse_expression_sum(parser, program, stack);
+    skip_expression_spaces(parser);
+    if (parser.position != parser.text.size()) {
+        fail_expression(parser, "unexpected '" + std::string(1, parser.text[parser.position]) + "'");
+    }
+    parser.text = outer_text;
+    parser.position = outer_position;
+}
+
+void parse_expression_name(ExpressionParser& parser, const std::string& name, ExpressionProgram& program,
+                           size_t& stack) {
+    auto series = parser.series.find(name);
+    auto defined = parser.defined.find(name);
+    if (series != parser.series.end()) {
+        emit_expression_op(program, stack, ExpressionOpcode::Series, series->second);
+    } else if (defined != parser.defined.end()) {
+        parse_expression_text(parser, defined->second, program, stack);
+    } else if (name == "x") {
+        emit_expression_op(program, stack, ExpressionOpcode::GridX);
+    } else {
+        std::string known;
+        for (const auto& entry : parser.series) {
+            known += (known.empty() ? "" : ", ") + entry.first;
+        }
+        fail_expression(parser, "unknown spectrum '" + name + "' (known: " + known + ")");
+    }
+}
+
+// Function to parse the arguments of a call up to the closing parenthesis
+void parse_expression_call(ExpressionParser& parser, const std::string& function, ExpressionProgram& program,
+                           size_t& stack) {
+    static const std::map<std::string, ExpressionOpcode> elementwise = {
+        { "abs", ExpressionOpcode::Abs }, { "sqrt", ExpressionOpcode::Sqrt },
+        { "exp", ExpressionOpcode::Exp }, { "log", ExpressionOpcode::Log }
+    };
+    bool reducible = function == "max" || function == "min" || function == "mean";
+    if (!reducible && !elementwise.count(function)) {
+        fail_expression(parser, "unknown function '" + function + "'");
+    }
+
+    // A one-argument reduction compiles its argument as a separate program
+    ExpressionProgram argument;
+    size_t argument_stack = 0;
+    parse_expression_sum(parser, reducible ? argument : program, reducible ? argument_stack : stack);
+    if (accept_expression_char(parser, ',')) {
+        if (function != "max" && function != "min") {
+            fail_expression(parser, "'" + function + "' takes one argument");
+        }
+        // Splice the first argument back in, re-basing the reductions it refers to
+        size_t base = program.reductions.size();
+        for (auto op : argument.ops) {
+            if (op.code == ExpressionOpcode::Scalar) op.index += base;
+            program.ops.push_back(op);
+        }
+        for (auto& reduction : argument.reductions) {
+            program.reductions.push_back(std::move(reduction));
+        }
+        program.depth = std::max(program.depth, stack + argument.depth);
+        ++stack;
+        parse_expression_sum(parser, program, stack);
+        emit_expression_op(program, stack, function == "max" ? ExpressionOpcode::Maximum : ExpressionOpcode::Minimum);
+    } else if (reducible) {
+        argument.reduce = function == "max" ? ExpressionOpcode::Maximum
+                          : function == "min" ? ExpressionOpcode::Minimum : ExpressionOpcode::Add;
+        program.reductions.push_back(std::move(argument));
+        emit_expression_op(program, stack, ExpressionOpcode::Scalar, program.reductions.size() - 1);
+    } else {
+        emit_expression_op(program, stack, elementwise.at(function));
+    }
+    if (!accept_expression_char(parser, ')')) {
+        fail_expression(parser, "expected ')'");
+    }
+}
+
+void parse_expression_primary(ExpressionParser& parser, ExpressionProgram& program, size_t& stack) {
+    skip_expression_spaces(parser);
+    if (parser.position >= parser.text.size()) {
+        fail_expression(parser, "unexpected end");
+    }
+    char c = parser.text[parser.position];
+    if (accept_expression_char(parser, '(')) {
+        parse_expression_sum(parser, program, stack);
+        if (!accept_expression_char(parser, ')')) {
+            fail_expression(parser, "expected ')'");
+        }
+    } else if (accept_expression_char(parser, '{')) {
+        size_t close = parser.text.find('}', parser.position);
+        if (close == std::string::npos) {
+            fail_expression(parser, "expected '}'");
+        }
+        std::string name = parser.text.substr(parser.position, close - parser.position);
+        parser.position = close + 1;
+        parse_expression_name(parser, name, program, stack);
+    } else if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+        const char* begin = parser.text.c_str() + parser.position;
+        char* end = nullptr;
+        double value = std::strtod(begin, &end);
+        if (end == begin) {
+            fail_expression(parser, "bad number");
+        }
+        parser.position += static_cast<size_t>(end - begin);
+        emit_expression_op(program, stack, ExpressionOpcode::Constant, 0, value);
+    } else if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+        size_t start = parser.position;
+        while (parser.position < parser.text.size() &&
+               (std::isalnum(static_cast<unsigned char>(parser.text[parser.position])) || parser.text[parser.position] == '_')) {
+            ++parser.position;
+        }
+        std::string name = parser.text.substr(start, parser.position - start);
+        if (accept_expression_char(parser, '(')) {
+            parse_expression_call(parser, name, program, stack);
+        } else {
+            parse_expression_name(parser, name, program, stack);
+        }
+    } else {
+        fail_expression(parser, "unexpected '" + std::string(1, c) + "'");
+    }
+}
+
+void parse_expression_unary(ExpressionParser& parser, ExpressionProgram& program, size_t& stack) {
+    if (accept_expression_char(parser, '-')) {
+        parse_expression_unary(parser, program, stack);
+        emit_expression_op(program, stack, ExpressionOpcode::Negate);
+        return;
+    }
+    parse_expression_primary(parser, program, stack);
+    if (accept_expression_char(parser, '^')) {
+        parse_expression_unary(parser, program, stack);
+        emit_expression_op(program, stack, ExpressionOpcode::Power);
+    }
+}
+
+void parse_expression_product(ExpressionParser& parser, ExpressionProgram& program, size_t& stack) {
+    parse_expression_unary(parser, program, stack);
+    while (true) {
+        if (accept_expression_char(parser, '*')) {
+            parse_expression_unary(parser, program, stack);
+            emit_expression_op(program, stack, ExpressionOpcode::Multiply);
+        } else if (accept_expression_char(parser, '/')) {
+            parse_expression_unary(parser, program, stack);
+            emit_expression_op(program, stack, ExpressionOpcode::Divide);
+        } else {
+            return;
+        }
+    }
+}
+
+void parse_expression_sum(ExpressionParser& parser, ExpressionProgram& program, size_t& stack) {
+    parse_expression_product(parser, program, stack);
+    while (true) {
+        if (accept_expression_char(parser, '+')) {
+            parse_expression_product(parser, program, stack);
+            emit_expression_op(program, stack, ExpressionOpcode::Add);
+        } else if (accept_expression_char(parser, '-')) {
+            parse_expression_product(parser, program, stack);
+            emit_expression_op(program, stack, ExpressionOpcode::Subtract);
+        } else {
+            return;
+        }
+    }
+}
+
+// Function to compile an expression over the named spectra
+ExpressionProgram compile_expression(const std::string& text, const std::map<std::string, size_t>& series,
+                                     const std::map<std::string, std::string>& defined) {
+    ExpressionParser parser{ series, defined, "", 0 };
+    ExpressionProgram program;
+    size_t stack = 0;
+    parse_expression_text(parser, text, program, stack);
+    return program;
+}
+
+// Function to run a compiled expression over grid points [begin, begin +
+// length); the result is left in the first block of the stack. Each opcode is
+// a plain loop over the block, which the compiler vectorizes.
+void run_expression_block(const ExpressionProgram& program, const std::vector<double>& scalars,
+                          const std::vector<const double*>& series, const double* x, size_t begin, size_t length,
+                          double* stack) {
+    size_t top = 0; // slots in use
+    for (const auto& op : program.ops) {
+        double* push = stack + top * EXPRESSION_BLOCK_SIZE;
+        switch (op.code) {
+        case ExpressionOpcode::Series:
+            std::copy(series[op.index] + begin, series[op.index] + begin + length, push);
+            ++top;
+            continue;
+        case ExpressionOpcode::GridX:
+            std::copy(x + begin, x + begin + length, push);
+            ++top;
+            continue;
+        case ExpressionOpcode::Constant:
+            std::fill_n(push, length, op.value);
+            ++top;
+            continue;
+        case ExpressionOpcode::Scalar:
+            std::fill_n(push, length, scalars[op.index]);
+            ++top;
+            continue;
+        default:
+            break;
+        }
+
+        double* a = push - EXPRESSION_BLOCK_SIZE; // top operand, updated in place by unary ops
+        switch (op.code) {
+        case ExpressionOpcode::Negate:
+            for (size_t k = 0; k < length; ++k) a[k] = -a[k];
+            continue;
+        case ExpressionOpcode::Abs:
+            for (size_t k = 0; k < length; ++k) a[k] = std::abs(a[k]);
+            continue;
+        case ExpressionOpcode::Sqrt:
+            for (size_t k = 0; k < length; ++k) a[k] = std::sqrt(a[k]);
+            continue;
+        case ExpressionOpcode::Exp:
+            for (size_t k = 0; k < length; ++k) a[k] = std::exp(a[k]);
+            continue;
+        case ExpressionOpcode::Log:
+            for (size_t k = 0; k < length; ++k) a[k] = std::log(a[k]);
+            continue;
+        default:
+            break;
+        }
+
+        double* out = a - EXPRESSION_BLOCK_SIZE; // binary ops combine into the operand below
+        switch (op.code) {
+        case ExpressionOpcode::Add:
+            for (size_t k = 0; k < length; ++k) out[k] += a[k];
+            break;
+        case ExpressionOpcode::Subtract:
+            for (size_t k = 0; k < length; ++k) out[k] -= a[k];
+            break;
+        case ExpressionOpcode::Multiply:
+            for (size_t k = 0; k < length; ++k) out[k] *= a[k];
+            break;
+        case ExpressionOpcode::Divide:
+            for (size_t k = 0; k < length; ++k) out[k] /= a[k];
+            break;
+        case ExpressionOpcode::Power:
+            for (size_t k = 0; k < length; ++k) out[k] = std::pow(out[k], a[k]);
+            break;
+        case ExpressionOpcode::Minimum:
+            for (size_t k = 0; k < length; ++k) out[k] = std::min(out[k], a[k]);
+            break;
+        case ExpressionOpcode::Maximum:
+            for (size_t k = 0; k < length; ++k) out[k] = std::max(out[k], a[k]);
+            break;
+        default:
+            break;
+        }
+        --top;
+    }
+}
+
+// Function to evaluate a program's reductions to scalars, innermost first
+std::vector<double> evaluate_expression_scalars(const ExpressionProgram& program,
+                                                const std::vector<const double*>& series, const std::vector<double>& x) {
+    const size_t n = x.size();
+    std::vector<double> scalars;
+    for (const auto& reduction : program.reductions) {
+        std::vector<double> inner = evaluate_expression_scalars(reduction, series, x);
+        std::vector<double> stack(std::max<size_t>(reduction.depth, 1) * EXPRESSION_BLOCK_SIZE);
+        double result = reduction.reduce == ExpressionOpcode::Maximum ? -std::numeric_limits<double>::infinity()
+                        : reduction.reduce == ExpressionOpcode::Minimum ? std::numeric_limits<double>::infinity() : 0.0;
+        for (size_t begin = 0; begin < n; begin += EXPRESSION_BLOCK_SIZE) {
+            size_t length = std::min(EXPRESSION_BLOCK_SIZE, n - begin);
+            run_expression_block(reduction, inner, series, x.data(), begin, length, stack.data());
+            for (size_t k = 0; k < length; ++k) {
+                if (reduction.reduce == ExpressionOpcode::Maximum) {
+                    result = std::max(result, stack[k]);
+                } else if (reduction.reduce == ExpressionOpcode::Minimum) {
+                    result = std::min(result, stack[k]);
+                } else {
+                    result += stack[k];
+                }
+            }
+        }
+        if (reduction.reduce == ExpressionOpcode::Add && n > 0) {
+            result /= static_cast<double>(n);
+        }
+        scalars.push_back(result);
+    }
+    return scalars;
+}
+
+// Function to evaluate a compiled expression on the whole grid in one fused pass
+std::vector<double> evaluate_expression(const ExpressionProgram& program, const std::vector<const double*>& series,
+                                        const std::vector<double>& x) {
+    const size_t n = x.size();
+    std::vector<double> scalars = evaluate_expression_scalars(program, series, x);
+    std::vector<double> stack(std::max<size_t>(program.depth, 1) * EXPRESSION_BLOCK_SIZE);
+    std::vector<double> result(n);
+    for (size_t begin = 0; begin < n; begin += EXPRESSION_BLOCK_SIZE) {
+        size_t length = std::min(EXPRESSION_BLOCK_SIZE, n - begin);
+        run_expression_block(program, scalars, series, x.data(), begin, length, stack.data());
+        std::copy(stack.begin(), stack.begin() + length, result.begin() + begin);
+    }
+    return result;
+}
+
+// Function to add the configured expression series and keep only the series
+// listed in plot_series. Expressions are compiled up front, so errors surface
+// before any work, but only the listed ones are evaluated; an expression used
+// by another is inlined into it rather than materialized.
+void apply_expressions(std::vector<SpectrumData>& spectra, PlotSpecParams& params) {
+    if (params.expressions.empty() && params.plot_series.empty()) {
+        return;
+    }
+
+    std::map<std::string, size_t> series_index;
+    std::vector<const double*> series;
+    for (size_t i = 0; i < spectra.size(); ++i) {
+        if (spectra[i].x_values != spectra.front().x_values) {
+            throw std::runtime_error("Expressions need all spectra on the same grid");
+        }
+        // File stems repeat across directories; a repeated name would shadow a series
+        if (!series_index.emplace(params.legend_names[i], i).second) {
+            throw std::runtime_error("Series name '" + params.legend_names[i] +
+                                     "' is used by more than one spectrum; set legend_names to tell them apart");
+        }
+        series.push_back(spectra[i].y_values.data());
+    }
+
+    std::map<std::string, std::string> defined;
+    std::map<std::string, ExpressionProgram> programs;
+    for (size_t e = 0; e < params.expressions.size(); ++e) {
+        const std::string& name = params.expression_names[e];
+        if (series_index.count(name) || defined.count(name)) {
+            throw std::runtime_error("Expression name '" + name + "' is already used");
+        }
+        programs[name] = compile_expression(params.expressions[e], series_index, defined);
+        defined[name] = params.expressions[e];
+    }
+
+    std::vector<std::string> names = params.plot_series;
+    if (names.empty()) {
+        names = params.legend_names;
+        names.insert(names.end(), params.expression_names.begin(), params.expression_names.end());
+    }
+
+    std::vector<SpectrumData> plotted;
+    for (const auto& name : names) {
+        auto input = series_index.find(name);
+        auto program = programs.find(name);
+        if (input != series_index.end()) {
+            plotted.push_back(spectra[input->second]);
+        } else if (program != programs.end()) {
+            std::cout << "Evaluating " << name << " = " << defined[name] << std::endl;
+            SpectrumData derived;
+            derived.x_values = spectra.front().x_values;
+            derived.y_values = evaluate_expression(program->second, series, derived.x_values);
+            derived.x_label = spectra.front().x_label;
+            derived.y_label = spectra.front().y_label;
+            derived.title = name;
+            if (params.peak_labels > 0 || params.peak_table) {
+                detect_peaks(derived, params);
+            }
+            plotted.push_back(std::move(derived));
+        } else {
+            throw std::runtime_error("plot_series names unknown series '" + name + "'");
+        }
+    }
+    spectra = std::move(plotted);
+    params.legend_names = std::move(names);
+}
+
+// Function to write every plotted series as CSV columns: one x column shared
+// by all spectra on the same grid (one per spectrum otherwise), then each
+// spectrum followed by its extra series
+void write_spectra_csv(const std::vector<SpectrumData>& spectra, const PlotSpecParams& params) {
+    bool shared_grid = true;
+    size_t n_rows = 0;
+    for (const auto& spectrum : spectra) {
+        shared_grid = shared_grid && spectrum.x_values == spectra.front().x_values;
+        n_rows = std::max(n_rows, spectrum.x_values.size());
+    }
+
+    std::vector<const std::vector<double>*> columns;
+    std::vector<std::string> headers;
+    for (size_t spec_idx = 0; spec_idx < spectra.size(); ++spec_idx) {
+        const auto& spectrum = spectra[spec_idx];
+        const std::string& name = params.legend_names[spec_idx];
+        if (spec_idx == 0 || !shared_grid) {
+            columns.push_back(&spectrum.x_values);
+            headers.push_back(shared_grid ? "x" : "x " + name);
+        }
+        columns.push_back(&spectrum.y_values);
+        headers.push_back(name);
+        for (size_t k = 0; k < spectrum.extra_y_values.size(); ++k) {
+            columns.push_back(&spectrum.extra_y_values[k]);
+            headers.push_back(name + " " + spectrum.extra_labels[k]);
+        }
+        for (const auto& band : spectrum.bands) {
+            columns.push_back(&band.lower);
+            headers.push_back(name + " " + band.label + " lower");
+            columns.push_back(&band.upper);
+            headers.push_back(name + " " + band.label + " upper");
+        }
+    }
+
+    std::string path = params.output_filename + "_data.csv";
+    std::string temp_path = path + ".partial";
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write file: " + path);
+        }
+        out << std::setprecision(10);
+        for (size_t c = 0; c < headers.size(); ++c) {
+            out << (c > 0 ? "," : "") << "\"" << headers[c] << "\"";
+        }
+        out << "\n";
+        for (size_t r = 0; r < n_rows; ++r) {
+            for (size_t c = 0; c < columns.size(); ++c) {
+                if (c > 0) out << ",";
+                if (r < columns[c]->size()) out << (*columns[c])[r];
+            }
+            out << "\n";
+        }
+    }
+    std::filesystem::rename(temp_path, path);
+    std::cout << "Data written to " << path << std::endl;
+}
+
+// Function to write the detected band maxima of every spectrum, one row per peak
+void write_peak_table(const std::vector<SpectrumData>& spectra, const PlotSpecParams& params) {
+    std::string path = params.output_filename + "_peaks.csv";
+    std::string temp_path = path + ".partial";
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write file: " + path);
+        }
+        out << std::setprecision(8) << "spectrum,rank,x (" << params.unit << "),height,prominence,states\n";
+        for (size_t spec_idx = 0; spec_idx < spectra.size(); ++spec_idx) {
+            const auto& spectrum = spectra[spec_idx];
+            for (size_t r = 0; r < spectrum.peaks.size(); ++r) {
+                const auto& peak = spectrum.peaks[r];
+                out << "\"" << params.legend_names[spec_idx] << "\"," << (r + 1) << "," << peak.x << "," << peak.height
+                    << "," << peak.prominence << ",";
+                for (size_t k = 0; k < peak.states.size(); ++k) {
+                    out << (k > 0 ? " " : "") << "S" << spectrum.states.state_number[peak.states[k]];
+                }
+                out << "\n";
+            }
+        }
+    }
+    std::filesystem::rename(temp_path, path);
+    std::cout << "Peaks written to " << path << std::endl;
+}
+
+// Batched stick plot: all states of a spectrum are painted as the segments of
+// a single DrawLines call, so the cost does not grow with one vtkPlot per stick.
+// Painting goes through vtkContext2D and therefore reaches both the GL2PS
+// vector exporter and the raster window capture.
+class StickPlot : public vtkPlot {
+public:
+    static StickPlot* New();
+    vtkTypeMacro(StickPlot, vtkPlot);
+
+    // Stick positions in the display unit and heights in units of the plot's y axis
+    void SetSticks(const std::vector<double>& positions, const std::vector<double>& heights) {
+        this->Segments.resize(4 * positions.size());
+        this->Bounds[0] = this->Bounds[2] = std::numeric_limits<double>::max();
+        this->Bounds[1] = this->Bounds[3] = std::numeric_limits<double>::lowest();
+        for (size_t k = 0; k < positions.size(); ++k) {
+            this->Segments[4 * k] = static_cast<float>(positions[k]);
+            this->Segments[4 * k + 1] = 0.0f;
+            this->Segments[4 * k + 2] = static_cast<float>(positions[k]);
+            this->Segments[4 * k + 3] = static_cast<float>(heights[k]);
+            this->Bounds[0] = std::min(this->Bounds[0], positions[k]);
+            this->Bounds[1] = std::max(this->Bounds[1], positions[k]);
+            this->Bounds[2] = std::min(this->Bounds[2], std::min(0.0, heights[k]));
+            this->Bounds[3] = std::max(this->Bounds[3], std::max(0.0, heights[k]));
+        }
+        this->Modified();
+    }
+
+    bool Paint(vtkContext2D* painter) override {
+        if (!this->GetVisible() || this->Segments.empty()) {
+            return false;
+        }
+        // Apply the chart's shift and scale, as the built-in plots do for their caches
+        vtkRectd shift_scale = this->GetShiftScale();
+        this->Transformed.resize(this->Segments.size());
+        for (size_t k = 0; k < this->Segments.size(); k += 2) {
+            this->Transformed[k] = static_cast<float>((this->Segments[k] + shift_scale.GetX()) * shift_scale.GetWidth());
+            this->Transformed[k + 1] = static_cast<float>((this->Segments[k + 1] + shift_scale.GetY()) * shift_scale.GetHeight());
+        }
+        painter->ApplyPen(this->GetPen());
+        painter->DrawLines(this->Transformed.data(), static_cast<int>(this->Transformed.size() / 2));
+        return true;
+    }
+
+    bool PaintLegend(vtkContext2D* painter, const vtkRectf& rect, int) override {
+        painter->ApplyPen(this->GetPen());
+        float x = rect.GetX() + 0.5f * rect.GetWidth();
+        painter->DrawLine(x, rect.GetY(), x, rect.GetY() + rect.GetHeight());
+        return true;
+    }
+
+    void GetBounds(double bounds[4]) override {
+        if (this->Segments.empty()) {
+            bounds[0] = bounds[2] = 0.0;
+            bounds[1] = bounds[3] = 1.0;
+            return;
+        }
+        std::copy(this->Bounds, this->Bounds + 4, bounds);
+    }
+
+protected:
+    StickPlot() = default;
+    ~StickPlot() override = default;
+
+private:
+    StickPlot(const StickPlot&) = delete;
+    void operator=(const StickPlot&) = delete;
+
+    std::vector<float> Segments;
+    std::vector<float> Transformed;
+    double Bounds[4] = { 0.0, 1.0, 0.0, 1.0 };
+};
+
+vtkStandardNewMacro(StickPlot);
+
+// A peak label anchored at a band maximum, in the display unit and y axis
+struct PeakLabel {
+    double x = 0.0;
+    double y = 0.0;
+    double priority = 0.0; // prominence relative to the spectrum's largest |y|
+    std::string text;
+    vtkColor3ub color;
+};
+
+// Labels of band maxima placed without overlap. The layout is redone in pixel
+// space on every paint, so it follows resizing and zooming: labels are placed
+// by decreasing priority just above (below, for negative bands) their peak and
+// stacked past the labels already placed; a leader line joins a lifted label
+// to its peak, and labels that would leave the axis range are dropped.
+class PeakLabelPlot : public vtkPlot {
+public:
+    static PeakLabelPlot* New();
+    vtkTypeMacro(PeakLabelPlot, vtkPlot);
+
+    void SetLabels(std::vector<PeakLabel> labels) {
+        std::stable_sort(labels.begin(), labels.end(),
+                         [](const PeakLabel& a, const PeakLabel& b) { return a.priority > b.priority; });
+        this->Labels = std::move(labels);
+        this->Bounds[0] = this->Bounds[2] = std::numeric_limits<double>::max();
+        this->Bounds[1] = this->Bounds[3] = std::numeric_limits<double>::lowest();
+        for (const auto& label : this->Labels) {
+            this->Bounds[0] = std::min(this->Bounds[0], label.x);
+            this->Bounds[1] = std::max(this->Bounds[1], label.x);
+            this->Bounds[2] = std::min(this->Bounds[2], label.y);
+            this->Bounds[3] = std::max(this->Bounds[3], label.y);
+        }
+        this->Modified();
+    }
+
+    bool Paint(vtkContext2D* painter) override {
+        if (!this->GetVisible() || this->Labels.empty() || !this->GetYAxis()) {
+            return false;
+        }
+        vtkRectd shift_scale = this->GetShiftScale();
+        auto to_plot = [&shift_scale](double x, double y, float point[2]) {
+            point[0] = static_cast<float>((x + shift_scale.GetX()) * shift_scale.GetWidth());
+            point[1] = static_cast<float>((y + shift_scale.GetY()) * shift_scale.GetHeight());
+        };
+        vtkTransform2D* transform = painter->GetTransform();
+
+        // Pixels per plot coordinate, and the vertical extent of the axis in pixels
+        float corners[4];
+        float corner_pixels[4];
+        to_plot(0.0, this->GetYAxis()->GetMinimum(), corners);
+        to_plot(1.0, this->GetYAxis()->GetMaximum(), corners + 2);
+        corners[2] = corners[0] + 1.0f;
+        transform->TransformPoints(corners, corner_pixels, 2);
+        const float pixels_x = corner_pixels[2] - corner_pixels[0];
+        const float pixels_y = (corner_pixels[3] - corner_pixels[1]) / (corners[3] - corners[1]);
+        const float bottom = corner_pixels[1];
+        const float top = corner_pixels[3];
+
+        vtkTextProperty* text = painter->GetTextProp();
+        text->SetFontSize(PEAK_LABEL_FONT_SIZE);
+        text->SetFontFamilyToArial();
+        text->SetJustificationToCentered();
+
+        std::vector<std::array<float, 4>> placed; // x0, y0, x1, y1 in pixels
+        for (const auto& label : this->Labels) {
+            float anchor[2];
+            float anchor_pixel[2];
+            to_plot(label.x, label.y, anchor);
+            transform->TransformPoints(anchor, anchor_pixel, 1);
+
+            float bounds[4];
+            painter->ComputeStringBounds(label.text, bounds);
+            const float width = bounds[2] * pixels_x;
+            const float height = bounds[3] * pixels_y;
+            const bool up = label.y >= 0.0;
+            const float x0 = anchor_pixel[0] - 0.5f * width;
+            const float x1 = anchor_pixel[0] + 0.5f * width;
+            const float first = anchor_pixel[1] + (up ? PEAK_LABEL_GAP_PX : -PEAK_LABEL_GAP_PX);
+            float base = first;
+
+            // Each move passes a placed label in one direction, so this ends
+            // after at most one step per placed label
+            bool moved = true;
+            while (moved) {
+                moved = false;
+                float y0 = up ? base : base - height;
+                float y1 = up ? base + height : base;
+                for (const auto& other : placed) {
+                    if (x0 < other[2] && other[0] < x1 && y0 < other[3] && other[1] < y1) {
+                        base = up ? other[3] + PEAK_LABEL_GAP_PX : other[1] - PEAK_LABEL_GAP_PX;
+                        moved = true;
+                        break;
+                    }
+                }
+            }
+            if (up ? base + height > top : base - height < bottom) continue;
+            placed.push_back({ x0, up ? base : base - height, x1, up ? base + height : base });
+
+            float base_pixel[2] = { anchor_pixel[0], base };
+            float base_point[2];
+            transform->InverseTransformPoints(base_pixel, base_point, 1);
+            const vtkColor3ub& color = label.color;
+            if (base != first) {
+                float first_pixel[2] = { anchor_pixel[0], first };
+                float first_point[2];
+                transform->InverseTransformPoints(first_pixel, first_point, 1);
+                this->GetPen()->SetColor(color.GetRed(), color.GetGreen(), color.GetBlue());
+                painter->ApplyPen(this->GetPen());
+                painter->DrawLine(first_point[0], first_point[1], base_point[0], base_point[1]);
+            }
+            text->SetColor(color.GetRed() / 255.0, color.GetGreen() / 255.0, color.GetBlue() / 255.0);
+            if (up) {
+                text->SetVerticalJustificationToBottom();
+            } else {
+                text->SetVerticalJustificationToTop();
+            }
+            painter->DrawString(base_point[0], base_point[1], label.text);
+        }
+        return true;
+    }
+
+    void GetBounds(double bounds[4]) override {
+        if (this->Labels.empty()) {
+            bounds[0] = bounds[2] = 0.0;
+            bounds[1] = bounds[3] = 1.0;
+            return;
+        }
+        std::copy(this->Bounds, this->Bounds + 4, bounds);
+    }
+
+protected:
+    PeakLabelPlot() = default;
+    ~PeakLabelPlot() override = default;
+
+private:
+    PeakLabelPlot(const PeakLabelPlot&) = delete;
+    void operator=(const PeakLabelPlot&) = delete;
+
+    std::vector<PeakLabel> Labels;
+    double Bounds[4] = { 0.0, 1.0, 0.0, 1.0 };
+};
+
+vtkStandardNewMacro(PeakLabelPlot);
+
+// Function to label the most prominent band maxima of every spectrum with
+// position, height and dominant states, laid out together so that labels of
+// different spectra do not overlap either
+void add_peak_labels(vtkChartXY* chart, const std::vector<SpectrumData>& spectra, const PlotSpecParams& params,
+                     vtkColorSeries* colors) {
+    const int position_digits = params.unit == "nm" ? 1 : (params.unit == "eV" ? 2 : 0);
+    std::vector<PeakLabel> labels;
+    for (size_t spec_idx = 0; spec_idx < spectra.size(); ++spec_idx) {
+        const auto& spectrum = spectra[spec_idx];
+        double largest = 0.0;
+        for (double y : spectrum.y_values) {
+            largest = std::max(largest, std::abs(y));
+        }
+        size_t count = std::min(spectrum.peaks.size(), static_cast<size_t>(params.peak_labels));
+        for (size_t r = 0; r < count; ++r) {
+            const auto& peak = spectrum.peaks[r];
+            PeakLabel label;
+            label.x = peak.x;
+            label.y = peak.height;
+            label.priority = largest > 0.0 ? peak.prominence / largest : 0.0;
+            label.color = colors->GetColorRepeating(static_cast<int>(spec_idx));
+
+            std::ostringstream text;
+            text << std::fixed << std::setprecision(position_digits) << peak.x << " " << params.unit << ": "
+                 << std::defaultfloat << std::setprecision(3) << peak.height;
+            for (size_t k = 0; k < peak.states.size(); ++k) {
+                text << (k == 0 ? " (" : ", ") << "S" << spectrum.states.state_number[peak.states[k]];
+            }
+            text << (peak.states.empty() ? "" : ")");
+            label.text = text.str();
+            labels.push_back(label);
+        }
+    }
+    if (labels.empty()) {
+        return;
+    }
+
+    auto plot = vtkSmartPointer<PeakLabelPlot>::New();
+    plot->SetLabels(std::move(labels));
+    plot->SetWidth(1.0);
+    plot->SetLegendVisibility(false);
+    plot->SetSelectable(false);
+    chart->AddPlot(plot);
+}
+
+// Function to get the stick height shown against the secondary axis:
+// oscillator strength, or the rotatory strength used by the CD modes
+double stick_axis_value(const ExcitedStateStore& states, size_t index, const PlotSpecParams& params) {
+    if (params.mode == "cd") {
+        return states.rot_strength_vel[index];
+    } else if (params.mode == "cdl") {
+        return states.rot_strength_len[index];
+    }
+    return states.osc_strength[index];
+}
+
+// Function to add the excited-state sticks of one spectrum to the chart as a
+// single batched plot. With stick_axis the heights are the raw strengths on the
+// right axis; otherwise the tallest stick is scaled to the tallest curve feature.
+void add_stick_overlay(vtkChartXY* chart, const SpectrumData& spectrum, const PlotSpecParams& params,
+                       const vtkColor3ub& color) {
+    const auto& states = spectrum.states;
+    double x_min = std::min(params.x_start, params.x_end);
+    double x_max = std::max(params.x_start, params.x_end);
+
+    std::vector<double> stick_x;
+    std::vector<double> stick_h;
+    double stick_peak = 0.0;
+    for (size_t i = 0; i < states.size(); ++i) {
+        double x = wavenumber_to_x(states.energy_ev[i] * EV_TO_CM_MINUS_1, params.unit) - x_axis_offset(params);
+        if (x < x_min || x > x_max) continue;
+        stick_x.push_back(x);
+        stick_h.push_back(params.stick_axis ? stick_axis_value(states, i, params) : stick_strength(states, i, params));
+        stick_peak = std::max(stick_peak, std::abs(stick_h.back()));
+    }
+    if (stick_x.empty() || stick_peak <= 0.0) {
+        return;
+    }
+
+    if (!params.stick_axis) {
+        double curve_peak = 0.0;
+        for (double y : spectrum.y_values) {
+            curve_peak = std::max(curve_peak, std::abs(y));
+        }
+        double scale = curve_peak > 0.0 ? curve_peak / stick_peak : 1.0;
+        for (double& h : stick_h) {
+            h *= scale;
+        }
+    }
+
+    auto plot = vtkSmartPointer<StickPlot>::New();
+    plot->SetSticks(stick_x, stick_h);
+    plot->SetColorF(color.GetRed() / 255.0, color.GetGreen() / 255.0, color.GetBlue() / 255.0);
+    plot->SetWidth(1.0);
+    plot->SetLegendVisibility(false);
+    chart->AddPlot(plot);
+    if (params.stick_axis) {
+        chart->SetPlotCorner(plot, 1); // bottom x axis, right y axis
+    }
+}
+
+// State shared with the hover callback of the interactive viewer
+struct HoverPickContext {
+    vtkChartXY* chart = nullptr;
+    vtkTooltipItem* tooltip = nullptr;
+    vtkRenderWindow* render_window = nullptr;
+    const std::vector<SpectrumData>* spectra = nullptr;
+    const PlotSpecParams* params = nullptr;
+    int last_pixel_x = -1;
+};
+
+// Mouse-move callback listing the excited states under the cursor
+void on_hover_pick(vtkObject* caller, unsigned long, void* client_data, void*) {
+    auto interactor = static_cast<vtkRenderWindowInteractor*>(caller);
+    auto context = static_cast<HoverPickContext*>(client_data);
+    const int* pos = interactor->GetEventPosition();
+
+    vtkAxis* x_axis = context->chart->GetAxis(vtkAxis::BOTTOM);
+    vtkAxis* y_axis = context->chart->GetAxis(vtkAxis::LEFT);
+    const float* x_p1 = x_axis->GetPoint1();
+    const float* x_p2 = x_axis->GetPoint2();
+    const float* y_p1 = y_axis->GetPoint1();
+    const float* y_p2 = y_axis->GetPoint2();
+
+    bool inside = pos[0] >= x_p1[0] && pos[0] <= x_p2[0] && pos[1] >= y_p1[1] && pos[1] <= y_p2[1] &&
+                  x_p2[0] > x_p1[0];
+    if (!inside) {
+        if (context->last_pixel_x >= 0) {
+            context->last_pixel_x = -1;
+            context->tooltip->SetVisible(false);
+            context->render_window->Render();
+        }
+        return;
+    }
+
+    double fraction = (pos[0] - x_p1[0]) / (x_p2[0] - x_p1[0]);
+    double x = x_axis->GetMinimum() + fraction * (x_axis->GetMaximum() - x_axis->GetMinimum());
+    const auto& params = *context->params;
+    const auto& spectra = *context->spectra;
+
+    std::ostringstream text;
+    for (size_t spec_idx = 0; spec_idx < spectra.size(); ++spec_idx) {
+        const auto& states = spectra[spec_idx].states;
+        auto picked = pick_contributing_states(states, x, params, static_cast<size_t>(std::max(params.hover_states, 0)));
+        if (picked.empty()) continue;
+
+        if (spectra.size() > 1) {
+            text << params.legend_names[spec_idx] << "\n";
+        }
+        for (size_t i : picked) {
+            double rotatory = params.mode == "cdl" ? states.rot_strength_len[i] : states.rot_strength_vel[i];
+            text << "S" << states.state_number[i] << "  " << std::fixed << std::setprecision(3)
+                 << states.energy_ev[i] << " eV  f=" << std::setprecision(4) << states.osc_strength[i]
+                 << "  R=" << std::setprecision(2) << rotatory;
+            const std::string& composition = load_state_composition(states, i);
+            if (!composition.empty()) {
+                text << "  " << composition;
+            }
+            text << "\n";
+        }
+    }
+
+    std::string label = text.str();
+    if (!label.empty()) {
+        label.pop_back();
+    }
+    context->last_pixel_x = pos[0];
+    context->tooltip->SetText(label);
+    context->tooltip->SetPosition(static_cast<float>(pos[0]) + 12.0f, static_cast<float>(pos[1]) + 12.0f);
+    context->tooltip->SetVisible(!label.empty());
+    context->render_window->Render();
+}
+
+// Function to build the spectrum chart with all curves and overlays in a view
+vtkSmartPointer<vtkChartXY> build_spectrum_chart(vtkContextView* view, const std::vector<SpectrumData>& spectra,
+                                                 const PlotSpecParams& params) {
+    view->GetRenderer()->SetBackground(1.0, 1.0, 1.0);
+
+    auto chart = vtkSmartPointer<vtkChartXY>::New();
+    view->GetScene()->AddItem(chart);
+    chart->SetAutoAxes(false);
+
+    // Calculate nice round tick positions
+    auto calculateNiceTicks = [](double min_val, double max_val, int target_ticks) -> std::vector<double> {
+        double range = max_val - min_val;
+        double rough_step = range / (target_ticks - 1);
+
+        // Find a nice step size (power of 10 times 1, 2, or 5)
+        double magnitude = std::pow(10, std::floor(std::log10(rough_step)));
+        double normalized = rough_step / magnitude;
+        double nice_step;
+
+        if (normalized <= 1.0) nice_step = magnitude;
+        else if (normalized <= 2.0) nice_step = 2 * magnitude;
+        else if (normalized <= 5.0) nice_step = 5 * magnitude;
+        else nice_step = 10 * magnitude;
 
         // Generate ticks
         std::vector<double> ticks;
@@ -539,19 +5408,42 @@ void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra,
         double spec_max = *std::max_element(spectrum.y_values.begin(), spectrum.y_values.end());
         overall_y_min = std::min(overall_y_min, spec_min);
         overall_y_max = std::max(overall_y_max, spec_max);
+        for (const auto& extra : spectrum.extra_y_values) {
+            overall_y_min = std::min(overall_y_min, *std::min_element(extra.begin(), extra.end()));
+            overall_y_max = std::max(overall_y_max, *std::max_element(extra.begin(), extra.end()));
+        }
+        for (const auto& band : spectrum.bands) {
+            overall_y_min = std::min(overall_y_min, *std::min_element(band.lower.begin(), band.lower.end()));
+            overall_y_max = std::max(overall_y_max, *std::max_element(band.upper.begin(), band.upper.end()));
+        }
+    }
+
+    // Scans are plotted against their own coordinate instead of the spectral grid
+    double x_start = params.x_start;
+    double x_end = params.x_end;
+    if (params.mode == "scan") {
+        x_start = std::numeric_limits<double>::max();
+        x_end = std::numeric_limits<double>::lowest();
+        for (const auto& spectrum : spectra) {
+            x_start = std::min(x_start, *std::min_element(spectrum.x_values.begin(), spectrum.x_values.end()));
+            x_end = std::max(x_end, *std::max_element(spectrum.x_values.begin(), spectrum.x_values.end()));
+        }
+        if (x_end <= x_start) {
+            x_end = x_start + 1.0;
+        }
     }
 
-    // Add 10% padding to Y-axis range for visual breathing room
+    // Add 10% padding to Y-axis range for visual breathing room, more when peaks are labelled
     double y_range = overall_y_max - overall_y_min;
-    double y_padding = y_range * 0.1;
+    double y_padding = y_range * (params.peak_labels > 0 ? PEAK_LABEL_HEADROOM : 0.1);
     double y_min = overall_y_min - y_padding;
     double y_max = overall_y_max + y_padding;
 
     // Ensure y_min is not negative for absorption/emission spectra unless data requires it
-    if (params.mode != "cd" && params.mode != "cdl" && overall_y_min >= 0) {
+    if (params.mode != "cd" && params.mode != "cdl" && params.mode != "scan" && overall_y_min >= 0) {
         y_min = 0;
         // Recalculate y_max with proper padding from 0
-        y_max = overall_y_max + y_range * 0.1;
+        y_max = overall_y_max + y_padding;
     }
 
     // Configure axes
@@ -568,11 +5460,11 @@ void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra,
     // Set axis behavior and ranges
     xAxis->SetBehavior(vtkAxis::FIXED);
     yAxis->SetBehavior(vtkAxis::FIXED);
-    xAxis->SetRange(params.x_start, params.x_end);
+    xAxis->SetRange(x_start, x_end);
     yAxis->SetRange(y_min, y_max);
 
     // Generate nice tick positions
-    auto x_ticks = calculateNiceTicks(params.x_start, params.x_end, 6);
+    auto x_ticks = calculateNiceTicks(x_start, x_end, 6);
     auto y_ticks = calculateNiceTicks(y_min, y_max, 6);
 
     // Set custom tick positions
@@ -605,7 +5497,7 @@ void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra,
     rightAxis->SetTitle("");
 
     // Set same range as bottom and left axes
-    topAxis->SetRange(params.x_start, params.x_end);
+    topAxis->SetRange(x_start, x_end);
     rightAxis->SetRange(y_min, y_max);
 
     // Remove tick marks from top and right axes for cleaner look
@@ -616,11 +5508,50 @@ void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra,
     topAxis->SetGridVisible(false);
     rightAxis->SetGridVisible(false);
 
+    // Secondary axis for the stick overlay: raw oscillator or rotatory strengths
+    if (params.stick_overlay && params.stick_axis) {
+        double stick_min = 0.0;
+        double stick_max = 0.0;
+        for (const auto& spectrum : spectra) {
+            for (size_t i = 0; i < spectrum.states.size(); ++i) {
+                double value = stick_axis_value(spectrum.states, i, params);
+                stick_min = std::min(stick_min, value);
+                stick_max = std::max(stick_max, value);
+            }
+        }
+        if (stick_max <= stick_min) {
+            stick_max = stick_min + 1.0;
+        }
+
+        // Keep the stick baseline aligned with zero on the left axis
+        double stick_padding = (stick_max - stick_min) * 0.1;
+        double right_min = stick_min < 0.0 ? stick_min - stick_padding : 0.0;
+        double right_max = stick_max + stick_padding;
+        if (y_min < 0.0 && y_max > 0.0 && right_min >= 0.0) {
+            right_min = right_max * y_min / y_max;
+        }
+
+        rightAxis->SetRange(right_min, right_max);
+        rightAxis->SetLabelsVisible(true);
+        rightAxis->SetTickLength(5);
+        rightAxis->GetTitleProperties()->SetFontSize(16);
+        rightAxis->GetLabelProperties()->SetFontSize(14);
+        rightAxis->SetTitle(params.mode == "cd" || params.mode == "cdl"
+                                ? "Rotatory Strength (10⁻⁴⁰ cgs)" : "Oscillator Strength");
+
+        auto right_tick_array = vtkSmartPointer<vtkDoubleArray>::New();
+        for (double tick : calculateNiceTicks(right_min, right_max, 6)) {
+            right_tick_array->InsertNextValue(tick);
+        }
+        rightAxis->SetCustomTickPositions(right_tick_array);
+    }
+
     // Create color series for different spectra
     auto colors = vtkSmartPointer<vtkColorSeries>::New();
     colors->SetColorScheme(vtkColorSeries::SPECTRUM);
 
     // Add plots for each spectrum
+    size_t extra_color_idx = spectra.size();
     for (size_t spec_idx = 0; spec_idx < spectra.size(); ++spec_idx) {
         const auto& spectrum = spectra[spec_idx];
 
@@ -640,16 +5571,70 @@ void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra,
         table->AddColumn(xArray);
         table->AddColumn(yArray);
 
-        // Add plot
-        auto plot = chart->AddPlot(vtkChart::LINE);
-        plot->SetInputData(table, 0, 1);
+        for (const auto& extra : spectrum.extra_y_values) {
+            auto extraArray = vtkSmartPointer<vtkDoubleArray>::New();
+            extraArray->SetName(("Y" + std::to_string(table->GetNumberOfColumns())).c_str());
+            for (double y : extra) {
+                extraArray->InsertNextValue(y);
+            }
+            table->AddColumn(extraArray);
+        }
 
         // Set different colors for each spectrum
         auto color = colors->GetColorRepeating(spec_idx);
+
+        // Shaded bands go first so that the curves are drawn over them; nested
+        // bands darken towards the center
+        for (const auto& band : spectrum.bands) {
+            auto lowerArray = vtkSmartPointer<vtkDoubleArray>::New();
+            lowerArray->SetName(("Y" + std::to_string(table->GetNumberOfColumns())).c_str());
+            auto upperArray = vtkSmartPointer<vtkDoubleArray>::New();
+            upperArray->SetName(("Y" + std::to_string(table->GetNumberOfColumns() + 1)).c_str());
+            for (size_t i = 0; i < band.lower.size(); ++i) {
+                lowerArray->InsertNextValue(band.lower[i]);
+                upperArray->InsertNextValue(band.upper[i]);
+            }
+            table->AddColumn(lowerArray);
+            table->AddColumn(upperArray);
+
+            auto area = vtkPlotArea::SafeDownCast(chart->AddPlot(vtkChart::AREA));
+            area->SetInputData(table);
+            area->SetInputArray(0, "X");
+            area->SetInputArray(1, lowerArray->GetName());
+            area->SetInputArray(2, upperArray->GetName());
+            area->GetBrush()->SetColorF(color.GetRed() / 255.0, color.GetGreen() / 255.0, color.GetBlue() / 255.0,
+                                        ENSEMBLE_BAND_OPACITY);
+            area->SetLabel(spectra.size() > 1 ? params.legend_names[spec_idx] + " " + band.label : band.label);
+        }
+
+        // Add plot
+        auto plot = chart->AddPlot(vtkChart::LINE);
+        plot->SetInputData(table, 0, 1);
         plot->SetColorF(color.GetRed() / 255.0, color.GetGreen() / 255.0, color.GetBlue() / 255.0);
 
-        plot->SetWidth(2.0);
-        plot->SetLabel(params.legend_names[spec_idx].c_str());
+        plot->SetWidth(2.0);
+        plot->SetLabel(params.legend_names[spec_idx].c_str());
+
+        for (size_t k = 0; k < spectrum.extra_y_values.size(); ++k) {
+            auto extra_plot = chart->AddPlot(vtkChart::LINE);
+            extra_plot->SetInputData(table, 0, static_cast<vtkIdType>(k + 2));
+            auto extra_color = colors->GetColorRepeating(static_cast<int>(extra_color_idx++));
+            extra_plot->SetColorF(extra_color.GetRed() / 255.0, extra_color.GetGreen() / 255.0,
+                                  extra_color.GetBlue() / 255.0);
+            extra_plot->SetWidth(1.5);
+            std::string extra_label = spectra.size() > 1
+                                          ? params.legend_names[spec_idx] + " " + spectrum.extra_labels[k]
+                                          : spectrum.extra_labels[k];
+            extra_plot->SetLabel(extra_label);
+        }
+
+        if (params.stick_overlay) {
+            add_stick_overlay(chart, spectrum, params, color);
+        }
+    }
+
+    if (params.peak_labels > 0) {
+        add_peak_labels(chart, spectra, params, colors);
     }
 
     // Configure legend with scholarly style
@@ -660,12 +5645,29 @@ void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra,
     legend->GetLabelProperties()->SetFontSize(12);
     legend->GetPen()->SetLineType(vtkPen::NO_PEN); // Remove legend border
 
-    // Set window size and render
+    // Set window size
     view->GetRenderWindow()->SetSize(1000, 700);
-    view->GetRenderWindow()->Render();
 
-    // Export plot
+    return chart;
+}
+
+// Function to render a view and export it in the configured format. With a
+// render_mutex, only the OpenGL work (rendering, GL2PS and the framebuffer
+// capture) holds it; encoding and writing raster files run unlocked.
+std::string export_plot(vtkContextView* view, const PlotSpecParams& params, std::mutex* render_mutex = nullptr) {
+    auto lock_rendering = [render_mutex]() {
+        return render_mutex ? std::unique_lock<std::mutex>(*render_mutex) : std::unique_lock<std::mutex>();
+    };
+    {
+        auto lock = lock_rendering();
+        view->GetRenderWindow()->Render();
+    }
+
+    // Write to a temporary name and rename, so an interrupted export never
+    // leaves a truncated file under the final name
     std::string full_output_name = params.output_filename + "." + params.output_format;
+    std::string partial_prefix = params.output_filename + ".partial";
+    std::string partial_output_name = partial_prefix + "." + params.output_format;
 
     if (params.output_format == "svg" || params.output_format == "eps" || params.output_format == "pdf") {
         auto exporter = vtkSmartPointer<vtkGL2PSExporter>::New();
@@ -680,9 +5682,10 @@ void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra,
         }
 
         exporter->CompressOff();
-        exporter->SetFilePrefix(params.output_filename.c_str());
+        exporter->SetFilePrefix(partial_prefix.c_str());
         exporter->DrawBackgroundOn();
         exporter->Write3DPropsAsRasterImageOff();
+        auto lock = lock_rendering();
         exporter->Write();
 
     } else if (params.output_format == "png" || params.output_format == "jpg" || params.output_format == "jpeg") {
@@ -691,29 +5694,1099 @@ void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra,
         windowToImageFilter->SetScale(2, 2); // Higher resolution
         windowToImageFilter->SetInputBufferTypeToRGB();
         windowToImageFilter->ReadFrontBufferOff();
-        windowToImageFilter->Update();
+
+        // Copy the captured pixels so the writers never reach back into the window
+        auto image = vtkSmartPointer<vtkImageData>::New();
+        {
+            auto lock = lock_rendering();
+            windowToImageFilter->Update();
+            image->DeepCopy(windowToImageFilter->GetOutput());
+        }
 
         if (params.output_format == "png") {
             auto writer = vtkSmartPointer<vtkPNGWriter>::New();
-            writer->SetFileName(full_output_name.c_str());
-            writer->SetInputConnection(windowToImageFilter->GetOutputPort());
+            writer->SetFileName(partial_output_name.c_str());
+            writer->SetInputData(image);
             writer->Write();
         } else {
             auto writer = vtkSmartPointer<vtkJPEGWriter>::New();
-            writer->SetFileName(full_output_name.c_str());
+            writer->SetFileName(partial_output_name.c_str());
             writer->SetQuality(95);
-            writer->SetInputConnection(windowToImageFilter->GetOutputPort());
+            writer->SetInputData(image);
             writer->Write();
         }
     }
 
-    std::cout << "Plot exported to: " << full_output_name << std::endl;
+    if (!std::filesystem::exists(partial_output_name)) {
+        throw std::runtime_error("Failed to write plot file: " + full_output_name);
+    }
+    std::filesystem::rename(partial_output_name, full_output_name);
+
+    if (!params.render_hash.empty()) {
+        write_render_hash(full_output_name, params.render_hash);
+    }
+    return full_output_name;
+}
+
+// Joins a thread when leaving its scope, so that no exit path destroys it
+// while joinable
+struct ThreadJoiner {
+    std::thread& thread;
+
+    ~ThreadJoiner() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+};
+
+// Completion state of a background export, polled by the interactive viewer
+struct AsyncExportStatus {
+    std::mutex render_mutex; // serializes OpenGL rendering of the two windows
+    std::atomic<bool> finished{false};
+    bool reported = false;
+    int timer_id = 0;
+    std::string output_name;
+    std::string error;
+};
+
+// Function to export from a snapshot of the spectra on a separate offscreen
+// render window, so the interactive window does not wait for the file. The
+// chart is built unlocked; export_plot holds the render mutex only while it
+// renders or reads back the offscreen window.
+void run_async_export(std::vector<SpectrumData> spectra, PlotSpecParams params,
+                      std::shared_ptr<AsyncExportStatus> status) {
+    try {
+        auto window = vtkSmartPointer<vtkRenderWindow>::New();
+        window->SetOffScreenRendering(1);
+        auto view = vtkSmartPointer<vtkContextView>::New();
+        view->SetRenderWindow(window);
+        build_spectrum_chart(view, spectra, params);
+        status->output_name = export_plot(view, params, &status->render_mutex);
+    } catch (const std::exception& e) {
+        status->error = e.what();
+    }
+    status->finished.store(true);
+}
+
+// Function to print the outcome of a background export, once
+void report_async_export(AsyncExportStatus& status) {
+    status.reported = true;
+    if (status.error.empty()) {
+        std::cout << "Plot exported to: " << status.output_name << std::endl;
+    } else {
+        std::cerr << "Error: background export failed: " << status.error << std::endl;
+    }
+}
+
+// Function to take the render mutex before the interactive window renders
+void on_render_start(vtkObject*, unsigned long, void* client_data, void*) {
+    static_cast<AsyncExportStatus*>(client_data)->render_mutex.lock();
+}
+
+// Function to release the render mutex after the interactive window rendered
+void on_render_end(vtkObject*, unsigned long, void* client_data, void*) {
+    static_cast<AsyncExportStatus*>(client_data)->render_mutex.unlock();
+}
+
+// Timer callback reporting the background export once it has finished
+void on_export_poll(vtkObject* caller, unsigned long, void* client_data, void*) {
+    auto status = static_cast<AsyncExportStatus*>(client_data);
+    if (!status->reported && status->finished.load()) {
+        report_async_export(*status);
+        static_cast<vtkRenderWindowInteractor*>(caller)->DestroyTimer(status->timer_id);
+    }
+}
+
+// Function to create VTK plot with multiple spectra and export
+void create_and_export_multiple_plots(const std::vector<SpectrumData>& spectra, const PlotSpecParams& params) {
+    std::cout << std::endl;
+    std::cout << "Creating visualization with " << spectra.size() << " spectra..." << std::endl;
+
+    auto view = vtkSmartPointer<vtkContextView>::New();
+    auto chart = build_spectrum_chart(view, spectra, params);
+
+    if (!params.interactive) {
+        std::string full_output_name = export_plot(view, params);
+        std::cout << "Plot exported to: " << full_output_name << std::endl;
+        return;
+    }
+
+    // Open the interactive window first, then export in the background
+    auto export_status = std::make_shared<AsyncExportStatus>();
+    auto render_start = vtkSmartPointer<vtkCallbackCommand>::New();
+    render_start->SetCallback(on_render_start);
+    render_start->SetClientData(export_status.get());
+    auto render_end = vtkSmartPointer<vtkCallbackCommand>::New();
+    render_end->SetCallback(on_render_end);
+    render_end->SetClientData(export_status.get());
+    view->GetRenderWindow()->AddObserver(vtkCommand::StartEvent, render_start);
+    view->GetRenderWindow()->AddObserver(vtkCommand::EndEvent, render_end);
+
+    view->GetInteractor()->Initialize();
+    view->GetRenderWindow()->Render();
+
+    auto export_poll = vtkSmartPointer<vtkCallbackCommand>::New();
+    export_poll->SetCallback(on_export_poll);
+    export_poll->SetClientData(export_status.get());
+    view->GetInteractor()->AddObserver(vtkCommand::TimerEvent, export_poll);
+    export_status->timer_id = view->GetInteractor()->CreateRepeatingTimer(100);
+
+    // Hovering over a band lists the excited states contributing to it
+    auto tooltip = vtkSmartPointer<vtkTooltipItem>::New();
+    tooltip->SetVisible(false);
+    view->GetScene()->AddItem(tooltip);
+
+    HoverPickContext hover_context;
+    hover_context.chart = chart;
+    hover_context.tooltip = tooltip;
+    hover_context.render_window = view->GetRenderWindow();
+    hover_context.spectra = &spectra;
+    hover_context.params = &params;
+
+    auto hover_callback = vtkSmartPointer<vtkCallbackCommand>::New();
+    hover_callback->SetCallback(on_hover_pick);
+    hover_callback->SetClientData(&hover_context);
+    view->GetInteractor()->AddObserver(vtkCommand::MouseMoveEvent, hover_callback);
+
+    // Start the export only once the setup above can no longer throw; the
+    // joiner waits for it on every way out, including an exception from Start
+    std::thread export_thread(run_async_export, spectra, params, export_status);
+    ThreadJoiner export_joiner{ export_thread };
+    std::cout << "Exporting " << params.output_filename << "." << params.output_format
+              << " in the background..." << std::endl;
+
+    std::cout << "Starting interactive viewer... (Close window to exit)" << std::endl;
+    view->GetInteractor()->Start();
+
+    export_thread.join();
+    if (!export_status->reported) {
+        report_async_export(*export_status);
+    }
+    if (!export_status->error.empty()) {
+        throw std::runtime_error("Failed to export plot: " + export_status->error);
+    }
+}
+
+// Function to compute the Förster spectral overlap of every donor (input
+// files, emission) with every acceptor (overlap_acceptors, absorption) on the
+// shared grid. Each donor is normalized to unit area and pre-multiplied by the
+// trapezoid weights and lambda^4 (nm) or nu^-4 (eV, cm-1), so the whole
+// N_donor x N_acceptor matrix is one blocked matrix product with the acceptor
+// molar absorptivities. J is in M^-1 cm^-1 nm^4 for nm grids, else M^-1 cm^3.
+int run_overlap(const PlotSpecParams& params) {
+    const std::vector<std::string>& donor_files = params.input_filenames;
+    const std::vector<std::string>& acceptor_files = params.overlap_acceptors.empty() ? params.input_filenames
+                                                                                      : params.overlap_acceptors;
+    std::vector<double> grid = make_grid(params);
+    const size_t n_points = grid.size();
+    if (n_points < 2) {
+        throw std::runtime_error("Mode 'overlap' needs at least two grid points");
+    }
+
+    std::vector<double> quadrature(n_points);
+    std::vector<double> weights(n_points);
+    for (size_t k = 0; k < n_points; ++k) {
+        double left = grid[k > 0 ? k - 1 : k];
+        double right = grid[k + 1 < n_points ? k + 1 : k];
+        quadrature[k] = 0.5 * std::abs(right - left);
+        double factor = params.unit == "nm" ? std::pow(grid[k], 4)
+                                            : std::pow(x_to_wavenumber(grid[k], params.unit), -4);
+        weights[k] = quadrature[k] * factor;
+    }
+
+    std::cout << "Overlap: " << donor_files.size() << " donors x " << acceptor_files.size() << " acceptors, "
+              << n_points << " grid points" << std::endl;
+
+    PlotSpecParams donor_params = params;
+    donor_params.mode = "emi";
+    std::vector<double> donors(donor_files.size() * n_points);
+    for (size_t d = 0; d < donor_files.size(); ++d) {
+        std::vector<double> emission = calculate_single_spectrum(donor_files[d], donor_params).y_values;
+        double area = 0.0;
+        for (size_t k = 0; k < n_points; ++k) {
+            area += quadrature[k] * emission[k];
+        }
+        if (area <= 0.0) {
+            throw std::runtime_error("Donor emission vanishes on the plotted range: " + donor_files[d]);
+        }
+        for (size_t k = 0; k < n_points; ++k) {
+            donors[d * n_points + k] = emission[k] / area * weights[k];
+        }
+    }
+
+    PlotSpecParams acceptor_params = params;
+    acceptor_params.mode = "abs";
+    std::vector<double> acceptors(acceptor_files.size() * n_points);
+    for (size_t a = 0; a < acceptor_files.size(); ++a) {
+        std::vector<double> absorption = calculate_single_spectrum(acceptor_files[a], acceptor_params).y_values;
+        std::copy(absorption.begin(), absorption.end(), acceptors.begin() + a * n_points);
+    }
+
+    std::vector<double> overlap;
+    matrix_multiply_transposed(donors, donor_files.size(), acceptors, acceptor_files.size(), n_points, overlap);
+
+    std::string matrix_path = params.output_filename + "_overlap.bin";
+    write_matrix_binary(matrix_path, donor_files.size(), acceptor_files.size(), overlap);
+    std::cout << "Overlap matrix written to " << matrix_path << std::endl;
+
+    size_t n_top = std::min(overlap.size(), static_cast<size_t>(params.overlap_top_pairs));
+    std::vector<size_t> order(overlap.size());
+    std::iota(order.begin(), order.end(), size_t(0));
+    std::partial_sort(order.begin(), order.begin() + n_top, order.end(),
+                      [&](size_t lhs, size_t rhs) { return overlap[lhs] > overlap[rhs]; });
+
+    std::string top_path = params.output_filename + "_overlap_top.csv";
+    std::string temp_path = top_path + ".partial";
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write file: " + top_path);
+        }
+        out << std::setprecision(10) << "rank,donor,acceptor,J (" << (params.unit == "nm" ? "M^-1 cm^-1 nm^4" : "M^-1 cm^3")
+            << ")\n";
+        for (size_t r = 0; r < n_top; ++r) {
+            size_t d = order[r] / acceptor_files.size();
+            size_t a = order[r] % acceptor_files.size();
+            out << (r + 1) << "," << donor_files[d] << "," << acceptor_files[a] << "," << overlap[order[r]] << "\n";
+        }
+    }
+    std::filesystem::rename(temp_path, top_path);
+    std::cout << "Top " << n_top << " pairs written to " << top_path << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// One merge of a hierarchical clustering. Leaves are 0..n-1 and the cluster
+// formed by merge m is n + m, as in SciPy linkage matrices.
+struct ClusterMerge {
+    size_t left;
+    size_t right;
+    double distance;
+    size_t size;
+};
+
+// Function to cluster n items agglomeratively with the nearest-neighbour chain
+// algorithm in O(n^2) time. Distances are read from, and updated by the
+// Lance-Williams formula in, the strict upper triangle of the row-major n x n
+// matrix; the diagonal and the lower triangle are left untouched, so no second
+// matrix is needed. Returns the merges sorted by distance.
+std::vector<ClusterMerge> hierarchical_clustering(std::vector<double>& matrix, size_t n, const std::string& linkage) {
+    auto distance = [&](size_t i, size_t j) -> double& { return i < j ? matrix[i * n + j] : matrix[j * n + i]; };
+
+    std::vector<bool> active(n, true);
+    std::vector<size_t> size(n, 1);
+    std::vector<ClusterMerge> merges; // between the slots holding each cluster
+    merges.reserve(n > 0 ? n - 1 : 0);
+    std::vector<size_t> chain;
+    size_t first_active = 0;
+    while (merges.size() + 1 < n) {
+        if (chain.empty()) {
+            while (!active[first_active]) ++first_active;
+            chain.push_back(first_active);
+        }
+        size_t a = chain.back();
+        size_t previous = chain.size() >= 2 ? chain[chain.size() - 2] : n;
+        size_t b = previous;
+        double best = previous < n ? distance(a, previous) : std::numeric_limits<double>::infinity();
+        for (size_t k = 0; k < n; ++k) {
+            if (active[k] && k != a && distance(a, k) < best) {
+                best = distance(a, k);
+                b = k;
+            }
+        }
+        if (b != previous || previous == n) {
+            chain.push_back(b);
+            continue;
+        }
+
+        // Reciprocal nearest neighbours: merge a into the slot of b
+        chain.resize(chain.size() - 2);
+        merges.push_back({a, b, best, size[a] + size[b]});
+        for (size_t k = 0; k < n; ++k) {
+            if (!active[k] || k == a || k == b) continue;
+            double d_a = distance(k, a);
+            double d_b = distance(k, b);
+            if (linkage == "single") {
+                distance(k, b) = std::min(d_a, d_b);
+            } else if (linkage == "complete") {
+                distance(k, b) = std::max(d_a, d_b);
+            } else {
+                distance(k, b) = (size[a] * d_a + size[b] * d_b) / (size[a] + size[b]);
+            }
+        }
+        active[a] = false;
+        size[b] += size[a];
+    }
+
+    // Order by distance and relabel the slots as cluster ids
+    std::stable_sort(merges.begin(), merges.end(),
+                     [](const ClusterMerge& lhs, const ClusterMerge& rhs) { return lhs.distance < rhs.distance; });
+    std::vector<size_t> parent(n);
+    std::iota(parent.begin(), parent.end(), size_t(0));
+    std::vector<size_t> cluster_id = parent;
+    auto find_root = [&](size_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+    for (size_t m = 0; m < merges.size(); ++m) {
+        size_t root_left = find_root(merges[m].left);
+        size_t root_right = find_root(merges[m].right);
+        merges[m].left = cluster_id[root_left];
+        merges[m].right = cluster_id[root_right];
+        parent[root_left] = root_right;
+        cluster_id[root_right] = n + m;
+    }
+    return merges;
+}
+
+// Function to get the leaves of a dendrogram from left to right
+std::vector<size_t> dendrogram_leaf_order(const std::vector<ClusterMerge>& merges, size_t n) {
+    std::vector<size_t> order;
+    order.reserve(n);
+    std::vector<size_t> stack = { merges.empty() ? 0 : n + merges.size() - 1 };
+    while (!stack.empty()) {
+        size_t node = stack.back();
+        stack.pop_back();
+        if (node < n) {
+            order.push_back(node);
+        } else {
+            stack.push_back(merges[node - n].right);
+            stack.push_back(merges[node - n].left);
+        }
+    }
+    return order;
+}
+
+// Function to compare every pair of input spectra, computed in mode
+// similarity_spectrum. Each spectrum becomes one row of a contiguous matrix,
+// scaled to unit length (and mean-centered first for Pearson), so the whole
+// similarity matrix is one blocked product of that matrix with itself.
+// Clustering runs in place on the same matrix, with distance 1 - similarity.
+int run_similarity(const PlotSpecParams& params) {
+    const size_t n = params.input_filenames.size();
+    PlotSpecParams spectrum_params = params;
+    spectrum_params.mode = params.similarity_spectrum;
+
+    std::cout << "Similarity: " << n << " " << params.similarity_spectrum << " spectra, "
+              << params.similarity_metric << " metric" << std::endl;
+
+    std::vector<double> spectra;
+    size_t n_points = 0;
+    for (size_t i = 0; i < n; ++i) {
+        std::vector<double> y = calculate_single_spectrum(params.input_filenames[i], spectrum_params).y_values;
+        if (i == 0) {
+            n_points = y.size();
+            spectra.resize(n * n_points);
+        }
+        if (params.similarity_metric == "pearson") {
+            double mean = std::accumulate(y.begin(), y.end(), 0.0) / n_points;
+            for (double& value : y) {
+                value -= mean;
+            }
+        }
+        double norm = std::sqrt(std::inner_product(y.begin(), y.end(), y.begin(), 0.0));
+        if (norm == 0.0) {
+            throw std::runtime_error("Spectrum is constant on the plotted range: " + params.input_filenames[i]);
+        }
+        for (size_t k = 0; k < n_points; ++k) {
+            spectra[i * n_points + k] = y[k] / norm;
+        }
+    }
+
+    std::vector<double> similarity;
+    matrix_multiply_transposed(spectra, n, spectra, n, n_points, similarity);
+    std::vector<double>().swap(spectra);
+
+    std::string matrix_path = params.output_filename + "_similarity.bin";
+    write_matrix_binary(matrix_path, n, n, similarity);
+    std::cout << "Similarity matrix written to " << matrix_path << std::endl;
+
+    std::vector<size_t> order;
+    if (params.similarity_linkage != "none") {
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = i + 1; j < n; ++j) {
+                similarity[i * n + j] = 1.0 - similarity[i * n + j];
+            }
+        }
+        std::vector<ClusterMerge> merges = hierarchical_clustering(similarity, n, params.similarity_linkage);
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = i + 1; j < n; ++j) {
+                similarity[i * n + j] = similarity[j * n + i];
+            }
+        }
+        order = dendrogram_leaf_order(merges, n);
+
+        std::string tree_path = params.output_filename + "_similarity_tree.csv";
+        std::string temp_path = tree_path + ".partial";
+        {
+            std::ofstream out(temp_path, std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Cannot write file: " + tree_path);
+            }
+            out << std::setprecision(10) << "merge,left,right,distance,size\n";
+            for (size_t m = 0; m < merges.size(); ++m) {
+                out << (n + m) << "," << merges[m].left << "," << merges[m].right << "," << merges[m].distance << ","
+                    << merges[m].size << "\n";
+            }
+        }
+        std::filesystem::rename(temp_path, tree_path);
+        std::cout << "Dendrogram (" << params.similarity_linkage << " linkage) written to " << tree_path << std::endl;
+    }
+
+    if (params.similarity_heatmap) {
+        std::vector<double> labels(n);
+        std::iota(labels.begin(), labels.end(), 0.0);
+        std::string heatmap_path = params.output_filename + "_similarity.csv";
+        write_matrix_csv(heatmap_path, "spectrum", labels, labels, similarity, order);
+        std::cout << "Heatmap written to " << heatmap_path << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Function to evaluate the CIE 1931 2-degree color-matching functions with the
+// multi-lobe Gaussian fit of Wyman, Sloan and Shirley (JCGT 2, 2013)
+void cie_color_matching(double nm, double xyz[3]) {
+    auto lobe = [nm](double mean, double sigma_below, double sigma_above) {
+        double t = (nm - mean) / (nm < mean ? sigma_below : sigma_above);
+        return std::exp(-0.5 * t * t);
+    };
+    xyz[0] = 1.056 * lobe(599.8, 37.9, 31.0) + 0.362 * lobe(442.0, 16.0, 26.7) - 0.065 * lobe(501.1, 20.4, 26.2);
+    xyz[1] = 0.821 * lobe(568.8, 46.9, 40.5) + 0.286 * lobe(530.9, 16.3, 31.1);
+    xyz[2] = 1.217 * lobe(437.0, 11.8, 36.0) + 0.681 * lobe(459.0, 26.0, 13.8);
+}
+
+// Function to get the relative spectral power of an illuminant: tabulated D65
+// (interpolated, zero outside 380-780 nm), a 2856 K Planckian for A, or the
+// equal-energy illuminant E
+double illuminant_power(const std::string& illuminant, double nm) {
+    if (illuminant == "E") {
+        return 1.0;
+    } else if (illuminant == "A") {
+        auto planck = [](double wavelength) {
+            return std::pow(wavelength, -5.0) / std::expm1(PLANCK_C2_NM_K / (wavelength * COLOR_A_TEMPERATURE_K));
+        };
+        return 100.0 * planck(nm) / planck(560.0);
+    }
+    const size_t n_table = sizeof(COLOR_D65_SPD) / sizeof(COLOR_D65_SPD[0]);
+    double position = (nm - COLOR_VISIBLE_MIN_NM) / COLOR_D65_STEP_NM;
+    if (position < 0.0 || position > n_table - 1) {
+        return 0.0;
+    }
+    size_t index = std::min(static_cast<size_t>(position), n_table - 2);
+    double fraction = position - index;
+    return (1.0 - fraction) * COLOR_D65_SPD[index] + fraction * COLOR_D65_SPD[index + 1];
+}
+
+// Function to convert XYZ to CIELAB relative to a white point
+void xyz_to_lab(const double xyz[3], const double white[3], double lab[3]) {
+    auto f = [](double t) {
+        const double delta = 6.0 / 29.0;
+        return t > delta * delta * delta ? std::cbrt(t) : t / (3.0 * delta * delta) + 4.0 / 29.0;
+    };
+    double fx = f(xyz[0] / white[0]);
+    double fy = f(xyz[1] / white[1]);
+    double fz = f(xyz[2] / white[2]);
+    lab[0] = 116.0 * fy - 16.0;
+    lab[1] = 500.0 * (fx - fy);
+    lab[2] = 200.0 * (fy - fz);
+}
+
+// Function to convert XYZ seen under a white point to linear sRGB, adapting
+// the white point to D65 with the Bradford transform
+void xyz_to_linear_srgb(const double xyz[3], const double white[3], double rgb[3]) {
+    static const double bradford[3][3] = { { 0.8951, 0.2664, -0.1614 },
+                                           { -0.7502, 1.7135, 0.0367 },
+                                           { 0.0389, -0.0685, 1.0296 } };
+    static const double bradford_inverse[3][3] = { { 0.9869929, -0.1470543, 0.1599627 },
+                                                   { 0.4323053, 0.5183603, 0.0492912 },
+                                                   { -0.0085287, 0.0400428, 0.9684867 } };
+    static const double xyz_to_srgb[3][3] = { { 3.2404542, -1.5371385, -0.4985314 },
+                                              { -0.9692660, 1.8760108, 0.0415560 },
+                                              { 0.0556434, -0.2040259, 1.0572252 } };
+    double cone[3];
+    double cone_white[3];
+    double cone_target[3];
+    for (int r = 0; r < 3; ++r) {
+        cone[r] = cone_white[r] = cone_target[r] = 0.0;
+        for (int c = 0; c < 3; ++c) {
+            cone[r] += bradford[r][c] * xyz[c];
+            cone_white[r] += bradford[r][c] * white[c];
+            cone_target[r] += bradford[r][c] * SRGB_WHITE_XYZ[c];
+        }
+        cone[r] *= cone_target[r] / cone_white[r];
+    }
+    double adapted[3];
+    for (int r = 0; r < 3; ++r) {
+        adapted[r] = 0.0;
+        for (int c = 0; c < 3; ++c) {
+            adapted[r] += bradford_inverse[r][c] * cone[c];
+        }
+    }
+    for (int r = 0; r < 3; ++r) {
+        rgb[r] = 0.0;
+        for (int c = 0; c < 3; ++c) {
+            rgb[r] += xyz_to_srgb[r][c] * adapted[c];
+        }
+    }
+}
+
+// Function to encode a linear sRGB channel as an 8-bit value, clipping colors
+// outside the gamut
+int srgb_encode(double linear) {
+    linear = std::clamp(linear, 0.0, 1.0);
+    double encoded = linear <= 0.0031308 ? 12.92 * linear : 1.055 * std::pow(linear, 1.0 / 2.4) - 0.055;
+    return static_cast<int>(std::lround(255.0 * encoded));
+}
+
+// Function to compute the perceived color of every input spectrum: light
+// transmitted through an absorber under an illuminant (abs, scaled to
+// color_peak_absorbance) or the emitted light itself (emi, normalized to the
+// brightest displayable color). The color-matching functions, illuminant and
+// quadrature weights form a 3 x N_points matrix, so the tristimulus values of
+// all spectra are one batched product. Writes XYZ, Lab and sRGB per spectrum
+// and an SVG swatch sheet.
+int run_color(const PlotSpecParams& params) {
+    const size_t n = params.input_filenames.size();
+    const bool emission = params.color_spectrum == "emi";
+    std::vector<double> grid = make_grid(params);
+    const size_t n_points = grid.size();
+
+    std::vector<double> wavelength(n_points);
+    for (size_t k = 0; k < n_points; ++k) {
+        wavelength[k] = 1.0e7 / x_to_wavenumber(grid[k], params.unit);
+    }
+    auto [shortest, longest] = std::minmax_element(wavelength.begin(), wavelength.end());
+    if (n_points < 2 || *shortest > COLOR_VISIBLE_MIN_NM || *longest < COLOR_VISIBLE_MAX_NM) {
+        throw std::runtime_error("Mode 'color' needs a grid covering 380-780 nm");
+    }
+
+    // Weighted color-matching functions, one row per tristimulus value
+    std::vector<double> weights(3 * n_points);
+    double white[3] = { 0.0, 0.0, 0.0 };
+    for (size_t k = 0; k < n_points; ++k) {
+        double left = wavelength[k > 0 ? k - 1 : k];
+        double right = wavelength[k + 1 < n_points ? k + 1 : k];
+        double step = 0.5 * std::abs(right - left);
+        double power = emission ? 1.0 : illuminant_power(params.color_illuminant, wavelength[k]);
+        double cmf[3];
+        cie_color_matching(wavelength[k], cmf);
+        for (int c = 0; c < 3; ++c) {
+            weights[c * n_points + k] = cmf[c] * power * step;
+            white[c] += weights[c * n_points + k];
+        }
+    }
+    if (emission) {
+        std::copy(SRGB_WHITE_XYZ, SRGB_WHITE_XYZ + 3, white);
+    } else {
+        // Normalize to Y = 1 for the unfiltered illuminant
+        double white_y = white[1];
+        for (double& weight : weights) {
+            weight /= white_y;
+        }
+        for (double& component : white) {
+            component /= white_y;
+        }
+    }
+
+    std::cout << "Color: " << n << " " << (emission ? "emission" : "absorption") << " spectra";
+    if (!emission) {
+        std::cout << " under illuminant " << params.color_illuminant;
+    }
+    std::cout << std::endl;
+
+    PlotSpecParams spectrum_params = params;
+    spectrum_params.mode = params.color_spectrum;
+    std::vector<double> spectra(n * n_points);
+    for (size_t i = 0; i < n; ++i) {
+        std::vector<double> y = calculate_single_spectrum(params.input_filenames[i], spectrum_params).y_values;
+        double* row = &spectra[i * n_points];
+        if (emission) {
+            // The line shape is a density per cm-1; |d nu / d lambda| = 1e7 / lambda^2 makes it per nm
+            for (size_t k = 0; k < n_points; ++k) {
+                row[k] = y[k] * 1.0e7 / (wavelength[k] * wavelength[k]);
+            }
+        } else {
+            double peak = *std::max_element(y.begin(), y.end());
+            double scale = peak > 0.0 ? params.color_peak_absorbance / peak : 0.0;
+            for (size_t k = 0; k < n_points; ++k) {
+                row[k] = std::pow(10.0, -scale * y[k]);
+            }
+        }
+    }
+
+    std::vector<double> tristimulus;
+    matrix_multiply_transposed(spectra, n, weights, 3, n_points, tristimulus);
+
+    std::vector<std::array<int, 3>> swatches(n);
+    std::string table_path = params.output_filename + "_color.csv";
+    std::string temp_path = table_path + ".partial";
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write file: " + table_path);
+        }
+        out << std::setprecision(6) << "file,X,Y,Z,L,a,b,R,G,B,hex\n";
+        for (size_t i = 0; i < n; ++i) {
+            double* xyz = &tristimulus[3 * i];
+            double rgb[3];
+            if (emission) {
+                if (xyz[1] <= 0.0) {
+                    std::cerr << "Warning: no visible emission in " << params.input_filenames[i] << std::endl;
+                } else {
+                    double luminance = xyz[1];
+                    for (int c = 0; c < 3; ++c) {
+                        xyz[c] /= luminance;
+                    }
+                }
+                xyz_to_linear_srgb(xyz, white, rgb);
+                double brightest = std::max({ rgb[0], rgb[1], rgb[2] });
+                for (double& channel : rgb) {
+                    channel = brightest > 0.0 ? channel / brightest : 0.0;
+                }
+            } else {
+                xyz_to_linear_srgb(xyz, white, rgb);
+            }
+            double lab[3];
+            xyz_to_lab(xyz, white, lab);
+
+            std::ostringstream hex;
+            hex << "#" << std::hex << std::uppercase << std::setfill('0');
+            for (int c = 0; c < 3; ++c) {
+                swatches[i][c] = srgb_encode(rgb[c]);
+                hex << std::setw(2) << swatches[i][c];
+            }
+            out << params.input_filenames[i] << "," << xyz[0] << "," << xyz[1] << "," << xyz[2] << "," << lab[0] << ","
+                << lab[1] << "," << lab[2] << "," << swatches[i][0] << "," << swatches[i][1] << "," << swatches[i][2]
+                << "," << hex.str() << "\n";
+        }
+    }
+    std::filesystem::rename(temp_path, table_path);
+    std::cout << "Colors written to " << table_path << std::endl;
+
+    // Swatch sheet: one labelled square per spectrum, in input order
+    const size_t columns = std::min<size_t>(n, 8);
+    const size_t rows = (n + columns - 1) / columns;
+    const int cell = 120;
+    const int label_height = 24;
+    std::string sheet_path = params.output_filename + "_swatches.svg";
+    temp_path = sheet_path + ".partial";
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write file: " + sheet_path);
+        }
+        out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << columns * cell << "\" height=\""
+            << rows * (cell + label_height) << "\">\n";
+        for (size_t i = 0; i < n; ++i) {
+            size_t x = (i % columns) * cell;
+            size_t y = (i / columns) * (cell + label_height);
+            std::string label = i < params.legend_names.size() ? params.legend_names[i] : params.input_filenames[i];
+            std::string escaped;
+            for (char ch : label) {
+                escaped += ch == '&' ? "&amp;" : ch == '<' ? "&lt;" : ch == '>' ? "&gt;" : std::string(1, ch);
+            }
+            out << "  <rect x=\"" << x + 4 << "\" y=\"" << y + 4 << "\" width=\"" << cell - 8 << "\" height=\""
+                << cell - 8 << "\" fill=\"rgb(" << swatches[i][0] << "," << swatches[i][1] << "," << swatches[i][2]
+                << ")\" stroke=\"#808080\"/>\n";
+            out << "  <text x=\"" << x + cell / 2 << "\" y=\"" << y + cell + label_height / 2 + 4
+                << "\" font-family=\"Arial\" font-size=\"12\" text-anchor=\"middle\">" << escaped << "</text>\n";
+        }
+        out << "</svg>\n";
+    }
+    std::filesystem::rename(temp_path, sheet_path);
+    std::cout << "Swatch sheet written to " << sheet_path << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Function to evaluate a sum of area-normalized Gaussians (sorted positions,
+// as in broaden_sticks) at one wavenumber, visiting only the sticks in reach
+double gaussian_mixture(const std::vector<double>& positions, const std::vector<double>& weights, double sigma,
+                        double wavenumber) {
+    const double window = GAUSSIAN_WINDOW_SIGMAS * sigma;
+    auto first = std::lower_bound(positions.begin(), positions.end(), wavenumber - window);
+    auto last = std::upper_bound(first, positions.end(), wavenumber + window);
+    double sum = 0.0;
+    for (auto it = first; it != last; ++it) {
+        double delta = (wavenumber - *it) / sigma;
+        sum += weights[static_cast<size_t>(it - positions.begin())] * std::exp(-0.5 * delta * delta);
+    }
+    return sum / (sigma * std::sqrt(2.0 * PI));
+}
+
+// Function to find the maximum of a positive Gaussian mixture on [low, high]
+// (cm-1) without a grid: mean-shift iterations from every stick in the range
+// climb to the local maxima, which are compared with the range ends
+double gaussian_mixture_maximum(const std::vector<double>& positions, const std::vector<double>& weights, double sigma,
+                                double low, double high, double& height) {
+    const double window = GAUSSIAN_WINDOW_SIGMAS * sigma;
+    double best = low;
+    height = gaussian_mixture(positions, weights, sigma, low);
+    double high_value = gaussian_mixture(positions, weights, sigma, high);
+    if (high_value > height) {
+        best = high;
+        height = high_value;
+    }
+    auto begin = std::lower_bound(positions.begin(), positions.end(), low);
+    auto end = std::upper_bound(begin, positions.end(), high);
+    for (auto start = begin; start != end; ++start) {
+        double x = *start;
+        for (size_t iteration = 0; iteration < DESCRIPTOR_MAX_ITERATIONS; ++iteration) {
+            auto first = std::lower_bound(positions.begin(), positions.end(), x - window);
+            auto last = std::upper_bound(first, positions.end(), x + window);
+            double sum = 0.0;
+            double moment = 0.0;
+            for (auto it = first; it != last; ++it) {
+                double delta = (x - *it) / sigma;
+                double g = weights[static_cast<size_t>(it - positions.begin())] * std::exp(-0.5 * delta * delta);
+                sum += g;
+                moment += g * *it;
+            }
+            double next = sum > 0.0 ? moment / sum : x;
+            bool converged = std::abs(next - x) < DESCRIPTOR_TOLERANCE_SIGMA * sigma;
+            x = next;
+            if (converged) break;
+        }
+        x = std::clamp(x, low, high);
+        double value = gaussian_mixture(positions, weights, sigma, x);
+        if (value > height) {
+            best = x;
+            height = value;
+        }
+    }
+    return best;
+}
+
+// Function to compute the descriptor table of every input file straight from
+// its excited states: the absorption line shape of mode abs is handled as a
+// Gaussian mixture, so peak, onset and band integrals are found analytically
+// or by local root finding and no grid is built. Files are parsed in parallel
+// into one column per descriptor; a file that fails leaves empty cells. The
+// peaks descriptor broadens on the plot grid and writes a separate long table.
+int run_descriptors(const PlotSpecParams& params) {
+    const size_t n = params.input_filenames.size();
+    const std::set<std::string> wanted(params.descriptors.begin(), params.descriptors.end());
+    const double sigma = params.fwhm_cm_minus_1 * FWHM_TO_SIGMA;
+    const double window_start = x_to_wavenumber(params.x_start, params.unit);
+    const double window_end = x_to_wavenumber(params.x_end, params.unit);
+    const double window_low = std::min(window_start, window_end);
+    const double window_high = std::max(window_start, window_end);
+    const std::string unit_suffix = params.unit == "cm-1" ? "cm" : params.unit;
+
+    std::vector<std::string> column_names;
+    auto add_column = [&](const std::string& descriptor, const std::string& name) {
+        if (wanted.count(descriptor)) column_names.push_back(name);
+    };
+    add_column("peak", "peak_" + unit_suffix);
+    add_column("peak_height", "peak_height");
+    add_column("onset", "onset_" + unit_suffix);
+    add_column("f_total", "f_total");
+    add_column("s1", "s1_" + unit_suffix);
+    add_column("s1", "s1_f");
+    if (wanted.count("bands")) {
+        for (const auto& band : params.descriptor_bands) {
+            std::ostringstream name;
+            name << "band_" << band[0] << "_" << band[1];
+            column_names.push_back(name.str());
+        }
+    }
+    std::vector<std::vector<double>> columns(column_names.size(),
+                                             std::vector<double>(n, std::numeric_limits<double>::quiet_NaN()));
+    std::vector<std::string> cd_signs(n);
+    std::vector<std::string> peak_rows(n);
+    std::vector<std::string> errors(n);
+    const std::vector<double> grid = wanted.count("peaks") ? make_grid(params) : std::vector<double>();
+
+    std::cout << "Descriptors: " << n << " files, " << column_names.size() + wanted.count("cd_signs")
+              << " columns" << std::endl;
+
+    PlotSpecParams abs_params = params;
+    abs_params.mode = "abs";
+    parallel_for_chunks(n, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            try {
+                std::string full_filename = resolve_input_filename(params.input_filenames[i]);
+                ExcitedStateStore states = params.soc_states ? parse_bdf_soc_states(full_filename)
+                                                             : parse_bdf_excited_states(full_filename);
+                if (params.soc_states && params.soc_merge_tolerance_ev > 0.0) {
+                    merge_spin_sublevels(states, params.soc_merge_tolerance_ev, 0.0);
+                }
+                if (states.size() == 0) {
+                    throw std::runtime_error("No excited states found");
+                }
+
+                std::vector<double> positions(states.size());
+                std::vector<double> strengths(states.size());
+                for (size_t k = 0; k < states.size(); ++k) {
+                    positions[k] = states.energy_ev[k] * EV_TO_CM_MINUS_1;
+                    strengths[k] = stick_strength(states, k, abs_params);
+                }
+
+                size_t column = 0;
+                double height = 0.0;
+                double peak = gaussian_mixture_maximum(positions, strengths, sigma, window_low, window_high, height);
+                if (wanted.count("peak")) {
+                    columns[column++][i] = wavenumber_to_x(peak, params.unit);
+                }
+                if (wanted.count("peak_height")) {
+                    columns[column++][i] = height;
+                }
+                if (wanted.count("onset")) {
+                    // Red edge: first crossing of the threshold from the low-energy end
+                    double threshold = params.descriptor_onset_fraction * height;
+                    double step = 0.25 * sigma;
+                    double low = std::max(window_low, positions.front() - GAUSSIAN_WINDOW_SIGMAS * sigma);
+                    double high = low;
+                    while (high < peak && gaussian_mixture(positions, strengths, sigma, high) < threshold) {
+                        low = high;
+                        high = std::min(peak, high + step);
+                    }
+                    for (size_t iteration = 0; iteration < DESCRIPTOR_MAX_ITERATIONS &&
+                                               high - low > DESCRIPTOR_TOLERANCE_SIGMA * sigma; ++iteration) {
+                        double middle = 0.5 * (low + high);
+                        if (gaussian_mixture(positions, strengths, sigma, middle) < threshold) {
+                            low = middle;
+                        } else {
+                            high = middle;
+                        }
+                    }
+                    columns[column++][i] = wavenumber_to_x(high, params.unit);
+                }
+                if (wanted.count("f_total")) {
+                    columns[column++][i] = std::accumulate(states.osc_strength.begin(), states.osc_strength.end(), 0.0);
+                }
+                if (wanted.count("s1")) {
+                    columns[column++][i] = wavenumber_to_x(positions.front(), params.unit);
+                    columns[column++][i] = states.osc_strength.front();
+                }
+                if (wanted.count("bands")) {
+                    // Integrated absorption, integral of epsilon over wavenumber (M^-1 cm^-2)
+                    for (const auto& band : params.descriptor_bands) {
+                        double band_start = x_to_wavenumber(band[0], params.unit);
+                        double band_end = x_to_wavenumber(band[1], params.unit);
+                        double band_low = std::min(band_start, band_end);
+                        double band_high = std::max(band_start, band_end);
+                        double integral = 0.0;
+                        for (size_t k = 0; k < states.size(); ++k) {
+                            integral += 0.5 * strengths[k] *
+                                        (std::erf((band_high - positions[k]) / (std::sqrt(2.0) * sigma)) -
+                                         std::erf((band_low - positions[k]) / (std::sqrt(2.0) * sigma)));
+                        }
+                        columns[column++][i] = integral;
+                    }
+                }
+                if (wanted.count("cd_signs")) {
+                    double largest = 0.0;
+                    for (double rotatory : states.rot_strength_vel) {
+                        largest = std::max(largest, std::abs(rotatory));
+                    }
+                    for (size_t k = 0; k < states.size() && cd_signs[i].size() < static_cast<size_t>(params.descriptor_cd_states); ++k) {
+                        double rotatory = states.rot_strength_vel[k];
+                        if (largest > 0.0 && std::abs(rotatory) >= DESCRIPTOR_CD_MIN_FRACTION * largest) {
+                            cd_signs[i] += rotatory > 0.0 ? '+' : '-';
+                        }
+                    }
+                }
+                if (wanted.count("peaks")) {
+                    SpectrumData spectrum;
+                    spectrum.x_values = grid;
+                    spectrum.y_values = broaden_sticks(positions, strengths, grid, params.unit, params.fwhm_cm_minus_1);
+                    spectrum.states = std::move(states);
+                    detect_peaks(spectrum, abs_params);
+                    std::ostringstream rows;
+                    rows << std::setprecision(8);
+                    for (size_t r = 0; r < spectrum.peaks.size(); ++r) {
+                        const auto& found = spectrum.peaks[r];
+                        rows << params.input_filenames[i] << "," << (r + 1) << "," << found.x << "," << found.height << ","
+                             << found.prominence << ",";
+                        for (size_t k = 0; k < found.states.size(); ++k) {
+                            rows << (k > 0 ? " " : "") << "S" << spectrum.states.state_number[found.states[k]];
+                        }
+                        rows << "\n";
+                    }
+                    peak_rows[i] = rows.str();
+                }
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+            }
+        }
+    });
+
+    size_t failed = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!errors[i].empty()) {
+            std::cerr << "Warning: " << params.input_filenames[i] << ": " << errors[i] << std::endl;
+            ++failed;
+        }
+    }
+
+    std::string table_path = params.output_filename + "_descriptors.csv";
+    std::string temp_path = table_path + ".partial";
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot write file: " + table_path);
+        }
+        out << std::setprecision(8) << "file";
+        for (const auto& name : column_names) {
+            out << "," << name;
+        }
+        if (wanted.count("cd_signs")) {
+            out << ",cd_signs";
+        }
+        out << "\n";
+        for (size_t i = 0; i < n; ++i) {
+            out << params.input_filenames[i];
+            for (const auto& values : columns) {
+                out << ",";
+                if (!std::isnan(values[i])) out << values[i];
+            }
+            if (wanted.count("cd_signs")) {
+                out << "," << cd_signs[i];
+            }
+            out << "\n";
+        }
+    }
+    std::filesystem::rename(temp_path, table_path);
+    std::cout << "Descriptors written to " << table_path << " (" << failed << " file(s) failed)" << std::endl;
+
+    if (wanted.count("peaks")) {
+        std::string peaks_path = params.output_filename + "_peaks.csv";
+        temp_path = peaks_path + ".partial";
+        {
+            std::ofstream out(temp_path, std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Cannot write file: " + peaks_path);
+            }
+            out << "file,rank,x (" << params.unit << "),height,prominence,states\n";
+            for (const auto& rows : peak_rows) {
+                out << rows;
+            }
+        }
+        std::filesystem::rename(temp_path, peaks_path);
+        std::cout << "Peaks written to " << peaks_path << std::endl;
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// One figure of a batch manifest
+struct BatchJob {
+    std::string output_filename;
+    std::vector<std::string> input_filenames;
+};
+
+// Function to read a batch manifest: one job per line, the output filename
+// (no extension) followed by its input files; '#' starts a comment
+std::vector<BatchJob> read_batch_manifest(const std::string& manifest_path) {
+    std::ifstream manifest(manifest_path);
+    if (!manifest.is_open()) {
+        throw std::runtime_error("Cannot open batch manifest: " + manifest_path);
+    }
+
+    std::vector<BatchJob> jobs;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream iss(line);
+        BatchJob job;
+        if (!(iss >> job.output_filename)) continue;
+        std::string input;
+        while (iss >> input) {
+            job.input_filenames.push_back(input);
+        }
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+// Function to read the output names of jobs recorded as done in a batch journal
+std::set<std::string> read_batch_journal(const std::string& journal_path) {
+    std::set<std::string> completed;
+    std::ifstream journal(journal_path);
+    std::string line;
+    while (std::getline(journal, line)) {
+        auto fields = split_string(line, '\t');
+        if (fields.size() >= 2 && fields[0] == "done") {
+            completed.insert(fields[1]);
+        }
+    }
+    return completed;
+}
+
+// Function to run every job of a batch manifest. Each finished job is appended
+// to <manifest>.journal and flushed, so -resume after an interruption only redoes
+// unfinished jobs. A failing job is logged and the batch continues.
+int run_batch(const PlotSpecParams& base_params) {
+    std::vector<BatchJob> jobs = read_batch_manifest(base_params.batch_manifest);
+    std::string journal_path = base_params.batch_manifest + ".journal";
+
+    std::set<std::string> completed;
+    if (base_params.resume) {
+        completed = read_batch_journal(journal_path);
+    }
+    std::ofstream journal(journal_path, base_params.resume ? std::ios::app : std::ios::trunc);
+    if (!journal.is_open()) {
+        throw std::runtime_error("Cannot write batch journal: " + journal_path);
+    }
+
+    std::cout << "Batch: " << jobs.size() << " jobs from " << base_params.batch_manifest;
+    if (base_params.resume) {
+        std::cout << " (" << completed.size() << " already done)";
+    }
+    std::cout << std::endl;
+
+    size_t finished = 0;
+    size_t skipped = 0;
+    size_t failed = 0;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        const BatchJob& job = jobs[j];
+        if (completed.count(job.output_filename)) {
+            ++skipped;
+            continue;
+        }
+
+        std::cout << std::endl << "[" << (j + 1) << "/" << jobs.size() << "] " << job.output_filename << std::endl;
+        try {
+            if (job.input_filenames.empty()) {
+                throw std::runtime_error("No input files listed for " + job.output_filename);
+            }
+
+            PlotSpecParams params = base_params;
+            params.interactive = false;
+            params.output_filename = job.output_filename;
+            params.input_filenames = job.input_filenames;
+            assign_legend_names(params);
+
+            params.render_hash = compute_render_hash(params);
+            if (params.force_render || !render_is_up_to_date(params)) {
+                std::vector<SpectrumData> spectra = calculate_multiple_spectra(params);
+                apply_expressions(spectra, params);
+                if (params.export_data) {
+                    write_spectra_csv(spectra, params);
+                }
+                if (params.peak_table) {
+                    write_peak_table(spectra, params);
+                }
+                create_and_export_multiple_plots(spectra, params);
+            } else {
+                std::cout << "Output is up to date, skipping." << std::endl;
+            }
 
-    // Start interactive viewer if requested
-    if (params.interactive) {
-        std::cout << "Starting interactive viewer... (Close window to exit)" << std::endl;
-        view->GetInteractor()->Start();
+            journal << "done\t" << job.output_filename << "\n" << std::flush;
+            ++finished;
+        } catch (const std::exception& e) {
+            std::cerr << "Error in job " << job.output_filename << ": " << e.what() << std::endl;
+            journal << "failed\t" << job.output_filename << "\t" << e.what() << "\n" << std::flush;
+            ++failed;
+        }
     }
+
+    std::cout << std::endl;
+    std::cout << "Batch finished: " << finished << " done, " << skipped << " resumed, "
+              << failed << " failed." << std::endl;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char *argv[]) {
@@ -725,8 +6798,42 @@ int main(int argc, char *argv[]) {
         // Parse command line arguments
         PlotSpecParams params = parse_arguments(argc, argv);
 
+        // Table modes run once over all inputs and draw no plot
+        if (is_table_mode(params.mode)) {
+            if (!params.batch_manifest.empty()) {
+                throw std::runtime_error("Mode '" + params.mode + "' does not support -batch");
+            }
+            if (params.mode == "overlap") {
+                return run_overlap(params);
+            } else if (params.mode == "similarity") {
+                return run_similarity(params);
+            } else if (params.mode == "color") {
+                return run_color(params);
+            }
+            return run_descriptors(params);
+        }
+
+        if (!params.batch_manifest.empty()) {
+            return run_batch(params);
+        }
+
+        // Skip compute and render when the output matches its stored hash
+        params.render_hash = compute_render_hash(params);
+        if (!params.interactive && !params.force_render && render_is_up_to_date(params)) {
+            std::cout << "Output " << params.output_filename << "." << params.output_format
+                      << " is up to date, skipping." << std::endl;
+            return EXIT_SUCCESS;
+        }
+
         // Calculate spectra from BDF files
         std::vector<SpectrumData> spectra = calculate_multiple_spectra(params);
+        apply_expressions(spectra, params);
+        if (params.export_data) {
+            write_spectra_csv(spectra, params);
+        }
+        if (params.peak_table) {
+            write_peak_table(spectra, params);
+        }
 
         // Create plot and export
         create_and_export_multiple_plots(spectra, params);